@@ -0,0 +1,254 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/kmalloc.h>
+#include <newbos/paging.h>
+#include <newbos/printk.h>
+
+#include "acpi.h"
+
+/*
+ * The RSDP is on a 16 byte boundary in the first KB of the EBDA, whose
+ * segment is stored at 0x40E, or in the BIOS area below 1 MB. Both are in
+ * the identity mapped low memory.
+ */
+#define EBDA_SEGMENT_PADDR 0x40E
+#define BIOS_AREA_START    0xE0000
+#define BIOS_AREA_END      0x100000
+
+#define MADT_LOCAL_APIC    0
+#define MADT_CPU_ENABLED   0x1
+
+struct rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_paddr;
+} __attribute__((packed));
+
+struct sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct madt {
+    struct sdt_header header;
+    uint32_t lapic_paddr;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_local_apic {
+    struct madt_entry entry;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+static uint8_t
+checksum(
+    void const *data,
+    uint32_t len)
+{
+    uint8_t const *p = data;
+    uint8_t sum = 0;
+
+    while (len-- > 0)
+    {
+        sum += *p++;
+    }
+    return sum;
+}
+
+static struct rsdp *
+scan_rsdp(
+    uint32_t start,
+    uint32_t end)
+{
+    uint32_t a;
+    for (a = start; a + sizeof(struct rsdp) <= end; a += 16)
+    {
+        struct rsdp *rsdp = (struct rsdp *) a;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 &&
+            checksum(rsdp, sizeof(struct rsdp)) == 0)
+        {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Copies len bytes at physical address paddr, which may be anywhere in
+ * memory, a page at a time.
+ */
+static int
+read_physical(
+    uint32_t paddr,
+    void *buf,
+    uint32_t len)
+{
+    uint8_t *dst = buf;
+
+    while (len > 0)
+    {
+        uint32_t offset = paddr & (PAGE_SIZE - 1);
+        uint32_t n = PAGE_SIZE - offset;
+        uint8_t *page;
+
+        if (n > len)
+        {
+            n = len;
+        }
+
+        page = kmap_frame(paddr - offset);
+        if (page == NULL)
+        {
+            return -1;
+        }
+        memcpy(dst, page + offset, n);
+        kunmap_frame(page);
+
+        paddr += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Returns a kmalloc'd copy of the table at paddr, NULL if it can't be read
+ * or its checksum is wrong.
+ */
+static struct sdt_header *
+read_table(
+    uint32_t paddr)
+{
+    struct sdt_header header, *table;
+
+    if (read_physical(paddr, &header, sizeof(header)) != 0 ||
+        header.length < sizeof(header))
+    {
+        return NULL;
+    }
+
+    table = kmalloc(header.length);
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    if (read_physical(paddr, table, header.length) != 0 ||
+        checksum(table, header.length) != 0)
+    {
+        kfree(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void
+parse_madt(
+    struct madt *madt,
+    struct acpi_madt *out)
+{
+    uint8_t *p = (uint8_t *) (madt + 1);
+    uint8_t *end = (uint8_t *) madt + madt->header.length;
+
+    out->lapic_paddr = madt->lapic_paddr;
+    out->num_cpus = 0;
+
+    while (p + sizeof(struct madt_entry) <= end)
+    {
+        struct madt_entry *e = (struct madt_entry *) p;
+        if (e->length < sizeof(struct madt_entry) || p + e->length > end)
+        {
+            break;
+        }
+
+        if (e->type == MADT_LOCAL_APIC &&
+            e->length >= sizeof(struct madt_local_apic))
+        {
+            struct madt_local_apic *lapic = (struct madt_local_apic *) e;
+            if ((lapic->flags & MADT_CPU_ENABLED) &&
+                out->num_cpus < MAX_CPUS)
+            {
+                out->apic_ids[out->num_cpus++] = lapic->apic_id;
+            }
+        }
+        p += e->length;
+    }
+}
+
+int
+acpi_find_madt(
+    struct acpi_madt *out)
+{
+    uint16_t ebda_segment;
+    uint32_t ebda;
+    struct rsdp *rsdp = NULL;
+    struct sdt_header *rsdt;
+    uint32_t i, num_tables;
+    int ret = -1;
+
+    memcpy(&ebda_segment, (void const *) EBDA_SEGMENT_PADDR,
+           sizeof(ebda_segment));
+    ebda = (uint32_t) ebda_segment << 4;
+    if (ebda != 0)
+    {
+        rsdp = scan_rsdp(ebda, ebda + 1024);
+    }
+    if (rsdp == NULL)
+    {
+        rsdp = scan_rsdp(BIOS_AREA_START, BIOS_AREA_END);
+    }
+    if (rsdp == NULL)
+    {
+        printk("acpi_find_madt: No RSDP.\n");
+        return -1;
+    }
+
+    rsdt = read_table(rsdp->rsdt_paddr);
+    if (rsdt == NULL || memcmp(rsdt->signature, "RSDT", 4) != 0)
+    {
+        printk("acpi_find_madt: Bad RSDT. paddr: %X\n", rsdp->rsdt_paddr);
+        kfree(rsdt);
+        return -1;
+    }
+
+    num_tables = (rsdt->length - sizeof(struct sdt_header)) / 4;
+    for (i = 0; i < num_tables && ret != 0; ++i)
+    {
+        uint32_t paddr = ((uint32_t *) (rsdt + 1))[i];
+        struct sdt_header header;
+
+        if (read_physical(paddr, &header, sizeof(header)) != 0 ||
+            memcmp(header.signature, "APIC", 4) != 0)
+        {
+            continue;
+        }
+
+        struct sdt_header *madt = read_table(paddr);
+        if (madt != NULL && madt->length >= sizeof(struct madt))
+        {
+            parse_madt((struct madt *) madt, out);
+            ret = 0;
+        }
+        kfree(madt);
+    }
+
+    kfree(rsdt);
+    return ret;
+}
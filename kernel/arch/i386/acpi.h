@@ -0,0 +1,27 @@
+#ifndef _NEWBOS_ACPI_H
+#define _NEWBOS_ACPI_H
+
+#include <stdint.h>
+
+#include <newbos/smp.h>
+
+/*
+ * What the MADT, the ACPI table listing interrupt controllers, says about
+ * the CPUs.
+ */
+struct acpi_madt {
+    uint32_t lapic_paddr;
+    uint32_t num_cpus;
+    uint8_t apic_ids[MAX_CPUS];
+};
+
+/*
+ * Returns 0 and fills in madt if the firmware provides a MADT. Only enabled
+ * CPUs are listed, the first MAX_CPUS of them.
+ */
+int
+acpi_find_madt(
+    struct acpi_madt *madt
+);
+
+#endif
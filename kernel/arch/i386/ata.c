@@ -0,0 +1,249 @@
+#include <stddef.h>
+
+#include <newbos/block.h>
+#include <newbos/printk.h>
+
+#include "ata.h"
+#include "io.h"
+
+/*
+ * Primary ATA bus, driven with polled PIO. The device interrupt is masked,
+ * every transfer busy-waits on the status register.
+ */
+#define ATA_DATA        0x1F0
+#define ATA_ERROR       0x1F1
+#define ATA_SECTOR_CNT  0x1F2
+#define ATA_LBA_LOW     0x1F3
+#define ATA_LBA_MID     0x1F4
+#define ATA_LBA_HIGH    0x1F5
+#define ATA_DRIVE       0x1F6
+#define ATA_COMMAND     0x1F7
+#define ATA_STATUS      0x1F7
+#define ATA_CONTROL     0x3F6
+
+#define ATA_STATUS_ERR  0x01
+#define ATA_STATUS_DRQ  0x08
+#define ATA_STATUS_DF   0x20
+#define ATA_STATUS_BSY  0x80
+
+#define ATA_CMD_READ_PIO    0x20
+#define ATA_CMD_WRITE_PIO   0x30
+#define ATA_CMD_CACHE_FLUSH 0xE7
+#define ATA_CMD_IDENTIFY    0xEC
+
+#define ATA_CONTROL_NIEN    0x02
+
+#define ATA_MAX_SECTORS 256 /* per command, a count of 0 means 256 */
+#define WORDS_PER_SECTOR (BLOCK_SECTOR_SIZE / 2)
+
+static int
+ata_read(struct block_device *dev, uint32_t sector, uint32_t count,
+         void *buf);
+
+static int
+ata_write(struct block_device *dev, uint32_t sector, uint32_t count,
+          void const *buf);
+
+static struct block_device ata_primary_master = {
+    "ata0",
+    0,
+    ata_read,
+    ata_write,
+};
+
+static int
+ata_wait_not_busy(
+    void)
+{
+    uint8_t status;
+    while ((status = inb(ATA_STATUS)) & ATA_STATUS_BSY);
+
+    if (status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ata_wait_data(
+    void)
+{
+    uint8_t status;
+    do
+    {
+        status = inb(ATA_STATUS);
+        if (status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+        {
+            return -1;
+        }
+    } while ((status & ATA_STATUS_BSY) || !(status & ATA_STATUS_DRQ));
+
+    return 0;
+}
+
+static void
+ata_select(
+    uint32_t sector,
+    uint32_t count)
+{
+    /*
+     * 28 bit LBA addressing of the master drive.
+     */
+    outb(ATA_DRIVE, 0xE0 | ((sector >> 24) & 0x0F));
+    outb(ATA_SECTOR_CNT, (uint8_t) count);
+    outb(ATA_LBA_LOW, (uint8_t) sector);
+    outb(ATA_LBA_MID, (uint8_t) (sector >> 8));
+    outb(ATA_LBA_HIGH, (uint8_t) (sector >> 16));
+}
+
+static int
+ata_read(
+    struct block_device *dev,
+    uint32_t sector,
+    uint32_t count,
+    void *buf)
+{
+    uint16_t *words = (uint16_t *) buf;
+    uint32_t i, n;
+
+    if (sector + count > dev->num_sectors)
+    {
+        return -1;
+    }
+
+    while (count > 0)
+    {
+        n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+
+        if (ata_wait_not_busy() != 0)
+        {
+            return -1;
+        }
+        ata_select(sector, n);
+        outb(ATA_COMMAND, ATA_CMD_READ_PIO);
+
+        for (i = 0; i < n * WORDS_PER_SECTOR; ++i)
+        {
+            if (i % WORDS_PER_SECTOR == 0 && ata_wait_data() != 0)
+            {
+                printk("ata_read: Error reading sector %u\n",
+                       sector + i / WORDS_PER_SECTOR);
+                return -1;
+            }
+            *words++ = inw(ATA_DATA);
+        }
+
+        sector += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int
+ata_write(
+    struct block_device *dev,
+    uint32_t sector,
+    uint32_t count,
+    void const *buf)
+{
+    uint16_t const *words = (uint16_t const *) buf;
+    uint32_t i, n;
+
+    if (sector + count > dev->num_sectors)
+    {
+        return -1;
+    }
+
+    while (count > 0)
+    {
+        n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+
+        if (ata_wait_not_busy() != 0)
+        {
+            return -1;
+        }
+        ata_select(sector, n);
+        outb(ATA_COMMAND, ATA_CMD_WRITE_PIO);
+
+        for (i = 0; i < n * WORDS_PER_SECTOR; ++i)
+        {
+            if (i % WORDS_PER_SECTOR == 0 && ata_wait_data() != 0)
+            {
+                printk("ata_write: Error writing sector %u\n",
+                       sector + i / WORDS_PER_SECTOR);
+                return -1;
+            }
+            outw(ATA_DATA, *words++);
+        }
+
+        outb(ATA_COMMAND, ATA_CMD_CACHE_FLUSH);
+        if (ata_wait_not_busy() != 0)
+        {
+            return -1;
+        }
+
+        sector += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+struct block_device *
+ata_init(
+    void)
+{
+    uint16_t identity[WORDS_PER_SECTOR];
+    uint32_t i;
+    uint8_t status;
+
+    outb(ATA_CONTROL, ATA_CONTROL_NIEN);
+
+    outb(ATA_DRIVE, 0xA0);
+    outb(ATA_SECTOR_CNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+
+    status = inb(ATA_STATUS);
+    if (status == 0 || status == 0xFF)
+    {
+        /*
+         * No drive, or no controller at all (floating bus).
+         */
+        return NULL;
+    }
+
+    while (inb(ATA_STATUS) & ATA_STATUS_BSY);
+
+    if (inb(ATA_LBA_MID) != 0 || inb(ATA_LBA_HIGH) != 0)
+    {
+        /*
+         * Not an ATA drive, e.g. ATAPI.
+         */
+        return NULL;
+    }
+
+    if (ata_wait_data() != 0)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < WORDS_PER_SECTOR; ++i)
+    {
+        identity[i] = inw(ATA_DATA);
+    }
+
+    /*
+     * Words 60 and 61 hold the number of sectors addressable with LBA28.
+     */
+    ata_primary_master.num_sectors =
+        identity[60] | ((uint32_t) identity[61] << 16);
+
+    printk("ata0: %u sectors\n", ata_primary_master.num_sectors);
+
+    return &ata_primary_master;
+}
@@ -0,0 +1,15 @@
+#ifndef _NEWBOS_ATA_H
+#define _NEWBOS_ATA_H
+
+#include <newbos/block.h>
+
+/*
+ * Probes the master drive on the primary ATA bus. Returns NULL if there is
+ * none.
+ */
+struct block_device *
+ata_init(
+    void
+);
+
+#endif
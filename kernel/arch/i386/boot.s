@@ -142,6 +142,7 @@ enable_paging:
 
     mov %cr0, %ecx        # read current config from cr0
     or  $0x80000000, %ecx # the highest bit controls paging
+    or  $0x00010000, %ecx # WP, the kernel can't write read-only pages either
     mov %ecx, %cr0        # enable paging by writing config to cr0
 
     lea higher_half, %ecx # store the address higher_half in ecx
@@ -0,0 +1,82 @@
+#include <string.h>
+
+#include <newbos/kstack.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+
+#include "double_fault.h"
+#include "interrupts.h"
+
+#define DOUBLE_FAULT_STACK_SIZE 0x1000
+
+#define SEGSEL_KERNEL_CS 0x08
+#define SEGSEL_KERNEL_DS 0x10
+
+/*
+ * Interrupts stay disabled in the task.
+ */
+#define DOUBLE_FAULT_EFLAGS 0x002
+
+/*
+ * Present task gate.
+ */
+#define TASK_GATE_FLAGS 0x85
+
+uint32_t read_cr2(void);
+uint32_t read_cr3(void);
+
+static struct tss tss[MAX_CPUS];
+
+static uint8_t stacks[MAX_CPUS][DOUBLE_FAULT_STACK_SIZE]
+    __attribute__((aligned(16)));
+
+/*
+ * Runs as a task of its own; the state of the faulting code was saved to
+ * the CPU's TSS on the switch. There's nothing to go back to.
+ */
+static void
+double_fault_task(
+    void)
+{
+    struct tss *t = (struct tss *) tss_init();
+    struct process *p = scheduler_current_process();
+
+    printk("Double fault - cpu: %u, eip: %X, esp: %X, cr2: %X\n",
+           smp_cpu_id(), t->eip, t->esp, read_cr2());
+
+    if (kstack_guard_hit(t->esp) || kstack_guard_hit(read_cr2()))
+    {
+        printk("Kernel stack overflow - pid: %u\n", p != NULL ? p->id : 0);
+    }
+
+    halt_forever();
+}
+
+uint32_t
+double_fault_tss(
+    void)
+{
+    return (uint32_t) &tss[smp_cpu_id()];
+}
+
+void
+double_fault_init_cpu(
+    void)
+{
+    uint32_t cpu = smp_cpu_id();
+    struct tss *t = &tss[cpu];
+
+    memset(t, 0, sizeof(struct tss));
+    t->eip = (uint32_t) double_fault_task;
+    t->eflags = DOUBLE_FAULT_EFLAGS;
+    t->esp = (uint32_t) (stacks[cpu] + DOUBLE_FAULT_STACK_SIZE);
+    t->cs = SEGSEL_KERNEL_CS;
+    t->ss = t->ds = t->es = t->fs = t->gs = SEGSEL_KERNEL_DS;
+    t->cr3 = read_cr3();
+    t->io_map_base = sizeof(struct tss);
+
+    idt_set_gate(8, 0, DOUBLE_FAULT_TSS_SEGSEL, TASK_GATE_FLAGS,
+                 IDT_DPL_KERNEL);
+}
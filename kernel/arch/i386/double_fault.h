@@ -0,0 +1,30 @@
+#ifndef _NEWBOS_DOUBLE_FAULT_H
+#define _NEWBOS_DOUBLE_FAULT_H
+
+#include <stdint.h>
+
+/*
+ * GDT selector of the double fault task of each CPU, see gdt.c.
+ */
+#define DOUBLE_FAULT_TSS_SEGSEL (6*8)
+
+/*
+ * The TSS of the calling CPU's double fault task.
+ */
+uint32_t
+double_fault_tss(
+    void
+);
+
+/*
+ * Sets up the calling CPU's double fault task, once paging is set up for
+ * good. A fault while the CPU delivers another one, like a page fault on a
+ * kernel stack that ran into its guard page, switches to that task, on a
+ * stack of its own, to report it.
+ */
+void
+double_fault_init_cpu(
+    void
+);
+
+#endif
@@ -0,0 +1,239 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <newbos/fpu.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+
+#include "interrupts.h"
+
+/*
+ * Device not available, raised by FPU instructions while CR0.TS is set.
+ */
+#define NM_VECTOR 7
+
+/*
+ * x87 and SSE floating point errors, raised with CR0.NE and CR4.OSXMMEXCPT
+ * set for unmasked exceptions.
+ */
+#define MF_VECTOR 16
+#define XM_VECTOR 19
+
+/*
+ * CPUID leaf 1 feature flags, in edx.
+ */
+#define CPUID_FPU  0x00000001
+#define CPUID_FXSR 0x01000000
+#define CPUID_SSE  0x02000000
+
+#define CR0_MP 0x00000002 /* FPU instructions trap while TS is set */
+#define CR0_EM 0x00000004 /* no FPU, emulate it */
+#define CR0_NE 0x00000020 /* report FPU errors with #MF */
+
+#define CR4_OSFXSR     0x00000200 /* FXSAVE and SSE instructions allowed */
+#define CR4_OSXMMEXCPT 0x00000400 /* report SSE errors with #XM */
+
+/*
+ * MXCSR after reset: all SSE exceptions masked.
+ */
+#define MXCSR_DEFAULT 0x1F80
+
+uint32_t cpuid_features(void);
+uint32_t read_cr0(void);
+void write_cr0(uint32_t value);
+uint32_t read_cr4(void);
+void write_cr4(uint32_t value);
+void fpu_clear_ts(void);
+void fpu_set_ts(void);
+void fpu_fninit(void);
+void fpu_ldmxcsr(uint32_t const *mxcsr);
+void fpu_fxsave(void *area);
+void fpu_fxrstor(void *area);
+void fpu_fnsave(void *area);
+void fpu_frstor(void *area);
+
+static uint32_t features;
+
+/*
+ * What a process starts out with the first time it uses the FPU.
+ */
+static struct fpu_state initial_state;
+
+/*
+ * The process whose registers each CPU's FPU holds, and whether the running
+ * process used the FPU since it was switched in. A process that gets the
+ * FPU back on the CPU it last used it on, with nobody else using it in
+ * between, doesn't need its registers restored.
+ */
+static struct process *owner[MAX_CPUS];
+static uint8_t in_use[MAX_CPUS];
+
+static void *
+state_area(
+    struct fpu_state *s)
+{
+    return (void *) (((uint32_t) s->area + 15) & ~15u);
+}
+
+static void
+save(
+    struct fpu_state *s)
+{
+    if (features & CPUID_FXSR)
+    {
+        fpu_fxsave(state_area(s));
+    }
+    else
+    {
+        fpu_fnsave(state_area(s));
+    }
+}
+
+static void
+restore(
+    struct fpu_state *s)
+{
+    if (features & CPUID_FXSR)
+    {
+        fpu_fxrstor(state_area(s));
+    }
+    else
+    {
+        fpu_frstor(state_area(s));
+    }
+}
+
+static void
+fpu_trap_handler(
+    registers_t *regs)
+{
+    uint32_t cpu = smp_cpu_id();
+    struct process *p = scheduler_current_process();
+
+    (void) regs;
+
+    fpu_clear_ts();
+    in_use[cpu] = 1;
+
+    if (p->fpu_used && p->fpu_cpu == cpu && owner[cpu] == p)
+    {
+        return;
+    }
+
+    restore(p->fpu_used ? &p->fpu : &initial_state);
+    p->fpu_used = 1;
+    p->fpu_cpu = cpu;
+    owner[cpu] = p;
+}
+
+/*
+ * An unmasked floating point exception. The kernel doesn't use the FPU, so
+ * it's a process's; there are no signals to deliver it with, so the process
+ * is stopped for good instead: nothing ever wakes it again.
+ */
+static void
+fpu_error_handler(
+    registers_t *regs)
+{
+    struct process *p = scheduler_current_process();
+
+    printk("Floating point exception - pid: %u, eip: %X, vector: %u\n",
+           p->id, regs->eip, regs->interrupt_number);
+
+    if ((regs->cs & 0x03) != 0x03)
+    {
+        abort();
+    }
+
+    for (;;)
+    {
+        scheduler_block();
+    }
+}
+
+void
+fpu_init_cpu(
+    void)
+{
+    uint32_t cr4 = read_cr4();
+
+    if (!(features & CPUID_FPU))
+    {
+        return;
+    }
+
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+    if (features & CPUID_FXSR)
+    {
+        cr4 |= CR4_OSFXSR;
+    }
+    if (features & CPUID_SSE)
+    {
+        cr4 |= CR4_OSXMMEXCPT;
+    }
+    write_cr4(cr4);
+
+    fpu_clear_ts();
+    fpu_fninit();
+    fpu_set_ts();
+}
+
+void
+fpu_init(
+    void)
+{
+    static uint32_t const mxcsr = MXCSR_DEFAULT;
+
+    features = cpuid_features();
+    if (!(features & CPUID_FPU))
+    {
+        printk("fpu_init: No FPU.\n");
+        return;
+    }
+
+    fpu_init_cpu();
+
+    fpu_clear_ts();
+    if (features & CPUID_SSE)
+    {
+        fpu_ldmxcsr(&mxcsr);
+    }
+    save(&initial_state);
+    fpu_set_ts();
+
+    register_isr_handler(NM_VECTOR, fpu_trap_handler);
+    register_trap_handler(MF_VECTOR, fpu_error_handler);
+    register_trap_handler(XM_VECTOR, fpu_error_handler);
+
+    printk("fpu_init: FPU enabled. fxsr: %u, sse: %u\n",
+           (features & CPUID_FXSR) ? 1 : 0, (features & CPUID_SSE) ? 1 : 0);
+}
+
+void
+fpu_switch(
+    struct process *prev)
+{
+    uint32_t cpu = smp_cpu_id();
+
+    if (!in_use[cpu])
+    {
+        /*
+         * The FPU is still disabled, prev didn't touch it.
+         */
+        return;
+    }
+
+    /*
+     * Saved right away rather than when another process wants the FPU,
+     * prev may be picked up by another CPU before that.
+     */
+    save(&prev->fpu);
+    if (!(features & CPUID_FXSR))
+    {
+        owner[cpu] = NULL;
+    }
+    in_use[cpu] = 0;
+    fpu_set_ts();
+}
@@ -0,0 +1,102 @@
+.section .text
+.align 4
+
+/*
+ * Returns the feature flags CPUID leaf 1 leaves in edx.
+ */
+.global cpuid_features
+.type cpuid_features, @function
+cpuid_features:
+    push %ebx             # cpuid clobbers ebx, which is callee saved
+    mov $1, %eax
+    cpuid
+    mov %edx, %eax
+    pop %ebx
+    ret
+
+.global read_cr0
+.type read_cr0, @function
+read_cr0:
+    mov %cr0, %eax
+    ret
+
+.global write_cr0
+.type write_cr0, @function
+write_cr0:
+    mov 4(%esp), %eax
+    mov %eax, %cr0
+    ret
+
+.global write_cr4
+.type write_cr4, @function
+write_cr4:
+    mov 4(%esp), %eax
+    mov %eax, %cr4
+    ret
+
+/*
+ * Clears CR0.TS, so FPU instructions don't trap anymore.
+ */
+.global fpu_clear_ts
+.type fpu_clear_ts, @function
+fpu_clear_ts:
+    clts
+    ret
+
+/*
+ * Sets CR0.TS, so the next FPU instruction traps with #NM.
+ */
+.global fpu_set_ts
+.type fpu_set_ts, @function
+fpu_set_ts:
+    mov %cr0, %eax
+    or  $0x00000008, %eax
+    mov %eax, %cr0
+    ret
+
+.global fpu_fninit
+.type fpu_fninit, @function
+fpu_fninit:
+    fninit
+    ret
+
+.global fpu_ldmxcsr
+.type fpu_ldmxcsr, @function
+fpu_ldmxcsr:
+    mov 4(%esp), %eax
+    ldmxcsr (%eax)
+    ret
+
+/*
+ * The FXSAVE image has to be 16 byte aligned.
+ */
+.global fpu_fxsave
+.type fpu_fxsave, @function
+fpu_fxsave:
+    mov 4(%esp), %eax
+    fxsave (%eax)
+    ret
+
+.global fpu_fxrstor
+.type fpu_fxrstor, @function
+fpu_fxrstor:
+    mov 4(%esp), %eax
+    fxrstor (%eax)
+    ret
+
+/*
+ * x87 state only, for CPUs without FXSAVE. fnsave reinitializes the FPU.
+ */
+.global fpu_fnsave
+.type fpu_fnsave, @function
+fpu_fnsave:
+    mov 4(%esp), %eax
+    fnsave (%eax)
+    ret
+
+.global fpu_frstor
+.type fpu_frstor, @function
+fpu_frstor:
+    mov 4(%esp), %eax
+    frstor (%eax)
+    ret
@@ -1,5 +1,7 @@
 #include <newbos/process.h>
+#include <newbos/smp.h>
 
+#include "double_fault.h"
 #include "gdt.h"
 
 #define SEGMENT_BASE    0
@@ -11,7 +13,7 @@
 #define CODE_RX_TYPE    0xA
 #define DATA_RW_TYPE    0x2
 
-#define GDT_NUM_ENTRIES 6
+#define GDT_NUM_ENTRIES 7
 
 #define TSS_SEGSEL      (5*8)
 
@@ -20,10 +22,14 @@
  */
 void gdt_flush(uint32_t);
 
-static void gdt_set_gate(uint32_t num, uint8_t plevel, uint8_t type);
+struct gdt_entry;
+
+static void gdt_set_gate(struct gdt_entry *gdt_entries, uint32_t num,
+                         uint8_t plevel, uint8_t type);
 
 static void
-gdt_create_tss_entry(uint32_t n, uint32_t tss_vaddr);
+gdt_create_tss_entry(struct gdt_entry *gdt_entries, uint32_t n,
+                     uint32_t tss_vaddr);
 
 /*
  * This structure contains the value of one GDT entry.
@@ -51,22 +57,27 @@ struct gdt_ptr
     uint32_t base;           /* Address to the first gdt entry */
 } __attribute__((packed));
 
-struct gdt_entry gdt_entries[GDT_NUM_ENTRIES];
+/*
+ * Every CPU has its own GDT, they only differ in the TSS entry.
+ */
+struct gdt_entry gdt_entries[MAX_CPUS][GDT_NUM_ENTRIES];
 
 void
 gdt_init(uint32_t tss_vaddr)
 {
+    struct gdt_entry *gdt = gdt_entries[smp_cpu_id()];
     struct gdt_ptr gdt_ptr;
     gdt_ptr.limit = sizeof(struct gdt_entry) * GDT_NUM_ENTRIES;
-    gdt_ptr.base = (uint32_t)&gdt_entries;
+    gdt_ptr.base = (uint32_t)gdt;
 
-    gdt_set_gate(0, 0, 0);              /* Null segment */
-    gdt_set_gate(1, PL0, CODE_RX_TYPE); /* Code segment */
-    gdt_set_gate(2, PL0, DATA_RW_TYPE); /* Data segment */
-    gdt_set_gate(3, PL3, CODE_RX_TYPE); /* User mode code segment */
-    gdt_set_gate(4, PL3, DATA_RW_TYPE); /* User mode data segment */
+    gdt_set_gate(gdt, 0, 0, 0);              /* Null segment */
+    gdt_set_gate(gdt, 1, PL0, CODE_RX_TYPE); /* Code segment */
+    gdt_set_gate(gdt, 2, PL0, DATA_RW_TYPE); /* Data segment */
+    gdt_set_gate(gdt, 3, PL3, CODE_RX_TYPE); /* User mode code segment */
+    gdt_set_gate(gdt, 4, PL3, DATA_RW_TYPE); /* User mode data segment */
 
-    gdt_create_tss_entry(5, tss_vaddr);
+    gdt_create_tss_entry(gdt, 5, tss_vaddr);
+    gdt_create_tss_entry(gdt, 6, double_fault_tss()); /* See double_fault.h */
 
     gdt_flush((uint32_t)&gdt_ptr);
 
@@ -77,7 +88,8 @@ gdt_init(uint32_t tss_vaddr)
  * Set the value of one GDT entry.
  */
 static void
-gdt_set_gate(uint32_t num, uint8_t plevel, uint8_t type)
+gdt_set_gate(struct gdt_entry *gdt_entries, uint32_t num, uint8_t plevel,
+             uint8_t type)
 {
     gdt_entries[num].base_low = (SEGMENT_BASE & 0xFFFF);
     gdt_entries[num].base_mid = (SEGMENT_BASE >> 16) & 0xFF;
@@ -109,7 +121,8 @@ gdt_set_gate(uint32_t num, uint8_t plevel, uint8_t type)
 }
 
 static void
-gdt_create_tss_entry(uint32_t n, uint32_t tss_vaddr)
+gdt_create_tss_entry(struct gdt_entry *gdt_entries, uint32_t n,
+                     uint32_t tss_vaddr)
 {
     gdt_entries[n].base_low     = (tss_vaddr & 0xFFFF);
     gdt_entries[n].base_mid     = (tss_vaddr >> 16) & 0xFF;
@@ -2,6 +2,9 @@
 #include <string.h>
 
 #include <newbos/printk.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/softirq.h>
 
 #include "interrupts.h"
 #include "io.h"
@@ -11,7 +14,8 @@ idt_entry_t idt_entries[256];
 extern void idt_flush(uint32_t);
 
 void
-idt_set_gate(uint8_t number, uint32_t base, uint16_t selector, uint8_t flags)
+idt_set_gate(uint8_t number, uint32_t base, uint16_t selector, uint8_t flags,
+             uint8_t dpl)
 
 {
     idt_entries[number].base_lo = base & 0xFFFF;
@@ -19,9 +23,7 @@ idt_set_gate(uint8_t number, uint32_t base, uint16_t selector, uint8_t flags)
 
     idt_entries[number].selector = selector;
     idt_entries[number].always0 = 0;
-    // We must uncomment the OR below when we get to using user-mode.
-    // It sets the interrupt gate's privilege level to 3.
-    idt_entries[number].flags = flags | 0x60;
+    idt_entries[number].flags = flags | dpl;
 }
 
 void
@@ -35,7 +37,17 @@ clear_idt()
 
 typedef void (*isr_t)(registers_t*);
 
-isr_t exception_handlers[32];
+isr_t exception_handlers[256];
+
+/*
+ * Vectors whose handler runs without the kernel lock.
+ */
+static uint8_t unlocked_vectors[256];
+
+/*
+ * Vectors whose handler runs like process code, see register_trap_handler().
+ */
+static uint8_t trap_vectors[256];
 
 extern void isr0();
 extern void isr1();
@@ -69,6 +81,12 @@ extern void isr28();
 extern void isr29();
 extern void isr30();
 extern void isr31();
+extern void isr128();
+extern void isr129();
+extern void isr64();
+extern void isr252();
+extern void isr253();
+extern void isr255();
 
 char* exception_messages[] =
 {
@@ -110,45 +128,72 @@ char* exception_messages[] =
 static void
 init_isr()
 {
-    memset(&exception_handlers, 0, sizeof(isr_t)*32);
-
-    idt_set_gate(0, (uint32_t)isr0, 0x08, 0x8E);
-    idt_set_gate(1, (uint32_t)isr1, 0x08, 0x8E);
-    idt_set_gate(2, (uint32_t)isr2, 0x08, 0x8E);
-    idt_set_gate(3, (uint32_t)isr3, 0x08, 0x8E);
-    idt_set_gate(4, (uint32_t)isr4, 0x08, 0x8E);
-    idt_set_gate(5, (uint32_t)isr5, 0x08, 0x8E);
-    idt_set_gate(6, (uint32_t)isr6, 0x08, 0x8E);
-    idt_set_gate(7, (uint32_t)isr7, 0x08, 0x8E);
-    idt_set_gate(8, (uint32_t)isr8, 0x08, 0x8E);
-    idt_set_gate(9, (uint32_t)isr9, 0x08, 0x8E);
-    idt_set_gate(10, (uint32_t)isr10, 0x08, 0x8E);
-    idt_set_gate(11, (uint32_t)isr11, 0x08, 0x8E);
-    idt_set_gate(12, (uint32_t)isr12, 0x08, 0x8E);
-    idt_set_gate(13, (uint32_t)isr13, 0x08, 0x8E);
-    idt_set_gate(14, (uint32_t)isr14, 0x08, 0x8E);
-    idt_set_gate(15, (uint32_t)isr15, 0x08, 0x8E);
-    idt_set_gate(16, (uint32_t)isr16, 0x08, 0x8E);
-    idt_set_gate(17, (uint32_t)isr17, 0x08, 0x8E);
-    idt_set_gate(18, (uint32_t)isr18, 0x08, 0x8E);
-    idt_set_gate(19, (uint32_t)isr19, 0x08, 0x8E);
-    idt_set_gate(20, (uint32_t)isr20, 0x08, 0x8E);
-    idt_set_gate(21, (uint32_t)isr21, 0x08, 0x8E);
-    idt_set_gate(22, (uint32_t)isr22, 0x08, 0x8E);
-    idt_set_gate(23, (uint32_t)isr23, 0x08, 0x8E);
-    idt_set_gate(24, (uint32_t)isr24, 0x08, 0x8E);
-    idt_set_gate(25, (uint32_t)isr25, 0x08, 0x8E);
-    idt_set_gate(26, (uint32_t)isr26, 0x08, 0x8E);
-    idt_set_gate(27, (uint32_t)isr27, 0x08, 0x8E);
-    idt_set_gate(28, (uint32_t)isr28, 0x08, 0x8E);
-    idt_set_gate(29, (uint32_t)isr29, 0x08, 0x8E);
-    idt_set_gate(30, (uint32_t)isr30, 0x08, 0x8E);
-    idt_set_gate(31, (uint32_t)isr31, 0x08, 0x8E);
+    memset(&exception_handlers, 0, sizeof(isr_t)*256);
+
+    idt_set_gate(0, (uint32_t)isr0, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(1, (uint32_t)isr1, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(2, (uint32_t)isr2, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(3, (uint32_t)isr3, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(4, (uint32_t)isr4, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(5, (uint32_t)isr5, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(6, (uint32_t)isr6, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(7, (uint32_t)isr7, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(8, (uint32_t)isr8, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(9, (uint32_t)isr9, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(10, (uint32_t)isr10, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(11, (uint32_t)isr11, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(12, (uint32_t)isr12, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(13, (uint32_t)isr13, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(14, (uint32_t)isr14, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(15, (uint32_t)isr15, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(16, (uint32_t)isr16, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(17, (uint32_t)isr17, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(18, (uint32_t)isr18, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(19, (uint32_t)isr19, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(20, (uint32_t)isr20, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(21, (uint32_t)isr21, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(22, (uint32_t)isr22, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(23, (uint32_t)isr23, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(24, (uint32_t)isr24, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(25, (uint32_t)isr25, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(26, (uint32_t)isr26, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(27, (uint32_t)isr27, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(28, (uint32_t)isr28, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(29, (uint32_t)isr29, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(30, (uint32_t)isr30, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(31, (uint32_t)isr31, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(SYSCALL_VECTOR, (uint32_t)isr128, 0x08, 0x8E, IDT_DPL_USER);
+    idt_set_gate(YIELD_VECTOR, (uint32_t)isr129, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint32_t)isr64, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(RESCHEDULE_VECTOR, (uint32_t)isr252, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(TLB_FLUSH_VECTOR, (uint32_t)isr253, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(SPURIOUS_VECTOR, (uint32_t)isr255, 0x08, 0x8E, IDT_DPL_KERNEL);
 }
 
-void
+registers_t *
 interrupt_handler(registers_t* regs)
 {
+    if (unlocked_vectors[regs->interrupt_number])
+    {
+        exception_handlers[regs->interrupt_number](regs);
+        return regs;
+    }
+
+    if (trap_vectors[regs->interrupt_number])
+    {
+        lock_kernel();
+        enable_interrupts();
+        exception_handlers[regs->interrupt_number](regs);
+        disable_interrupts();
+
+        regs = scheduler_interrupt_return(regs);
+        unlock_kernel();
+        return regs;
+    }
+
+    lock_kernel();
+    irq_enter();
+
     if (0 != exception_handlers[regs->interrupt_number])
     {
         exception_handlers[regs->interrupt_number](regs);
@@ -172,7 +217,8 @@ interrupt_handler(registers_t* regs)
                "ss: %X\n",
                regs->interrupt_number,
                regs->error_code,
-               exception_messages[regs->interrupt_number],
+               regs->interrupt_number < 32 ?
+                   exception_messages[regs->interrupt_number] : "(unknown)",
                regs->gs,
                regs->fs,
                regs->es,
@@ -192,6 +238,11 @@ interrupt_handler(registers_t* regs)
                regs->ss);
         abort();
     }
+
+    irq_exit();
+    regs = scheduler_interrupt_return(regs);
+    unlock_kernel();
+    return regs;
 }
 
 void
@@ -202,6 +253,24 @@ register_isr_handler(
     exception_handlers[number] = handler;
 }
 
+void
+register_isr_handler_unlocked(
+    int number,
+    void (*handler)(registers_t*))
+{
+    exception_handlers[number] = handler;
+    unlocked_vectors[number] = 1;
+}
+
+void
+register_trap_handler(
+    int number,
+    void (*handler)(registers_t*))
+{
+    exception_handlers[number] = handler;
+    trap_vectors[number] = 1;
+}
+
 irq_t interrupt_handlers[256];
 
 extern void irq0();
@@ -238,22 +307,22 @@ init_irq()
     outb(0x21, 0x0);
     outb(0xA1, 0x0);
 
-    idt_set_gate(32, (uint32_t)irq0, 0x08, 0x8E);
-    idt_set_gate(33, (uint32_t)irq1, 0x08, 0x8E);
-    idt_set_gate(34, (uint32_t)irq2, 0x08, 0x8E);
-    idt_set_gate(35, (uint32_t)irq3, 0x08, 0x8E);
-    idt_set_gate(36, (uint32_t)irq4, 0x08, 0x8E);
-    idt_set_gate(37, (uint32_t)irq5, 0x08, 0x8E);
-    idt_set_gate(38, (uint32_t)irq6, 0x08, 0x8E);
-    idt_set_gate(39, (uint32_t)irq7, 0x08, 0x8E);
-    idt_set_gate(40, (uint32_t)irq8, 0x08, 0x8E);
-    idt_set_gate(41, (uint32_t)irq9, 0x08, 0x8E);
-    idt_set_gate(42, (uint32_t)irq10, 0x08, 0x8E);
-    idt_set_gate(43, (uint32_t)irq11, 0x08, 0x8E);
-    idt_set_gate(44, (uint32_t)irq12, 0x08, 0x8E);
-    idt_set_gate(45, (uint32_t)irq13, 0x08, 0x8E);
-    idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
-    idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
+    idt_set_gate(32, (uint32_t)irq0, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(33, (uint32_t)irq1, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(34, (uint32_t)irq2, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(35, (uint32_t)irq3, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(36, (uint32_t)irq4, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(37, (uint32_t)irq5, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(38, (uint32_t)irq6, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(39, (uint32_t)irq7, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(40, (uint32_t)irq8, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(41, (uint32_t)irq9, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(42, (uint32_t)irq10, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(43, (uint32_t)irq11, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(44, (uint32_t)irq12, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(45, (uint32_t)irq13, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E, IDT_DPL_KERNEL);
+    idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E, IDT_DPL_KERNEL);
 }
 
 void
@@ -262,7 +331,7 @@ register_irq_handler(uint8_t n, irq_t handler)
     interrupt_handlers[n] = handler;
 }
 
-void
+registers_t *
 irq_handler(registers_t* regs)
 {
     if (regs->interrupt_number >= 40)
@@ -274,11 +343,22 @@ irq_handler(registers_t* regs)
     // send reset signal to master.
     outb(0x20, 0x20);
 
+    lock_kernel();
+    irq_enter();
+
     if (interrupt_handlers[regs->interrupt_number] != 0)
     {
         irq_t handler = interrupt_handlers[regs->interrupt_number];
         handler(regs);
     }
+
+    /*
+     * Runs the bottom halves the handler left, with interrupts enabled.
+     */
+    irq_exit();
+    regs = scheduler_interrupt_return(regs);
+    unlock_kernel();
+    return regs;
 }
 
 void
@@ -291,3 +371,9 @@ interrupts_init()
 
     printk("Interrupts enabled.\n");
 }
+
+void
+interrupts_init_ap()
+{
+    idt_flush((uint32_t)&idt_ptr);
+}
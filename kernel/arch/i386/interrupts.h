@@ -44,12 +44,33 @@ typedef struct registers
     uint32_t eip, cs, eflags, useresp, ss;
 } registers_t;
 
-void idt_set_gate(uint8_t number, uint32_t base, uint16_t selector, uint8_t flags);
+/*
+ * Lowest privilege a gate can be raised from with int n. Exceptions and
+ * hardware interrupts get through whatever it is.
+ */
+#define IDT_DPL_KERNEL 0x00
+#define IDT_DPL_USER   0x60
 
-void interrupt_handler(registers_t* regs);
+void idt_set_gate(uint8_t number, uint32_t base, uint16_t selector, uint8_t flags,
+                  uint8_t dpl);
+
+registers_t *interrupt_handler(registers_t* regs);
 
 void register_isr_handler(int number, void (*handler)(registers_t*));
 
+/*
+ * Handlers registered this way run without the kernel lock and return
+ * straight to the interrupted code, they must not touch shared state.
+ */
+void register_isr_handler_unlocked(int number, void (*handler)(registers_t*));
+
+/*
+ * Handlers registered this way run as part of the interrupted process, with
+ * the kernel lock held and interrupts enabled. They may block, and aren't
+ * accounted as interrupts.
+ */
+void register_trap_handler(int number, void (*handler)(registers_t*));
+
 #define IRQ0 32
 #define IRQ1 33
 #define IRQ2 34
@@ -67,16 +88,51 @@ void register_isr_handler(int number, void (*handler)(registers_t*));
 #define IRQ14 46
 #define IRQ15 47
 
+#define SYSCALL_VECTOR 0x80
+#define YIELD_VECTOR 0x81
+
+/*
+ * Local APIC interrupts, see lapic.h and smp.h.
+ */
+#define LAPIC_TIMER_VECTOR 0x40
+#define RESCHEDULE_VECTOR  0xFC
+#define TLB_FLUSH_VECTOR   0xFD
+#define SPURIOUS_VECTOR    0xFF
+
 typedef void (*irq_t)(registers_t*);
 
 void register_irq_handler(uint8_t, irq_t handler);
 
-void irq_handler(registers_t* regs);
+registers_t *irq_handler(registers_t* regs);
 
 void interrupts_init();
 
+/*
+ * Loads the IDT on a CPU other than the first.
+ */
+void interrupts_init_ap();
+
 void enable_interrupts();
 
 void disable_interrupts();
 
+/*
+ * Disables interrupts and returns the flags register from before, for
+ * restore_interrupts().
+ */
+uint32_t save_and_disable_interrupts();
+
+void restore_interrupts(uint32_t flags);
+
+/*
+ * Enables interrupts and halts until the next one, without a window for
+ * one to arrive in between.
+ */
+void enable_interrupts_and_halt();
+
+/*
+ * Disables interrupts and halts the CPU for good.
+ */
+void halt_forever();
+
 #endif
@@ -265,10 +265,68 @@ isr31:
     push $31
     jmp isr_common_stub
 
+/*
+ * System calls, see sysenter.c.
+ */
+.global isr128
+.type isr128, @function
+isr128:
+    cli
+    push $0
+    push $128
+    jmp isr_common_stub
+
+/*
+ * Software interrupt used by the kernel to give up the CPU, see
+ * scheduler_schedule().
+ */
+.global isr129
+.type isr129, @function
+isr129:
+    cli
+    push $0
+    push $129
+    jmp isr_common_stub
+
+/*
+ * Local APIC interrupts: timer, reschedule and TLB flush IPIs, spurious.
+ */
+.global isr64
+.type isr64, @function
+isr64:
+    cli
+    push $0
+    push $64
+    jmp isr_common_stub
+
+.global isr252
+.type isr252, @function
+isr252:
+    cli
+    push $0
+    push $252
+    jmp isr_common_stub
+
+.global isr253
+.type isr253, @function
+isr253:
+    cli
+    push $0
+    push $253
+    jmp isr_common_stub
+
+.global isr255
+.type isr255, @function
+isr255:
+    cli
+    push $0
+    push $255
+    jmp isr_common_stub
+
 /*
  * This is a common ISR stub. It saves the processor state, sets up for kernel
  * mode segments, calls the c-level fault hander, and finally restores the
- * stack frame.
+ * stack frame returned by the handler.
  */
 isr_common_stub:
     pusha
@@ -291,8 +349,9 @@ isr_common_stub:
 
     call    interrupt_handler
 
-    # pop pointer to structure from stack
-    add     $4, %esp
+    # switch to the frame the handler returned, which belongs to another
+    # process if it decided to reschedule
+    mov     %eax, %esp
 
     # restore data segment
     pop     %gs
@@ -442,7 +501,7 @@ irq15:
 /*
  * This is a common IRQ stub. It saves the processor state, sets up for kernel
  * mode segments, calls the c-level fault hander, and finally restores the
- * stack frame.
+ * stack frame returned by the handler.
  */
 irq_common_stub:
     pusha
@@ -465,8 +524,9 @@ irq_common_stub:
 
     call    irq_handler
 
-    # pop pointer to structure from stack
-    add     $4, %esp
+    # switch to the frame the handler returned, which belongs to another
+    # process if it decided to reschedule
+    mov     %eax, %esp
 
     # restore data segment
     pop     %gs
@@ -492,3 +552,36 @@ enable_interrupts:
 disable_interrupts:
     cli
     ret
+
+.global save_and_disable_interrupts
+.type save_and_disable_interrupts, @function
+save_and_disable_interrupts:
+    pushf
+    pop     %eax
+    cli
+    ret
+
+.global restore_interrupts
+.type restore_interrupts, @function
+restore_interrupts:
+    push    4(%esp)
+    popf
+    ret
+
+# sti only takes effect after the next instruction, so no interrupt can be
+# handled between the two
+.global enable_interrupts_and_halt
+.type enable_interrupts_and_halt, @function
+enable_interrupts_and_halt:
+    sti
+    hlt
+    ret
+
+# with interrupts disabled only an NMI gets the CPU going again
+.global halt_forever
+.type halt_forever, @function
+halt_forever:
+    cli
+1:
+    hlt
+    jmp 1b
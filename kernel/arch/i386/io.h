@@ -18,4 +18,10 @@ inw(
     uint16_t port
 );
 
+void
+outw(
+    uint16_t port,
+    uint16_t value
+);
+
 #endif
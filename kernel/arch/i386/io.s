@@ -19,3 +19,11 @@ inw:
 	mov 0x4(%esp), %dx
     in  (%dx),%ax
     ret
+
+.global outw
+.type outw, @function
+outw:
+    mov 0x4(%esp), %dx
+    mov 0x8(%esp), %ax
+    out %ax, (%dx)
+    ret
@@ -1,4 +1,5 @@
 #include <newbos/printk.h>
+#include <newbos/softirq.h>
 
 #include "interrupts.h"
 #include "io.h"
@@ -98,39 +99,79 @@ unsigned char keyboard_layout[128] =
     /* All other keys are undefined */
 };
 
+/*
+ * Scancodes read by the interrupt handler, until the tasklet gets to them.
+ * Only the first CPU gets the keyboard's interrupt and runs the tasklet.
+ */
+#define SCANCODE_BUFFER_SIZE 64
+
+static uint8_t scancodes[SCANCODE_BUFFER_SIZE];
+static volatile uint32_t scancodes_head;
+static volatile uint32_t scancodes_tail;
+
+static struct tasklet keyboard_tasklet;
+
+static void
+keyboard_tasklet_func(struct tasklet *t)
+{
+    char key[2] = { 0, 0 };
+
+    (void) t;
+
+    while (scancodes_tail != scancodes_head)
+    {
+        uint8_t scancode = scancodes[scancodes_tail % SCANCODE_BUFFER_SIZE];
+        ++scancodes_tail;
+
+        // If the top bit of the byte we read from the keyboard is set, that
+        // means the key has just been released.
+        if (scancode & 0x80)
+        {
+            // We can use this one to see if the user has just released the
+            // shift, alt, or control keys...
+            continue;
+        }
+
+        // Here, a key was just pressed. Please note that if you hold a
+        // keydown then you will get repeated key press interrupts.
+
+        // Just to show how this works we simply translate the keyboard
+        // scancode into an ASCII value, and then display it on the screen.
+        // You can get creative and use some flags to see if shift is pressed
+        // and use a different layout, or you could add another 128 entries
+        // to the above layout to correspond to 'shift' being held. If shift
+        // is held using the larger lookup table, you would add 128 to the
+        // scancode when you look for it.
+        key[0] = keyboard_layout[scancode];
+        if (key[0] != 0)
+        {
+            printk("%s", key);
+        }
+    }
+}
+
 void
 keyboard_callback(registers_t* regs)
 {
     uint8_t scancode;
 
-    // Read from the keyboard data buffer
+    (void) regs;
+
+    // Read from the keyboard data buffer, which acknowledges the key. The
+    // rest is left to the tasklet, a full buffer drops keys.
     scancode = inb(0x60);
 
-    // If the top bit of the byte we read from the keyboard is set, that means
-    // the key has just been released.
-    if (scancode & 0x80)
+    if (scancodes_head - scancodes_tail < SCANCODE_BUFFER_SIZE)
     {
-        // We can use this one to see if the user has just released the shift,
-        // alt, or control keys...
-    }
-    else
-    {
-        // Here, a key was just pressed. Please note that if you hold a keydown
-        // then you will get repeated key press interrupts.
-
-        // Just to show how this works we simply translate the keyboard
-        // scancode into an ASCII value, and then display it on the screen. You
-        // can get creative and use some flags to see if shift is pressed and
-        // use a different layout, or you could add another 128 entries to the
-        // above layout to correspond to 'shift' being held. If shift is held
-        // using the larger lookup table, you would add 128 to the scancode
-        //when you look for it.
-        printk("%s", keyboard_layout[scancode]);
+        scancodes[scancodes_head % SCANCODE_BUFFER_SIZE] = scancode;
+        ++scancodes_head;
     }
+    tasklet_schedule(&keyboard_tasklet);
 }
 
 void
 keyboard_init()
 {
+    tasklet_init(&keyboard_tasklet, keyboard_tasklet_func);
     register_irq_handler(IRQ1, keyboard_callback);
 }
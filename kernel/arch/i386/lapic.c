@@ -0,0 +1,276 @@
+#include <stddef.h>
+
+#include <newbos/clocksource.h>
+#include <newbos/paging.h>
+#include <newbos/printk.h>
+#include <newbos/timer.h>
+
+#include "interrupts.h"
+#include "lapic.h"
+#include "tsc.h"
+
+/*
+ * Register offsets, in bytes.
+ */
+#define LAPIC_ID         0x020
+#define LAPIC_TPR        0x080
+#define LAPIC_EOI        0x0B0
+#define LAPIC_SVR        0x0F0
+#define LAPIC_ESR        0x280
+#define LAPIC_ICR_LOW    0x300
+#define LAPIC_ICR_HIGH   0x310
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_LVT_LINT0  0x350
+#define LAPIC_LVT_LINT1  0x360
+#define LAPIC_LVT_ERROR  0x370
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+#define SVR_ENABLE          0x100
+#define LVT_MASKED          0x10000
+#define LVT_EXTINT          0x700
+#define LVT_NMI             0x400
+#define LVT_TIMER_DEADLINE  0x40000
+#define ICR_DELIVERY_STATUS 0x01000
+#define ICR_ALL_BUT_SELF    0xC0000
+#define TIMER_DIV_16        0x3
+
+/*
+ * PIT ticks the timer is measured over.
+ */
+#define CALIBRATE_TICKS 10
+
+#define MSR_TSC_DEADLINE 0x6E0
+
+/*
+ * Shifts of the nanoseconds to timer counts and to TSC counts conversions.
+ * Both keep mult in 32 bits for clocks up to 256 GHz, and the product in
+ * 64 bits for max_delta_ns.
+ */
+#define COUNTS_SHIFT 24
+#define DEADLINE_SHIFT 20
+
+/*
+ * Longest TSC deadline, 100 seconds.
+ */
+#define DEADLINE_MAX_DELTA_NS (100 * NSEC_PER_SEC)
+
+void write_msr(uint32_t msr, uint64_t value);
+
+/*
+ * The registers are in a page of their own. Every access is a read or
+ * write of a whole 32 bit register.
+ */
+static volatile uint32_t *lapic;
+
+/*
+ * Timer counts, with TIMER_DIV_16, in one PIT tick.
+ */
+static uint32_t timer_counts_per_tick;
+
+/*
+ * mult turning nanoseconds into timer counts, or into TSC counts in TSC
+ * deadline mode.
+ */
+static uint32_t counts_mult;
+static uint32_t deadline_mult;
+
+static uint32_t
+lapic_read(
+    uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static void
+lapic_write(
+    uint32_t reg,
+    uint32_t value)
+{
+    lapic[reg / 4] = value;
+}
+
+int
+lapic_init(
+    uint32_t paddr)
+{
+    uint32_t vaddr = pdt_kernel_find_next_vaddr(PAGE_SIZE);
+
+    if (vaddr == 0 ||
+        pdt_map_kernel_memory(paddr, vaddr, PAGE_SIZE, PAGING_READ_WRITE,
+                              PAGING_PL0) != PAGE_SIZE)
+    {
+        printk("lapic_init: Could not map registers. paddr: %X\n", paddr);
+        return -1;
+    }
+
+    lapic = (volatile uint32_t *) vaddr;
+    return 0;
+}
+
+void
+lapic_setup(
+    int is_bsp)
+{
+    lapic_write(LAPIC_SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+    lapic_write(LAPIC_TPR, 0);
+
+    /*
+     * The PIC is wired to LINT0 of the first CPU only.
+     */
+    lapic_write(LAPIC_LVT_LINT0, is_bsp ? LVT_EXTINT : LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, is_bsp ? LVT_NMI : LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_eoi();
+}
+
+uint32_t
+lapic_id(
+    void)
+{
+    if (lapic == NULL)
+    {
+        return 0;
+    }
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void
+lapic_eoi(
+    void)
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void
+wait_for_delivery(
+    void)
+{
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_STATUS)
+    {
+        __builtin_ia32_pause();
+    }
+}
+
+/*
+ * An interrupt handler sending an IPI of its own must not get between the
+ * writes of the two halves of the ICR, or before the IPI is delivered.
+ */
+void
+lapic_send_ipi(
+    uint32_t apic_id,
+    uint32_t icr)
+{
+    uint32_t flags = save_and_disable_interrupts();
+
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    wait_for_delivery();
+
+    restore_interrupts(flags);
+}
+
+void
+lapic_send_ipi_others(
+    uint32_t vector)
+{
+    uint32_t flags = save_and_disable_interrupts();
+
+    lapic_write(LAPIC_ICR_LOW, ICR_ALL_BUT_SELF | LAPIC_ICR_FIXED | vector);
+    wait_for_delivery();
+
+    restore_interrupts(flags);
+}
+
+static void
+lapic_timer_set_next_event(
+    uint64_t delta_ns)
+{
+    uint32_t counts = (uint32_t)((delta_ns * counts_mult) >> COUNTS_SHIFT);
+
+    lapic_write(LAPIC_TIMER_INIT, counts != 0 ? counts : 1);
+}
+
+static void
+lapic_timer_set_deadline(
+    uint64_t delta_ns)
+{
+    write_msr(MSR_TSC_DEADLINE,
+              read_tsc() + ((delta_ns * deadline_mult) >> DEADLINE_SHIFT));
+}
+
+/*
+ * In one-shot mode, counting down at the bus clock divided by 16, or
+ * interrupting at a TSC value once calibrated, if the CPU can.
+ */
+static struct clock_event_device lapic_timer_device = {
+    "lapic", lapic_timer_set_next_event, NSEC_PER_USEC, NSEC_PER_TICK
+};
+
+void
+lapic_timer_calibrate(
+    void)
+{
+    uint32_t start;
+
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+    /*
+     * Start right after a tick, so we measure whole ticks.
+     */
+    start = timer_ticks();
+    while (timer_ticks() == start);
+
+    start = timer_ticks();
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    while (timer_ticks() - start < CALIBRATE_TICKS);
+
+    timer_counts_per_tick =
+        (0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR)) / CALIBRATE_TICKS;
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    printk("lapic_timer_calibrate: Timer counts per tick: %u\n",
+           timer_counts_per_tick);
+
+    counts_mult = clocks_calc_mult(NSEC_PER_MSEC,
+                                   timer_counts_per_tick * TIMER_FREQUENCY / 1000,
+                                   COUNTS_SHIFT);
+    lapic_timer_device.max_delta_ns =
+        (uint64_t)(0xFFFFFFFF / timer_counts_per_tick) * NSEC_PER_TICK;
+
+    if (tsc_deadline_supported())
+    {
+        deadline_mult = clocks_calc_mult(NSEC_PER_MSEC, tsc_khz(),
+                                         DEADLINE_SHIFT);
+        lapic_timer_device.name = "lapic-deadline";
+        lapic_timer_device.set_next_event = lapic_timer_set_deadline;
+        lapic_timer_device.max_delta_ns = DEADLINE_MAX_DELTA_NS;
+    }
+}
+
+void
+lapic_timer_init_cpu(
+    void)
+{
+    if (lapic_timer_device.set_next_event == lapic_timer_set_deadline)
+    {
+        /*
+         * The mode has to be set before the deadline is written.
+         */
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_DEADLINE | LAPIC_TIMER_VECTOR);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    }
+
+    clockevents_register(&lapic_timer_device);
+}
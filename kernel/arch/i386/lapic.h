@@ -0,0 +1,80 @@
+#ifndef _NEWBOS_LAPIC_H
+#define _NEWBOS_LAPIC_H
+
+#include <stdint.h>
+
+/*
+ * Maps the local APIC registers, at the same address on every CPU. Returns
+ * -1 if they can't be mapped.
+ */
+int
+lapic_init(
+    uint32_t paddr
+);
+
+/*
+ * Enables the calling CPU's local APIC. The first CPU keeps getting the
+ * PIC's interrupts through it.
+ */
+void
+lapic_setup(
+    int is_bsp
+);
+
+/*
+ * APIC ID of the calling CPU, 0 before lapic_init().
+ */
+uint32_t
+lapic_id(
+    void
+);
+
+void
+lapic_eoi(
+    void
+);
+
+/*
+ * Sends an interrupt command: an IPI of the given ICR delivery mode and
+ * vector to the CPU with the given APIC ID.
+ */
+void
+lapic_send_ipi(
+    uint32_t apic_id,
+    uint32_t icr
+);
+
+/*
+ * Sends vector to every CPU but the calling one.
+ */
+void
+lapic_send_ipi_others(
+    uint32_t vector
+);
+
+#define LAPIC_ICR_FIXED   0x00000
+#define LAPIC_ICR_INIT    0x00500
+#define LAPIC_ICR_STARTUP 0x00600
+#define LAPIC_ICR_ASSERT  0x04000
+#define LAPIC_ICR_LEVEL   0x08000
+
+/*
+ * Measures the local APIC timer against the PIT, which must be running.
+ * Called once, on the first CPU, after tsc_init().
+ */
+void
+lapic_timer_calibrate(
+    void
+);
+
+/*
+ * Makes the calling CPU's local APIC timer its clock event device,
+ * interrupting on LAPIC_TIMER_VECTOR, in TSC deadline mode if the CPU has
+ * it.
+ */
+void
+lapic_timer_init_cpu(
+    void
+);
+
+#endif
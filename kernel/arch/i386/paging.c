@@ -3,80 +3,180 @@
 
 #include <newbos/paging.h>
 #include <newbos/printk.h>
+#include <newbos/smp.h>
 
 #include "memory.h"
 
-#define NUM_ENTRIES 1024
-#define PDT_SIZE NUM_ENTRIES * sizeof(struct pde)
 #define MAX_NUM_MEMORY_MAP  100
 #define FOUR_KB     0x1000
 #define FOUR_MB     0x400000
 #define PAGING_PL0        0
 #define PS_4KB 0x00
+#define PS_LARGE 0x01
 
-#define VIRTUAL_TO_PDT_IDX(a)   (((a) >> 22) & 0x3FF)
-#define VIRTUAL_TO_PT_IDX(a)    (((a) >> 12) & 0x3FF)
-#define PDT_IDX_TO_VIRTUAL(a)   (((a) << 22))
+#ifdef CONFIG_PAE
+/*
+ * PAE paging: a page directory pointer table (PDPT) of four entries, each
+ * pointing to a page directory of 512 64-bit entries. The four page
+ * directories of an address space are allocated back to back, right after
+ * the PDPT, so they can be indexed as a single table of 2048 entries that
+ * each cover 2 MB. Page tables have 512 entries.
+ */
+#define NUM_PDT_ENTRIES 2048
+#define NUM_PT_ENTRIES  512
+#define PDT_SHIFT       21
+#define PDPT_ENTRIES    4
+#define PDT_FRAMES      (1 + PDPT_ENTRIES)
+#define PDT_OFFSET      FOUR_KB
+#define ENTRY_ADDR_MASK 0x000FFFFFFFFFF000ULL
+#define MAX_PHYSICAL_ADDR 0x1000000000ULL /* 64 GB, 36 bit MAXPHYADDR */
+#else
+#define NUM_PDT_ENTRIES 1024
+#define NUM_PT_ENTRIES  1024
+#define PDT_SHIFT       22
+#define PDT_FRAMES      1
+#define PDT_OFFSET      0
+#define ENTRY_ADDR_MASK 0xFFFFF000
+#define MAX_PHYSICAL_ADDR 0x100000000ULL /* 4 GB */
+#endif
+
+#define PDT_SIZE (NUM_PDT_ENTRIES * sizeof(struct pde))
+#define PT_SIZE  (NUM_PT_ENTRIES * sizeof(struct pte))
+
+#define VIRTUAL_TO_PDT_IDX(a)   ((a) >> PDT_SHIFT)
+#define VIRTUAL_TO_PT_IDX(a)    (((a) >> 12) & (NUM_PT_ENTRIES - 1))
+#define PDT_IDX_TO_VIRTUAL(a)   (((a) << PDT_SHIFT))
 #define PT_IDX_TO_VIRTUAL(a)   (((a) << 12))
 #define KERNEL_START_VADDR  0xC0000000
-#define KERNEL_TMP_PT_IDX   1023
 #define PT_ENTRY_SIZE  FOUR_KB
-#define PDT_ENTRY_SIZE FOUR_MB
-#define KERNEL_TMP_VADDR \
-    (KERNEL_START_VADDR + KERNEL_TMP_PT_IDX * PT_ENTRY_SIZE)
+#define PDT_ENTRY_SIZE (1 << PDT_SHIFT)
 #define KERNEL_PT_PDT_IDX VIRTUAL_TO_PDT_IDX(KERNEL_START_VADDR)
 
-#define IS_ENTRY_PRESENT(e) ((e)->config && 0x01)
+/*
+ * The last pages of the kernel's first 4 MB are never handed out, they are
+ * slots for temporary mappings of page frames. Every CPU has its own: one
+ * used internally while walking page tables and NUM_KMAP_SLOTS for
+ * kmap_frame(). Only the CPU using a slot can have it in its TLB, so
+ * changing one needs no TLB flush on the others.
+ */
+#define NUM_KMAP_SLOTS      4
+#define SLOTS_PER_CPU       (1 + NUM_KMAP_SLOTS)
+#define KERNEL_SLOT_VADDR(cpu, n) \
+    (KERNEL_START_VADDR + FOUR_MB - ((cpu) * SLOTS_PER_CPU + (n) + 1) * FOUR_KB)
+#define KERNEL_TMP_VADDR    KERNEL_SLOT_VADDR(smp_cpu_id(), 0)
+#define KERNEL_SLOTS_START  KERNEL_SLOT_VADDR(MAX_CPUS - 1, NUM_KMAP_SLOTS)
+#define KERNEL_TMP_PDT_IDX  VIRTUAL_TO_PDT_IDX(KERNEL_SLOTS_START)
+#define IS_KERNEL_TMP_SLOT(pdt_idx, pt_idx) \
+    ((pdt_idx) == KERNEL_TMP_PDT_IDX && \
+     (pt_idx) >= VIRTUAL_TO_PT_IDX(KERNEL_SLOTS_START))
+
+/*
+ * Page tables set up at boot for the kernel's first 4 MB. They aren't page
+ * frames from the allocator and must never be freed.
+ */
+#define IS_KERNEL_BOOT_PT(pdt_idx) \
+    ((pdt_idx) >= KERNEL_PT_PDT_IDX && (pdt_idx) <= KERNEL_TMP_PDT_IDX)
+
+#define KERNEL_IDENTITY_PDT_ENTRIES (FOUR_MB >> PDT_SHIFT)
+
+/*
+ * Bits shared by page directory and page table entries.
+ */
+#define ENTRY_PRESENT  0x001
+#define ENTRY_RW       0x002
+#define ENTRY_USER     0x004
+#define ENTRY_PWT      0x008
+#define ENTRY_ACCESSED 0x020
+#define ENTRY_DIRTY    0x040
+#define ENTRY_PS       0x080
+
+/*
+ * A page table entry that isn't present but has ENTRY_SWAPPED set holds the
+ * swap slot of the page in its frame address bits.
+ */
+#define ENTRY_SWAPPED  0x200
+
+/*
+ * Present entries keep the page's age in the bits available to software,
+ * see pdt_sample_page().
+ */
+#define ENTRY_AGE_SHIFT 9
+#define ENTRY_AGE_MASK  ((paddr_t) PAGE_AGE_MAX << ENTRY_AGE_SHIFT)
+#define SWAP_ENTRY(slot) (((paddr_t) (slot) << 12) | ENTRY_SWAPPED)
+#define IS_SWAP_ENTRY(e) \
+    (((e)->value & (ENTRY_PRESENT | ENTRY_SWAPPED)) == ENTRY_SWAPPED)
+
+/*
+ * A kernel page table entry that isn't present but has ENTRY_GUARD set is a
+ * guard page: nothing is mapped there, but the page isn't free either.
+ */
+#define ENTRY_GUARD    0x400
+#define IS_GUARD_ENTRY(e) \
+    (((e)->value & (ENTRY_PRESENT | ENTRY_GUARD)) == ENTRY_GUARD)
+
+#define IS_ENTRY_PRESENT(e) ((e)->value & ENTRY_PRESENT)
+#define IS_LARGE_PAGE(e) \
+    (((e)->value & (ENTRY_PRESENT | ENTRY_PS)) == (ENTRY_PRESENT | ENTRY_PS))
 
 #define PAGING_READ_WRITE 1
 
+#define PFA_RECLAIM_TRIES 4
+
 struct pte
 {
-    uint8_t config;
-    uint8_t middle; /* only the highest 4 bits and the lowest bit are used */
-    uint16_t high_addr;
+    paddr_t value;
 } __attribute__((packed));
 
 static struct pde *kernel_pdt;
 static struct pte *kernel_pt;
+static uint32_t kernel_pdt_paddr;
 
 struct memory_map
 {
-    uint32_t addr;
-    uint32_t len;
+    paddr_t addr;
+    paddr_t len;
 };
 
 struct page_frame_bitmap {
     uint32_t *start;
     uint32_t len; /* in bits */
+    uint32_t free;
 };
 static struct page_frame_bitmap page_frames;
 static struct memory_map mmap[MAX_NUM_MEMORY_MAP];
 static uint32_t mmap_len;
 
-static void
-pfa_free(uint32_t paddr);
+static uint32_t kmap_depth[MAX_CPUS];
+
+static uint32_t large_pages_split;
+
+static struct pfa_reclaimer const *reclaimer;
 
 static void
 toggle_bit(uint32_t bit_idx);
 
 
 static void
-create_pdt_entry(struct pde *pdt, uint32_t n, uint32_t paddr, uint8_t ps,
+create_pdt_entry(struct pde *pdt, uint32_t n, paddr_t paddr, uint8_t ps,
                  uint8_t rw, uint8_t pl);
 
 static void
-create_pt_entry(struct pte *pt, uint32_t n, uint32_t paddr, uint8_t rw,
+create_pt_entry(struct pte *pt, uint32_t n, paddr_t paddr, uint8_t rw,
                 uint8_t pl);
 
 static uint32_t
-idx_for_paddr(uint32_t paddr);
+idx_for_paddr(paddr_t paddr);
 
 static uint32_t
 pt_unmap_memory( struct pte *pt, uint32_t pdt_idx, uint32_t vaddr, uint32_t size);
 
+static int
+pdt_split_large_page(struct pde *pdt, uint32_t pdt_idx);
+
 void pdt_set(uint32_t);
 
+void invalidate_page_table_entry(uint32_t);
+
 static uint32_t
 align_up(
     uint32_t n,
@@ -90,14 +190,6 @@ align_up(
     return n + (a - m);
 }
 
-static uint32_t
-align_down(
-    uint32_t n,
-    uint32_t a)
-{
-    return n - (n % a);
-}
-
 static uint32_t
 div_ceil(
     uint32_t num,
@@ -106,41 +198,92 @@ div_ceil(
     return (num - 1) / den + 1;
 }
 
-static uint32_t
+/*
+ * Physical addresses may be 64 bits wide, use masks rather than division so
+ * we don't depend on libgcc.
+ */
+static paddr_t
+paddr_align_up(
+    paddr_t n)
+{
+    return (n + FOUR_KB - 1) & ~((paddr_t) FOUR_KB - 1);
+}
+
+static paddr_t
+paddr_align_down(
+    paddr_t n)
+{
+    return n & ~((paddr_t) FOUR_KB - 1);
+}
+
+static paddr_t
 get_pt_paddr(
     struct pde *pde,
     uint32_t pde_idx)
 {
-    struct pde *e = pde + pde_idx;
-    uint32_t addr = e->high_addr;
-    addr <<= 16;
-    addr |= ((uint32_t) (e->low_addr & 0xF0) << 8);
-
-    return addr;
+    return pde[pde_idx].value & ENTRY_ADDR_MASK;
 }
 
 static uint32_t
 kernel_map_temporary_memory(
-    uint32_t paddr)
+    paddr_t paddr)
 {
-    create_pt_entry(kernel_pt, KERNEL_TMP_PT_IDX, paddr,
+    uint32_t vaddr = KERNEL_TMP_VADDR;
+    create_pt_entry(kernel_pt, VIRTUAL_TO_PT_IDX(vaddr), paddr,
                     PAGING_READ_WRITE, PAGING_PL0);
-    invalidate_page_table_entry(KERNEL_TMP_VADDR);
-    return KERNEL_TMP_VADDR;
+    invalidate_page_table_entry(vaddr);
+    return vaddr;
 }
 
 static void
 kernel_set_temporary_entry(
-    uint32_t entry)
+    struct pte entry)
 {
-    kernel_pt[KERNEL_TMP_PT_IDX] = *((struct pte *) &entry);
-    invalidate_page_table_entry(KERNEL_TMP_VADDR);
+    uint32_t vaddr = KERNEL_TMP_VADDR;
+    kernel_pt[VIRTUAL_TO_PT_IDX(vaddr)] = entry;
+    invalidate_page_table_entry(vaddr);
 }
 
-static uint32_t
+static struct pte
 kernel_get_temporary_entry()
 {
-    return *((uint32_t *) &kernel_pt[KERNEL_TMP_PT_IDX]);
+    return kernel_pt[VIRTUAL_TO_PT_IDX(KERNEL_TMP_VADDR)];
+}
+
+void *
+kmap_frame(
+    paddr_t paddr)
+{
+    uint32_t cpu = smp_cpu_id();
+    uint32_t vaddr, slot = kmap_depth[cpu];
+    if (slot == NUM_KMAP_SLOTS)
+    {
+        printk("kmap_frame: No temporary slot left. paddr: %X\n",
+               (uint32_t) paddr);
+        return NULL;
+    }
+
+    /*
+     * Claim the slot before filling it in, an interrupt handler that maps a
+     * frame in between gets the next one.
+     */
+    ++kmap_depth[cpu];
+
+    vaddr = KERNEL_SLOT_VADDR(cpu, slot + 1);
+    create_pt_entry(kernel_pt, VIRTUAL_TO_PT_IDX(vaddr), paddr,
+                    PAGING_READ_WRITE, PAGING_PL0);
+    invalidate_page_table_entry(vaddr);
+    return (void *) vaddr;
+}
+
+void
+kunmap_frame(
+    void *vaddr)
+{
+    uint32_t v = (uint32_t) vaddr;
+    memset(kernel_pt + VIRTUAL_TO_PT_IDX(v), 0, sizeof(struct pte));
+    invalidate_page_table_entry(v);
+    --kmap_depth[smp_cpu_id()];
 }
 
 struct pde *
@@ -148,31 +291,63 @@ pdt_create(uint32_t *out_paddr)
 {
     struct pde *pdt;
     *out_paddr = 0;
-    uint32_t pdt_paddr = pfa_allocate(1);
-    uint32_t pdt_vaddr = pdt_kernel_find_next_vaddr(PDT_SIZE);
-    uint32_t size = pdt_map_kernel_memory(pdt_paddr, pdt_vaddr, PDT_SIZE,
+    paddr_t pdt_paddr = pfa_allocate(PDT_FRAMES);
+    if (pdt_paddr == 0)
+    {
+        return NULL;
+    }
+
+#ifdef CONFIG_PAE
+    /*
+     * cr3 only holds a 32 bit address of the PDPT.
+     */
+    if (pdt_paddr >= 0x100000000ULL)
+    {
+        printk("pdt_create: PDPT above 4 GB. paddr: %X:%X\n",
+               (uint32_t) (pdt_paddr >> 32), (uint32_t) pdt_paddr);
+        return NULL;
+    }
+#endif
+
+    uint32_t pdt_vaddr = pdt_kernel_find_next_vaddr(PDT_FRAMES * FOUR_KB);
+    uint32_t size = pdt_map_kernel_memory(pdt_paddr, pdt_vaddr,
+                                          PDT_FRAMES * FOUR_KB,
                                           PAGING_READ_WRITE, PAGING_PL0);
-    if (size < PDT_SIZE) {
+    if (size < PDT_FRAMES * FOUR_KB) {
         /*
-         * Since PDT_SIZE is the size of one frame, size must either be equal
-         * to PDT_SIZE or 0
+         * The directory frames are mapped into one page table, so size must
+         * either be the size of all of them or 0
          */
         pfa_free(pdt_paddr);
         return NULL;
     }
 
-    pdt = (struct pde *) pdt_vaddr;
+    pdt = (struct pde *) (pdt_vaddr + PDT_OFFSET);
 
     memset(pdt, 0, PDT_SIZE);
 
-    *out_paddr = pdt_paddr;
+#ifdef CONFIG_PAE
+    {
+        uint32_t i;
+        uint64_t *pdpt = (uint64_t *) pdt_vaddr;
+        memset(pdpt, 0, FOUR_KB);
+        for (i = 0; i < PDPT_ENTRIES; ++i)
+        {
+            pdpt[i] = (pdt_paddr + PDT_OFFSET + i * FOUR_KB) | ENTRY_PRESENT;
+        }
+    }
+#endif
+
+    *out_paddr = (uint32_t) pdt_paddr;
     return pdt;
 }
 
 uint32_t
 pdt_unmap_memory(struct pde *pdt, uint32_t vaddr, uint32_t size)
 {
-    uint32_t pdt_idx, pt_paddr, pt_vaddr, tmp_entry;
+    uint32_t pdt_idx, pt_vaddr;
+    paddr_t pt_paddr;
+    struct pte tmp_entry;
 
     uint32_t freed_size = 0;
     uint32_t end_vaddr;
@@ -186,23 +361,47 @@ pdt_unmap_memory(struct pde *pdt, uint32_t vaddr, uint32_t size)
 
         if (!IS_ENTRY_PRESENT(pdt + pdt_idx))
         {
-            vaddr = align_up(vaddr, PDT_ENTRY_SIZE);
+            vaddr = align_up(vaddr + 1, PDT_ENTRY_SIZE);
             continue;
         }
 
+        if (IS_LARGE_PAGE(pdt + pdt_idx))
+        {
+            if (vaddr % PDT_ENTRY_SIZE == 0 &&
+                end_vaddr - vaddr >= PDT_ENTRY_SIZE)
+            {
+                memset(pdt + pdt_idx, 0, sizeof(struct pde));
+                invalidate_page_table_entry(vaddr);
+                freed_size = PDT_ENTRY_SIZE;
+                vaddr += freed_size;
+                continue;
+            }
+
+            /*
+             * Only part of the large page goes away, fall back to 4 KB pages
+             * for the whole of it first.
+             */
+            if (pdt_split_large_page(pdt, pdt_idx) != 0)
+            {
+                smp_flush_tlb();
+                return 0;
+            }
+        }
+
         pt_paddr = get_pt_paddr(pdt, pdt_idx);
         tmp_entry = kernel_get_temporary_entry();
 
         pt_vaddr = kernel_map_temporary_memory(pt_paddr);
 
         freed_size =
-            pt_unmap_memory((struct pte *) pt_vaddr, pdt_idx, vaddr, size);
+            pt_unmap_memory((struct pte *) pt_vaddr, pdt_idx, vaddr,
+                            end_vaddr - vaddr);
 
         kernel_set_temporary_entry(tmp_entry);
 
         if (freed_size == PDT_ENTRY_SIZE)
         {
-            if (pdt_idx != KERNEL_PT_PDT_IDX)
+            if (!IS_KERNEL_BOOT_PT(pdt_idx))
             {
                 pfa_free(pt_paddr);
                 memset(pdt + pdt_idx, 0, sizeof(struct pde));
@@ -212,9 +411,39 @@ pdt_unmap_memory(struct pde *pdt, uint32_t vaddr, uint32_t size)
         vaddr += freed_size;
     }
 
+    smp_flush_tlb();
     return freed_size;
 }
 
+int
+pdt_map_kernel_guard(
+    uint32_t vaddr)
+{
+    uint32_t pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+    uint32_t pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
+    struct pte tmp_entry, *pt;
+    int ret = -1;
+
+    if (!IS_ENTRY_PRESENT(kernel_pdt + pdt_idx) ||
+        IS_LARGE_PAGE(kernel_pdt + pdt_idx))
+    {
+        return -1;
+    }
+
+    tmp_entry = kernel_get_temporary_entry();
+    pt = (struct pte *)
+        kernel_map_temporary_memory(get_pt_paddr(kernel_pdt, pdt_idx));
+
+    if (!IS_ENTRY_PRESENT(pt + pt_idx) && !IS_KERNEL_TMP_SLOT(pdt_idx, pt_idx))
+    {
+        pt[pt_idx].value = ENTRY_GUARD;
+        ret = 0;
+    }
+
+    kernel_set_temporary_entry(tmp_entry);
+    return ret;
+}
+
 uint32_t
 pdt_unmap_kernel_memory(uint32_t virtual_addr, uint32_t size)
 {
@@ -229,9 +458,9 @@ pt_kernel_find_next_vaddr(
     uint32_t i, num_to_find, num_found = 0, org_i;
     num_to_find = align_up(size, FOUR_KB) / FOUR_KB;
 
-    for (i = 0; i < NUM_ENTRIES; ++i) {
-        if (IS_ENTRY_PRESENT(pt+i) ||
-            (pdt_idx == KERNEL_PT_PDT_IDX && i == KERNEL_TMP_PT_IDX)) {
+    for (i = 0; i < NUM_PT_ENTRIES; ++i) {
+        if (IS_ENTRY_PRESENT(pt+i) || IS_GUARD_ENTRY(pt+i) ||
+            IS_KERNEL_TMP_SLOT(pdt_idx, i)) {
             num_found = 0;
         } else {
             if (num_found == 0) {
@@ -251,13 +480,15 @@ uint32_t
 pdt_kernel_find_next_vaddr(
     uint32_t size)
 {
-    uint32_t pdt_idx, pt_paddr, pt_vaddr, tmp_entry, vaddr = 0;
+    uint32_t pdt_idx, pt_vaddr, vaddr = 0;
+    paddr_t pt_paddr;
+    struct pte tmp_entry;
     /*
-     * TODO: support > 4MB sizes
+     * TODO: support sizes larger than one page table
      */
 
-    pdt_idx = VIRTUAL_TO_PDT_IDX(KERNEL_START_VADDR);
-    for (; pdt_idx < NUM_ENTRIES; ++pdt_idx)
+    pdt_idx = KERNEL_PT_PDT_IDX;
+    for (; pdt_idx < NUM_PDT_ENTRIES; ++pdt_idx)
     {
         if (IS_ENTRY_PRESENT(kernel_pdt + pdt_idx))
         {
@@ -289,7 +520,7 @@ pdt_kernel_find_next_vaddr(
 static uint32_t pt_map_memory(
     struct pte *pt,
     uint32_t pdt_idx,
-    uint32_t paddr,
+    paddr_t paddr,
     uint32_t vaddr,
     uint32_t size,
     uint8_t rw,
@@ -298,12 +529,12 @@ static uint32_t pt_map_memory(
     uint32_t pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
     uint32_t mapped_size = 0;
 
-    while (mapped_size < size && pt_idx < NUM_ENTRIES)
+    while (mapped_size < size && pt_idx < NUM_PT_ENTRIES)
     {
         if (IS_ENTRY_PRESENT(pt + pt_idx))
         {
             return mapped_size;
-        } else if(pdt_idx == KERNEL_PT_PDT_IDX && pt_idx == KERNEL_TMP_PT_IDX) {
+        } else if (IS_KERNEL_TMP_SLOT(pdt_idx, pt_idx)) {
             return mapped_size;
         }
 
@@ -320,7 +551,7 @@ static uint32_t pt_map_memory(
 uint32_t
 pdt_map_memory(
     struct pde *pdt,
-    uint32_t paddr,
+    paddr_t paddr,
     uint32_t vaddr,
     uint32_t size,
     uint8_t rw,
@@ -328,7 +559,9 @@ pdt_map_memory(
 {
     uint32_t pdt_idx;
     struct pte *pt;
-    uint32_t pt_paddr, pt_vaddr, tmp_entry;
+    uint32_t pt_vaddr;
+    paddr_t pt_paddr;
+    struct pte tmp_entry;
     uint32_t mapped_size = 0;
     uint32_t total_mapped_size = 0;
     size = align_up(size, PT_ENTRY_SIZE);
@@ -337,6 +570,42 @@ pdt_map_memory(
     {
         pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
 
+        if (IS_LARGE_PAGE(pdt + pdt_idx))
+        {
+            /*
+             * Already mapped
+             */
+            return total_mapped_size;
+        }
+
+        /*
+         * User mappings that cover a whole, aligned and physically contiguous
+         * directory entry get a large page instead of a page table. That
+         * saves the page table frame and uses one TLB entry for all of it.
+         * A page table with nothing left in it makes way for the large page.
+         */
+        if (pl == PAGING_PL3 && size >= PDT_ENTRY_SIZE &&
+            vaddr % PDT_ENTRY_SIZE == 0 &&
+            (paddr & (PDT_ENTRY_SIZE - 1)) == 0 &&
+            !pdt_has_mappings(pdt, vaddr))
+        {
+            pt_paddr = IS_ENTRY_PRESENT(pdt + pdt_idx) ?
+                       get_pt_paddr(pdt, pdt_idx) : 0;
+            create_pdt_entry(pdt, pdt_idx, paddr, PS_LARGE, rw, pl);
+            if (pt_paddr != 0)
+            {
+                invalidate_page_table_entry(vaddr);
+                smp_flush_tlb();
+                pfa_free(pt_paddr);
+            }
+
+            size -= PDT_ENTRY_SIZE;
+            total_mapped_size += PDT_ENTRY_SIZE;
+            vaddr += PDT_ENTRY_SIZE;
+            paddr += PDT_ENTRY_SIZE;
+            continue;
+        }
+
         tmp_entry = kernel_get_temporary_entry();
 
         if (!IS_ENTRY_PRESENT(pdt + pdt_idx))
@@ -347,11 +616,11 @@ pdt_map_memory(
                 printk("Couldn't allocate page frame for new page table."
                        "pdt_idx: %u, data vaddr: %X, data paddr: %X, "
                        "data size: %u\n",
-                       pdt_idx, vaddr, paddr, size);
+                       pdt_idx, vaddr, (uint32_t) paddr, size);
                 return 0;
             }
             pt_vaddr = kernel_map_temporary_memory(pt_paddr);
-            memset((void *) pt_vaddr, 0, NUM_ENTRIES * sizeof(struct pte));
+            memset((void *) pt_vaddr, 0, PT_SIZE);
         } else {
             pt_paddr = get_pt_paddr(pdt, pdt_idx);
             pt_vaddr = kernel_map_temporary_memory(pt_paddr);
@@ -365,14 +634,21 @@ pdt_map_memory(
         {
             printk("Could not map memory in page table. "
                    "pt: %X, paddr: %X, vaddr: %X, size: %u\n",
-                   (uint32_t) pt, paddr, vaddr, size);
+                   (uint32_t) pt, (uint32_t) paddr, vaddr, size);
             kernel_set_temporary_entry(tmp_entry);
             return 0;
         }
 
         if (!IS_ENTRY_PRESENT(pdt + pdt_idx))
         {
-            create_pdt_entry(pdt, pdt_idx, pt_paddr, PS_4KB, rw, pl);
+            /*
+             * The page table entries decide if a page is writable, so the
+             * directory entry must not be stricter than any of them. A table
+             * first filled with a read-only page (e.g. the zero page) can
+             * later receive writable pages.
+             */
+            create_pdt_entry(pdt, pdt_idx, pt_paddr, PS_4KB,
+                             PAGING_READ_WRITE, pl);
         }
 
         kernel_set_temporary_entry(tmp_entry);
@@ -386,9 +662,478 @@ pdt_map_memory(
     return total_mapped_size;
 }
 
+paddr_t
+pdt_lookup(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint8_t *out_rw)
+{
+    uint32_t pdt_idx, pt_idx;
+    paddr_t pt_paddr, paddr = 0;
+    struct pte *pt;
+    struct pte tmp_entry;
+
+    pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+    pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
+
+    if (!IS_ENTRY_PRESENT(pdt + pdt_idx))
+    {
+        return 0;
+    }
+
+    if (IS_LARGE_PAGE(pdt + pdt_idx))
+    {
+        if (out_rw != NULL)
+        {
+            *out_rw = (pdt[pdt_idx].value & ENTRY_RW) ? 1 : 0;
+        }
+        return get_pt_paddr(pdt, pdt_idx) + (vaddr & (PDT_ENTRY_SIZE - 1));
+    }
+
+    tmp_entry = kernel_get_temporary_entry();
+
+    pt_paddr = get_pt_paddr(pdt, pdt_idx);
+    pt = (struct pte *) kernel_map_temporary_memory(pt_paddr);
+    if (IS_ENTRY_PRESENT(pt + pt_idx))
+    {
+        paddr = pt[pt_idx].value & ENTRY_ADDR_MASK;
+        if (out_rw != NULL)
+        {
+            *out_rw = (pt[pt_idx].value & ENTRY_RW) ? 1 : 0;
+        }
+    }
+
+    kernel_set_temporary_entry(tmp_entry);
+
+    return paddr;
+}
+
+int
+pdt_has_mappings(
+    struct pde *pdt,
+    uint32_t vaddr)
+{
+    uint32_t pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr), pt_idx;
+    struct pte *pt;
+    struct pte tmp_entry;
+    int ret = 0;
+
+    if (!IS_ENTRY_PRESENT(pdt + pdt_idx))
+    {
+        return 0;
+    }
+    if (IS_LARGE_PAGE(pdt + pdt_idx))
+    {
+        return 1;
+    }
+
+    /*
+     * Unmapping everything in a page table doesn't free it, so its entries
+     * have to be looked at.
+     */
+    tmp_entry = kernel_get_temporary_entry();
+    pt = (struct pte *) kernel_map_temporary_memory(get_pt_paddr(pdt, pdt_idx));
+
+    for (pt_idx = 0; pt_idx < NUM_PT_ENTRIES && !ret; ++pt_idx)
+    {
+        ret = IS_ENTRY_PRESENT(pt + pt_idx) || IS_SWAP_ENTRY(pt + pt_idx);
+    }
+
+    kernel_set_temporary_entry(tmp_entry);
+
+    return ret;
+}
+
+uint32_t
+pdt_count_pages(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t *out_swapped)
+{
+    uint32_t pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr), pt_idx, n = 0;
+    struct pte *pt;
+    struct pte tmp_entry;
+
+    *out_swapped = 0;
+    if (!IS_ENTRY_PRESENT(pdt + pdt_idx) || IS_LARGE_PAGE(pdt + pdt_idx))
+    {
+        return 0;
+    }
+
+    tmp_entry = kernel_get_temporary_entry();
+    pt = (struct pte *) kernel_map_temporary_memory(get_pt_paddr(pdt, pdt_idx));
+
+    for (pt_idx = 0; pt_idx < NUM_PT_ENTRIES; ++pt_idx)
+    {
+        if (IS_ENTRY_PRESENT(pt + pt_idx))
+        {
+            ++n;
+        }
+        else if (IS_SWAP_ENTRY(pt + pt_idx))
+        {
+            ++*out_swapped;
+        }
+    }
+
+    kernel_set_temporary_entry(tmp_entry);
+
+    return n;
+}
+
+/*
+ * Folds the accessed bit of a present entry into its age and clears the
+ * accessed and dirty bits. Stores the PAGE_STATE_* bits, with the new age,
+ * in out_state.
+ */
+static paddr_t
+age_entry(
+    paddr_t value,
+    uint32_t *out_state)
+{
+    uint32_t age = (uint32_t) ((value & ENTRY_AGE_MASK) >> ENTRY_AGE_SHIFT);
+    uint32_t state = PAGE_STATE_PRESENT;
+
+    if (value & ENTRY_ACCESSED)
+    {
+        state |= PAGE_STATE_ACCESSED;
+        age = 0;
+    }
+    else if (age < PAGE_AGE_MAX)
+    {
+        ++age;
+    }
+    if (value & ENTRY_DIRTY)
+    {
+        state |= PAGE_STATE_DIRTY;
+    }
+    if (value & ENTRY_RW)
+    {
+        state |= PAGE_STATE_RW;
+    }
+    if (value & ENTRY_USER)
+    {
+        state |= PAGE_STATE_USER;
+    }
+
+    *out_state = state | (age << PAGE_STATE_AGE_SHIFT);
+
+    return (value & ~(ENTRY_AGE_MASK | ENTRY_ACCESSED | ENTRY_DIRTY)) |
+           ((paddr_t) age << ENTRY_AGE_SHIFT);
+}
+
+/*
+ * Ages the present entry at entry with age_entry(), while the CPUs may set
+ * its accessed and dirty bits. Returns 1 if those were set, then other CPUs
+ * may have it cached and won't set them again until they drop it.
+ */
+static int
+age_entry_atomic(
+    paddr_t *entry,
+    uint32_t *out_state)
+{
+    paddr_t old = __atomic_load_n(entry, __ATOMIC_RELAXED), new;
+
+    do
+    {
+        new = age_entry(old, out_state);
+    } while (!__atomic_compare_exchange_n(entry, &old, new, 0,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+
+    return (old & (ENTRY_ACCESSED | ENTRY_DIRTY)) != 0;
+}
+
+uint32_t
+pdt_sample_page(
+    struct pde *pdt,
+    uint32_t vaddr,
+    paddr_t *out_paddr)
+{
+    uint32_t pdt_idx, pt_idx, state = 0;
+    int flush = 0;
+    struct pte *pt;
+    struct pte tmp_entry;
+
+    pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+    pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
+
+    if (!IS_ENTRY_PRESENT(pdt + pdt_idx))
+    {
+        return 0;
+    }
+
+    if (IS_LARGE_PAGE(pdt + pdt_idx))
+    {
+        if (out_paddr != NULL)
+        {
+            *out_paddr = get_pt_paddr(pdt, pdt_idx);
+        }
+        if (age_entry_atomic((paddr_t *) (pdt + pdt_idx), &state))
+        {
+            invalidate_page_table_entry(vaddr);
+            smp_flush_tlb();
+        }
+        return state | PAGE_STATE_LARGE;
+    }
+
+    tmp_entry = kernel_get_temporary_entry();
+    pt = (struct pte *) kernel_map_temporary_memory(get_pt_paddr(pdt, pdt_idx));
+
+    if (IS_ENTRY_PRESENT(pt + pt_idx))
+    {
+        if (out_paddr != NULL)
+        {
+            *out_paddr = pt[pt_idx].value & ENTRY_ADDR_MASK;
+        }
+        flush = age_entry_atomic((paddr_t *) (pt + pt_idx), &state);
+    }
+    else if (IS_SWAP_ENTRY(pt + pt_idx))
+    {
+        state = PAGE_STATE_SWAPPED;
+    }
+
+    kernel_set_temporary_entry(tmp_entry);
+
+    if (flush)
+    {
+        invalidate_page_table_entry(vaddr);
+        smp_flush_tlb();
+    }
+
+    return state;
+}
+
+int
+pdt_set_swap_entry(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t slot)
+{
+    uint32_t pdt_idx, pt_idx;
+    struct pte *pt;
+    struct pte tmp_entry;
+    int ret = -1;
+
+    pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+    pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
+
+    if (!IS_ENTRY_PRESENT(pdt + pdt_idx) || IS_LARGE_PAGE(pdt + pdt_idx))
+    {
+        return -1;
+    }
+
+    tmp_entry = kernel_get_temporary_entry();
+    pt = (struct pte *) kernel_map_temporary_memory(get_pt_paddr(pdt, pdt_idx));
+
+    if (pt[pt_idx].value == 0)
+    {
+        pt[pt_idx].value = SWAP_ENTRY(slot);
+        ret = 0;
+    }
+
+    kernel_set_temporary_entry(tmp_entry);
+
+    return ret;
+}
+
+int
+pdt_get_swap_entry(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t *out_slot)
+{
+    uint32_t pdt_idx, pt_idx;
+    struct pte *pt;
+    struct pte tmp_entry;
+    int ret = -1;
+
+    pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+    pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
+
+    if (!IS_ENTRY_PRESENT(pdt + pdt_idx) || IS_LARGE_PAGE(pdt + pdt_idx))
+    {
+        return -1;
+    }
+
+    tmp_entry = kernel_get_temporary_entry();
+    pt = (struct pte *) kernel_map_temporary_memory(get_pt_paddr(pdt, pdt_idx));
+
+    if (IS_SWAP_ENTRY(pt + pt_idx))
+    {
+        *out_slot = (uint32_t) (pt[pt_idx].value >> 12);
+        ret = 0;
+    }
+
+    kernel_set_temporary_entry(tmp_entry);
+
+    return ret;
+}
+
+/*
+ * Replaces the large page at pdt_idx with a page table mapping the same
+ * frames with the same permissions.
+ */
+static int
+pdt_split_large_page(
+    struct pde *pdt,
+    uint32_t pdt_idx)
+{
+    uint32_t i;
+    paddr_t pt_paddr, paddr, age;
+    struct pte *pt;
+    struct pte tmp_entry;
+    uint8_t rw, pl;
+
+    pt_paddr = pfa_allocate(1);
+    if (pt_paddr == 0)
+    {
+        printk("pdt_split_large_page: Couldn't allocate page table. "
+               "pdt_idx: %u\n", pdt_idx);
+        return -1;
+    }
+
+    paddr = get_pt_paddr(pdt, pdt_idx);
+    rw = (pdt[pdt_idx].value & ENTRY_RW) ? 1 : 0;
+    pl = (pdt[pdt_idx].value & ENTRY_USER) ? 1 : 0;
+    age = pdt[pdt_idx].value & ENTRY_AGE_MASK;
+
+    /*
+     * The pages start out as old as the large page was.
+     */
+    tmp_entry = kernel_get_temporary_entry();
+    pt = (struct pte *) kernel_map_temporary_memory(pt_paddr);
+    for (i = 0; i < NUM_PT_ENTRIES; ++i)
+    {
+        create_pt_entry(pt, i, paddr + i * PT_ENTRY_SIZE, rw, pl);
+        pt[i].value |= age;
+    }
+    kernel_set_temporary_entry(tmp_entry);
+
+    create_pdt_entry(pdt, pdt_idx, pt_paddr, PS_4KB, PAGING_READ_WRITE, pl);
+    invalidate_page_table_entry(PDT_IDX_TO_VIRTUAL(pdt_idx));
+
+    ++large_pages_split;
+    return 0;
+}
+
+int
+pdt_split_large_page_at(
+    struct pde *pdt,
+    uint32_t vaddr)
+{
+    uint32_t pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+
+    if (!IS_ENTRY_PRESENT(pdt + pdt_idx) || !IS_LARGE_PAGE(pdt + pdt_idx) ||
+        pdt_split_large_page(pdt, pdt_idx) != 0)
+    {
+        return -1;
+    }
+
+    smp_flush_tlb();
+    return 0;
+}
+
+uint32_t
+pdt_protect_memory(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t size,
+    uint8_t rw)
+{
+    uint32_t pdt_idx, pt_idx, end_vaddr, protected_size = 0;
+    struct pte *pt;
+    struct pte tmp_entry;
+
+    size = align_up(size, PT_ENTRY_SIZE);
+    end_vaddr = vaddr + size;
+
+    while (vaddr < end_vaddr)
+    {
+        pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+
+        if (!IS_ENTRY_PRESENT(pdt + pdt_idx))
+        {
+            protected_size += align_up(vaddr + 1, PDT_ENTRY_SIZE) - vaddr;
+            vaddr = align_up(vaddr + 1, PDT_ENTRY_SIZE);
+            continue;
+        }
+
+        if (IS_LARGE_PAGE(pdt + pdt_idx))
+        {
+            if (vaddr % PDT_ENTRY_SIZE == 0 &&
+                end_vaddr - vaddr >= PDT_ENTRY_SIZE)
+            {
+                pdt[pdt_idx].value = (pdt[pdt_idx].value & ~ENTRY_RW) |
+                                     ((rw & 0x01) << 1);
+                invalidate_page_table_entry(vaddr);
+                protected_size += PDT_ENTRY_SIZE;
+                vaddr += PDT_ENTRY_SIZE;
+                continue;
+            }
+
+            if (pdt_split_large_page(pdt, pdt_idx) != 0)
+            {
+                smp_flush_tlb();
+                return protected_size;
+            }
+        }
+
+        tmp_entry = kernel_get_temporary_entry();
+        pt = (struct pte *)
+            kernel_map_temporary_memory(get_pt_paddr(pdt, pdt_idx));
+
+        pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
+        while (vaddr < end_vaddr && pt_idx < NUM_PT_ENTRIES)
+        {
+            if (IS_ENTRY_PRESENT(pt + pt_idx) &&
+                !IS_KERNEL_TMP_SLOT(pdt_idx, pt_idx))
+            {
+                pt[pt_idx].value = (pt[pt_idx].value & ~ENTRY_RW) |
+                                   ((rw & 0x01) << 1);
+                invalidate_page_table_entry(vaddr);
+            }
+            protected_size += PT_ENTRY_SIZE;
+            vaddr += PT_ENTRY_SIZE;
+            ++pt_idx;
+        }
+
+        kernel_set_temporary_entry(tmp_entry);
+    }
+
+    smp_flush_tlb();
+    return protected_size;
+}
+
+uint32_t
+pdt_large_pages(
+    struct pde *pdt)
+{
+    uint32_t i, n = 0;
+
+    /*
+     * The kernel's identity mapping is a large page too, only count pages
+     * that user mode can reach.
+     */
+    for (i = 0; i < KERNEL_PT_PDT_IDX; ++i)
+    {
+        if (IS_LARGE_PAGE(pdt + i) && (pdt[i].value & ENTRY_USER))
+        {
+            ++n;
+        }
+    }
+    return n;
+}
+
+uint32_t
+pdt_large_pages_split(
+    void)
+{
+    return large_pages_split;
+}
+
 uint32_t
 pdt_map_kernel_memory(
-    uint32_t paddr,
+    paddr_t paddr,
     uint32_t vaddr,
     uint32_t size,
     uint8_t rw,
@@ -408,9 +1153,9 @@ pt_unmap_memory(
     uint32_t pt_idx = VIRTUAL_TO_PT_IDX(vaddr);
     uint32_t freed_size = 0;
 
-    while (freed_size < size && pt_idx < NUM_ENTRIES)
+    while (freed_size < size && pt_idx < NUM_PT_ENTRIES)
     {
-        if (pdt_idx == KERNEL_PT_PDT_IDX && pt_idx == KERNEL_TMP_PT_IDX)
+        if (IS_KERNEL_TMP_SLOT(pdt_idx, pt_idx))
         {
             /* can't touch this */
             return freed_size;
@@ -437,9 +1182,11 @@ pdt_load_process_pdt(
     uint32_t i;
 
     // TODO: Remove first page entry
-    pdt[0] = kernel_pdt[0];
+    for (i = 0; i < KERNEL_IDENTITY_PDT_ENTRIES; ++i) {
+        pdt[i] = kernel_pdt[i];
+    }
 
-    for (i = KERNEL_PDT_IDX; i < NUM_ENTRIES; ++i) {
+    for (i = KERNEL_PT_PDT_IDX; i < NUM_PDT_ENTRIES; ++i) {
         if (IS_ENTRY_PRESENT(kernel_pdt + i)) {
             pdt[i] = kernel_pdt[i];
         }
@@ -447,14 +1194,152 @@ pdt_load_process_pdt(
     pdt_set(pdt_paddr);
 }
 
+void
+pdt_load_kernel_pdt(
+    void)
+{
+    pdt_set(kernel_pdt_paddr);
+}
+
+int
+pdt_sync_kernel_memory(
+    struct pde *pdt,
+    uint32_t vaddr)
+{
+    uint32_t pdt_idx = VIRTUAL_TO_PDT_IDX(vaddr);
+
+    if (vaddr < KERNEL_START_VADDR ||
+        !IS_ENTRY_PRESENT(kernel_pdt + pdt_idx) ||
+        IS_ENTRY_PRESENT(pdt + pdt_idx))
+    {
+        return -1;
+    }
+
+    pdt[pdt_idx] = kernel_pdt[pdt_idx];
+    return 0;
+}
+
+#ifdef CONFIG_PAE
+/*
+ * Kernel paging structures for PAE mode. The boot code sets up 32-bit paging,
+ * these replace its tables once we know where everything is.
+ */
+static uint64_t pae_pdpt[PDPT_ENTRIES] __attribute__((aligned(32)));
+static struct pde pae_kernel_pdt[NUM_PDT_ENTRIES]
+    __attribute__((aligned(FOUR_KB)));
+static struct pte pae_kernel_pts[FOUR_MB / (NUM_PT_ENTRIES * FOUR_KB)]
+                                [NUM_PT_ENTRIES]
+    __attribute__((aligned(FOUR_KB)));
+
+void pae_enable(uint32_t pdpt_paddr);
+
+/*
+ * Rebuilds the boot mappings, the identity mapped first 4 MB and the kernel
+ * at KERNEL_START_VADDR, with 64-bit entries and switches the CPU to PAE.
+ */
+static void
+pae_init(
+    uint32_t *boot_pt)
+{
+    uint32_t i;
+    struct pte *pt = &pae_kernel_pts[0][0];
+
+    for (i = 0; i < FOUR_MB / FOUR_KB; ++i)
+    {
+        pt[i].value = boot_pt[i];
+    }
+
+    for (i = 0; i < KERNEL_IDENTITY_PDT_ENTRIES; ++i)
+    {
+        pae_kernel_pdt[i].value = ((paddr_t) i * PDT_ENTRY_SIZE) |
+            ENTRY_PS | ENTRY_PWT | ENTRY_RW | ENTRY_PRESENT;
+    }
+
+    for (i = 0; i < FOUR_MB / PDT_ENTRY_SIZE; ++i)
+    {
+        create_pdt_entry(pae_kernel_pdt, KERNEL_PT_PDT_IDX + i,
+                         VIRTUAL_TO_PHYSICAL((uint32_t) pae_kernel_pts[i]),
+                         PS_4KB, PAGING_READ_WRITE, PAGING_PL0);
+    }
+
+    for (i = 0; i < PDPT_ENTRIES; ++i)
+    {
+        pae_pdpt[i] = VIRTUAL_TO_PHYSICAL(
+            (uint32_t) (pae_kernel_pdt + i * NUM_PT_ENTRIES)) | ENTRY_PRESENT;
+    }
+
+    pae_enable(VIRTUAL_TO_PHYSICAL((uint32_t) pae_pdpt));
+
+    kernel_pdt = pae_kernel_pdt;
+    kernel_pdt_paddr = VIRTUAL_TO_PHYSICAL((uint32_t) pae_pdpt);
+    kernel_pt = pae_kernel_pts[KERNEL_TMP_PDT_IDX - KERNEL_PT_PDT_IDX];
+}
+#endif
+
+/*
+ * Takes [start, end) out of the first n entries of the memory map, splitting
+ * an entry it's in the middle of. Returns the new number of entries.
+ */
+static uint32_t
+mmap_reserve(
+    uint32_t n,
+    uint64_t start,
+    uint64_t end)
+{
+    uint32_t i, j;
+    uint64_t addr, stop;
+
+    for (i = 0; i < n; ++i)
+    {
+        addr = mmap[i].addr;
+        stop = addr + mmap[i].len;
+        if (end <= addr || start >= stop)
+        {
+            continue;
+        }
+
+        if (start > addr && end < stop && n < MAX_NUM_MEMORY_MAP)
+        {
+            for (j = n; j > i + 1; --j)
+            {
+                mmap[j] = mmap[j - 1];
+            }
+            mmap[i + 1].addr = end;
+            mmap[i + 1].len = stop - end;
+            mmap[i].len = start - addr;
+            ++n;
+            ++i;
+        }
+        else if (start > addr)
+        {
+            mmap[i].len = start - addr;
+        }
+        else if (end < stop)
+        {
+            mmap[i].addr = end;
+            mmap[i].len = stop - end;
+        }
+        else
+        {
+            for (j = i; j + 1 < n; ++j)
+            {
+                mmap[j] = mmap[j + 1];
+            }
+            --n;
+            --i;
+        }
+    }
+
+    return n;
+}
+
 static uint32_t fill_memory_map(
     uint32_t kernel_physical_start,
     uint32_t kernel_physical_end,
-    uint32_t kernel_virtual_start,
-    uint32_t kernel_virtual_end,
     struct multiboot_info *multiboot_info)
 {
-    uint32_t addr = 0, len = 0, i = 0;
+    uint64_t addr, end;
+    uint32_t i = 0;
 
     /*
      * Grub multiboot documents that flag[6] bit indicates presense of mmap_*
@@ -469,25 +1354,31 @@ static uint32_t fill_memory_map(
     multiboot_memory_map_t *entry =
         (multiboot_memory_map_t *) multiboot_info->mmap_addr;
     while ((uint32_t) entry < multiboot_info->mmap_addr +
-                              multiboot_info->mmap_length)
+                              multiboot_info->mmap_length &&
+           i < MAX_NUM_MEMORY_MAP)
     {
         if (entry->type == MULTIBOOT_MEMORY_AVAILABLE)
         {
-            addr = (uint32_t) entry->addr;
-            len = (uint32_t) entry->len;
-            if (addr <= kernel_physical_start
-                    && (addr + len) > kernel_physical_end)
+            /*
+             * Entries are 64 bits wide. Clip them to what the paging mode can
+             * address instead of truncating them.
+             */
+            addr = entry->addr;
+            end = entry->addr + entry->len;
+            if (end > MAX_PHYSICAL_ADDR)
             {
+                end = MAX_PHYSICAL_ADDR;
+            }
 
+            if (addr <= kernel_physical_start && end > kernel_physical_end)
+            {
                 addr = kernel_physical_end;
-                len = len - kernel_physical_end;
-
             }
 
-            if (addr > 0x100000)
+            if (addr > 0x100000 && addr < end)
             {
                 mmap[i].addr = addr;
-                mmap[i].len = len;
+                mmap[i].len = end - addr;
                 ++i;
             }
         }
@@ -495,13 +1386,29 @@ static uint32_t fill_memory_map(
             (((uint32_t) entry) + entry->size + sizeof(entry->size));
     }
 
+    /*
+     * Modules stay where the boot loader put them, see initrd.h.
+     */
+    if (multiboot_info->flags & MULTIBOOT_INFO_MODS)
+    {
+        multiboot_module_t *mods =
+            (multiboot_module_t *) multiboot_info->mods_addr;
+        uint32_t m;
+
+        for (m = 0; m < multiboot_info->mods_count; ++m)
+        {
+            i = mmap_reserve(i, mods[m].mod_start, mods[m].mod_end);
+        }
+    }
+
     return i;
 }
 
 static uint32_t
 construct_bitmap(struct memory_map *mmap, uint32_t n)
 {
-    uint32_t i, bitmap_pfs, bitmap_size, paddr, vaddr, mapped_mem;
+    uint32_t i, bitmap_pfs, bitmap_size, vaddr, mapped_mem;
+    paddr_t paddr;
     uint32_t total_pfs = 0;
 
     /*
@@ -509,7 +1416,7 @@ construct_bitmap(struct memory_map *mmap, uint32_t n)
      */
     for (i = 0; i < n; ++i)
     {
-        total_pfs += mmap[i].len / FOUR_KB;
+        total_pfs += mmap[i].len >> 12;
     }
 
     bitmap_pfs = div_ceil(div_ceil(total_pfs, 8), FOUR_KB);
@@ -541,17 +1448,17 @@ construct_bitmap(struct memory_map *mmap, uint32_t n)
     {
         printk("Could not find virtual address for bitmap in kernel. "
                "paddr: %X, bitmap_size: %u, bitmap_pfs: %u\n",
-               paddr, bitmap_size);
+               (uint32_t) paddr, bitmap_size, bitmap_pfs);
         return 1;
 
     }
 
     mapped_mem = pdt_map_kernel_memory(paddr, vaddr, bitmap_size,
-                                       PAGING_PL0, PAGING_READ_WRITE);
+                                       PAGING_READ_WRITE, PAGING_PL0);
     if (mapped_mem < bitmap_size) {
         printk("Could not map kernel memory for bitmap. "
                "paddr: %X, vaddr: %X, bitmap_size: %u\n",
-               paddr, vaddr, bitmap_size);
+               (uint32_t) paddr, vaddr, bitmap_size);
         return 1;
     }
 
@@ -564,6 +1471,7 @@ construct_bitmap(struct memory_map *mmap, uint32_t n)
     {
         *last |= 0x01 << (7 - i);
     }
+    page_frames.free = page_frames.len;
 
 
     return 0;
@@ -578,7 +1486,8 @@ frames_init(
     uint32_t kernel_pt_vaddr,
     struct multiboot_info *minfo)
 {
-    uint32_t i, addr, len;
+    uint32_t i;
+    paddr_t addr, len;
 
     printk("Kernel Address:\n");
     printk(" Physical: [%X ... %X]\n",
@@ -586,41 +1495,79 @@ frames_init(
     printk(" Virtual:  [%X ... %X]\n",
            kernel_virtual_start, kernel_virtual_end);
 
-    kernel_pdt =  (struct pdt *)kernel_pdt_vaddr;
-    kernel_pt = (struct pt *)kernel_pt_vaddr;
+#ifdef CONFIG_PAE
+    (void) kernel_pdt_vaddr;
+    pae_init((uint32_t *) kernel_pt_vaddr);
+    printk("Paging: PAE\n");
+#else
+    kernel_pdt = (struct pde *) kernel_pdt_vaddr;
+    kernel_pdt_paddr = kernel_pdt_vaddr;
+    kernel_pt = (struct pte *) kernel_pt_vaddr;
+#endif
 
     mmap_len = fill_memory_map(
         kernel_physical_start,
         kernel_physical_end,
-        kernel_virtual_start,
-        kernel_virtual_end,
         minfo);
 
     for (i = 0; i < mmap_len; ++i) {
         /*
          * Align addresses on 4KB blocks
          */
-        addr = align_up(mmap[i].addr, FOUR_KB);
-        len = align_down(mmap[i].len - (addr - mmap[i].addr), FOUR_KB);
+        addr = paddr_align_up(mmap[i].addr);
+        len = paddr_align_down(mmap[i].len - (addr - mmap[i].addr));
 
         mmap[i].addr = addr;
         mmap[i].len = len;
     }
 
     construct_bitmap(mmap, mmap_len);
+
+    printk("Physical memory: %u MB in %u page frames\n",
+           page_frames.len / (0x100000 / FOUR_KB), page_frames.len);
 }
 
-static void
-pfa_free(uint32_t paddr)
+void
+pfa_free(paddr_t paddr)
 {
     uint32_t bit_idx = idx_for_paddr(paddr);
     if (bit_idx == page_frames.len) {
-        printk("pfa_free: invalid paddr %X\n", paddr);
+        printk("pfa_free: invalid paddr %X\n", (uint32_t) paddr);
     } else {
         toggle_bit(bit_idx);
+        ++page_frames.free;
     }
 }
 
+uint32_t
+pfa_free_frames(
+    void)
+{
+    return page_frames.free;
+}
+
+uint32_t
+pfa_total_frames(
+    void)
+{
+    return page_frames.len;
+}
+
+void
+pfa_set_reclaimer(
+    struct pfa_reclaimer const *r)
+{
+    reclaimer = r;
+}
+
+void
+pfa_zero(paddr_t paddr)
+{
+    void *vaddr = kmap_frame(paddr);
+    memset(vaddr, 0, FOUR_KB);
+    kunmap_frame(vaddr);
+}
+
 static void
 toggle_bit(uint32_t bit_idx)
 {
@@ -635,16 +1582,18 @@ toggle_bits(uint32_t bit_idx, uint32_t num_bits)
     for (i = bit_idx; i < bit_idx + num_bits; ++i) {
         toggle_bit(i);
     }
+    page_frames.free -= num_bits;
 }
 
 static uint32_t
-idx_for_paddr(uint32_t paddr)
+idx_for_paddr(paddr_t paddr)
 {
-    uint32_t i, byte_offset = 0;
+    uint32_t i;
+    paddr_t byte_offset = 0;
     for (i = 0; i < mmap_len; ++i) {
         if (paddr < mmap[i].addr + mmap[i].len) {
             byte_offset += paddr - mmap[i].addr;
-            return byte_offset / FOUR_KB;
+            return byte_offset >> 12;
         } else {
             byte_offset += mmap[i].len;
         }
@@ -658,13 +1607,14 @@ fits_in_one_mmap_entry(
     uint32_t bit_idx,
     uint32_t pfs)
 {
-    uint32_t i, current_offset = 0, offset = bit_idx * FOUR_KB;
+    uint32_t i;
+    paddr_t current_offset = 0, offset = (paddr_t) bit_idx * FOUR_KB;
     for (i = 0; i < mmap_len; ++i) {
         if (current_offset + mmap[i].len <= offset) {
             current_offset += mmap[i].len;
         } else {
             offset -= current_offset;
-            if (offset + pfs * FOUR_KB <= mmap[i].len) {
+            if (offset + (paddr_t) pfs * FOUR_KB <= mmap[i].len) {
                 return 1;
             } else {
                 return 0;
@@ -675,11 +1625,12 @@ fits_in_one_mmap_entry(
     return 0;
 }
 
-static uint32_t
+static paddr_t
 paddr_for_idx(
     uint32_t bit_idx)
 {
-    uint32_t i, current_offset = 0, offset = bit_idx * FOUR_KB;
+    uint32_t i;
+    paddr_t current_offset = 0, offset = (paddr_t) bit_idx * FOUR_KB;
     for (i = 0; i < mmap_len; ++i) {
         if (current_offset + mmap[i].len <= offset) {
             current_offset += mmap[i].len;
@@ -692,8 +1643,8 @@ paddr_for_idx(
     return 0;
 }
 
-uint32_t
-pfa_allocate(
+static paddr_t
+pfa_find_and_allocate(
     uint32_t num_page_frames)
 {
     uint32_t i, j, cell, bit_idx;
@@ -728,6 +1679,73 @@ pfa_allocate(
     return 0;
 }
 
+paddr_t
+pfa_allocate(
+    uint32_t num_page_frames)
+{
+    uint32_t tries = 0;
+    paddr_t paddr = pfa_find_and_allocate(num_page_frames);
+
+    /*
+     * Out of frames: reclaim some from user space instead of failing. A
+     * contiguous request may need a few rounds.
+     */
+    while (paddr == 0 && reclaimer != NULL && tries++ < PFA_RECLAIM_TRIES &&
+           reclaimer->reclaim(num_page_frames) != 0)
+    {
+        paddr = pfa_find_and_allocate(num_page_frames);
+    }
+
+    if (reclaimer != NULL)
+    {
+        reclaimer->wakeup();
+    }
+
+    return paddr;
+}
+
+static uint32_t
+frames_are_free(
+    uint32_t bit_idx,
+    uint32_t num_bits)
+{
+    uint32_t i;
+    for (i = bit_idx; i < bit_idx + num_bits; ++i) {
+        if (((page_frames.start[i / 32] >> (31 - (i % 32))) & 0x1) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+paddr_t
+pfa_allocate_aligned(
+    uint32_t num_page_frames,
+    uint32_t alignment)
+{
+    uint32_t i, bit_idx;
+    paddr_t paddr, end;
+
+    /*
+     * Alignment is about physical addresses, not bit indices, so walk the
+     * aligned addresses of each memory region.
+     */
+    for (i = 0; i < mmap_len; ++i) {
+        paddr = (mmap[i].addr + alignment - 1) & ~((paddr_t) alignment - 1);
+        end = mmap[i].addr + mmap[i].len;
+        for (; paddr + (paddr_t) num_page_frames * FOUR_KB <= end;
+               paddr += alignment) {
+            bit_idx = idx_for_paddr(paddr);
+            if (frames_are_free(bit_idx, num_page_frames)) {
+                toggle_bits(bit_idx, num_page_frames);
+                return paddr;
+            }
+        }
+    }
+
+    return 0;
+}
+
 /**
  * Creates an entry in the page descriptor table at the specified index.
  * THe entry will point to the given PTE.
@@ -735,8 +1753,8 @@ pfa_allocate(
  * @param pdt   The page descriptor table
  * @param n     The index in the PDT
  * @param addr  The address to the first entry in the page table, or a
- *              4MB page frame
- * @param ps    Page size, either PS_4KB or PS_4MB
+ *              large page frame (4MB, or 2MB with PAE)
+ * @param ps    Page size, either PS_4KB or PS_LARGE
  * @param rw    Read/write permission, 0 = read-only, 1 = read and write
  * @param pl    The required privilege level to access the page,
  *              0 = PL0, 1 = PL3
@@ -745,17 +1763,11 @@ static void
 create_pdt_entry(
     struct pde *pdt,
     uint32_t n,
-    uint32_t addr,
+    paddr_t addr,
     uint8_t ps,
     uint8_t rw,
     uint8_t pl)
 {
-    /* Since page tables are aligned at 4kB boundaries, we only need to store
-     * the 20 highest bits */
-    /* The lower 4 bits */
-    pdt[n].low_addr  = ((addr >> 12) & 0xF) << 4;
-    pdt[n].high_addr = ((addr >> 16) & 0xFFFF);
-
     /*
      * name    | value | size | desc
      * ---------------------------
@@ -775,11 +1787,13 @@ create_pdt_entry(
      *      PS |    ps |    1 | Page size:
      *                              0 = address point to pt entry,
      *                              1 = address points to 4 MB page
+     *                                  (2 MB with PAE)
      * Ignored |     0 |    4 | Ignored
      *
-     * NOTE: Ignored is not part of pdt[n].config!
+     * Since page tables are aligned at 4kB boundaries, the address is stored
+     * in the bits above the 12 lowest (bits 12-31, or 12-51 with PAE).
      */
-    pdt[n].config =
+    pdt[n].value = (addr & ENTRY_ADDR_MASK) |
         ((ps & 0x01) << 7) | (0x01 << 3) | ((pl & 0x01) << 2) |
         ((rw & 0x01) << 1) | 0x01;
 }
@@ -798,16 +1812,10 @@ static void
 create_pt_entry(
     struct pte *pt,
     uint32_t n,
-    uint32_t addr,
+    paddr_t addr,
     uint8_t rw,
     uint8_t pl)
 {
-    /* Since page tables are aligned at 4kB boundaries, we only need to store
-     * the 20 highest bits */
-    /* The lower 4 bits */
-    pt[n].middle  = ((addr >> 12) & 0xF) << 4;
-    pt[n].high_addr = ((addr >> 16) & 0xFFFF);
-
     /*
      * name    | value | size | desc
      * ---------------------------
@@ -823,13 +1831,13 @@ create_pt_entry(
      *                              1 = writes are not cached
      *     PCD |     0 |    1 | Page-level cache disable
      *       A |     0 |    1 | Is set if the entry has been accessed
-     * Ignored |     0 |    1 | Ignored
+     *       D |     0 |    1 | Is set if the page has been written to
      *     PAT |     0 |    1 | 1 = PAT is support, 0 = PAT is not supported
      *       G |     0 |    1 | 1 = The PTE is global, 0 = The PTE is local
      * Ignored |     0 |    3 | Ignored
      *
-     * NOTE: G and Ignore are part of pt[n].middle, not pt[n].config!
+     * The page frame address is stored in the bits above the 12 lowest.
      */
-    pt[n].config =
+    pt[n].value = (addr & ENTRY_ADDR_MASK) |
         (0x01 << 3) | ((0x01 & pl) << 2) | ((0x01 & rw) << 1) | 0x01;
 }
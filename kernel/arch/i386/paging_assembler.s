@@ -17,9 +17,77 @@ pagetable_load:
     mov %eax, %cr3
     ret
 
+.global read_cr3
+.type read_cr3, @function
+read_cr3:
+    mov %cr3, %eax
+    ret
+
+.global read_cr4
+.type read_cr4, @function
+read_cr4:
+    mov %cr4, %eax
+    ret
+
+/*
+ * Flushes all of the TLB, by reloading the page directory.
+ */
+.global tlb_flush
+.type tlb_flush, @function
+tlb_flush:
+    mov %cr3, %eax
+    mov %eax, %cr3
+    ret
+
 .global invalidate_page_table_entry
 .type invalidate_page_table_entry, @function
 invalidate_page_table_entry:
     mov 4(%esp), %eax
     invlpg (%eax)
     ret
+
+.global read_cr2
+.type read_cr2, @function
+read_cr2:
+    mov %cr2, %eax        # linear address that caused the last page fault
+    ret
+
+/*
+ * Switches from 32-bit paging to PAE paging. CR4.PAE can't change while paging
+ * is enabled, so we drop to the identity mapped physical address of this code,
+ * turn paging off, load the PDPT and turn paging back on. The new tables must
+ * map both the identity mapped low memory and the higher half kernel.
+ */
+.set KERNEL_START_VADDR,    0xC0000000
+
+.global pae_enable
+.type pae_enable, @function
+pae_enable:
+    mov 4(%esp), %edx     # physical address of the PDPT
+    pushf
+    cli                   # the IDT and GDT are unreachable with paging off
+
+    mov $(pae_enable_low - KERNEL_START_VADDR), %eax
+    jmp *%eax
+
+pae_enable_low:
+    mov %cr0, %eax
+    and $0x7FFFFFFF, %eax # disable paging
+    mov %eax, %cr0
+
+    mov %cr4, %eax
+    or  $0x00000020, %eax # set bit enabling PAE
+    mov %eax, %cr4
+
+    mov %edx, %cr3        # load the PDPT
+
+    mov %cr0, %eax
+    or  $0x80000000, %eax # enable paging again
+    mov %eax, %cr0
+
+    lea pae_enable_high, %eax
+    jmp *%eax
+
+pae_enable_high:
+    popf
+    ret
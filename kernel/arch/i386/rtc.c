@@ -0,0 +1,142 @@
+#include <string.h>
+
+#include "io.h"
+#include "rtc.h"
+
+#define CMOS_ADDRESS 0x70
+#define CMOS_DATA    0x71
+
+/*
+ * CMOS registers
+ */
+#define RTC_SECONDS  0x00
+#define RTC_MINUTES  0x02
+#define RTC_HOURS    0x04
+#define RTC_DAY      0x07
+#define RTC_MONTH    0x08
+#define RTC_YEAR     0x09
+#define RTC_STATUS_A 0x0A
+#define RTC_STATUS_B 0x0B
+
+#define STATUS_A_UPDATING 0x80
+#define STATUS_B_24H      0x02
+#define STATUS_B_BINARY   0x04
+#define HOURS_PM          0x80
+
+struct rtc_time {
+    uint8_t seconds;
+    uint8_t minutes;
+    uint8_t hours;
+    uint8_t day;
+    uint8_t month;
+    uint8_t year;
+};
+
+static uint8_t
+cmos_read(
+    uint8_t reg)
+{
+    outb(CMOS_ADDRESS, reg);
+    return inb(CMOS_DATA);
+}
+
+static void
+read_time(
+    struct rtc_time *t)
+{
+    while (cmos_read(RTC_STATUS_A) & STATUS_A_UPDATING);
+
+    t->seconds = cmos_read(RTC_SECONDS);
+    t->minutes = cmos_read(RTC_MINUTES);
+    t->hours = cmos_read(RTC_HOURS);
+    t->day = cmos_read(RTC_DAY);
+    t->month = cmos_read(RTC_MONTH);
+    t->year = cmos_read(RTC_YEAR);
+}
+
+static uint32_t
+from_bcd(
+    uint32_t value)
+{
+    return (value & 0x0F) + (value >> 4) * 10;
+}
+
+/*
+ * Days from the epoch to the given date of the proleptic Gregorian
+ * calendar, counting years from March so the leap day comes last.
+ */
+static uint32_t
+days_since_epoch(
+    uint32_t year,
+    uint32_t month,
+    uint32_t day)
+{
+    uint32_t era, year_of_era, day_of_year, day_of_era;
+
+    year -= month <= 2;
+    era = year / 400;
+    year_of_era = year - era * 400;
+    day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 +
+                  day - 1;
+    day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 +
+                 day_of_year;
+
+    return era * 146097 + day_of_era - 719468;
+}
+
+uint32_t
+rtc_read_seconds(
+    void)
+{
+    struct rtc_time t, again;
+    uint32_t status, hours, pm, year, month, day;
+
+    /*
+     * The clock may tick between reads of its registers, read until two
+     * reads agree.
+     */
+    read_time(&t);
+    for (;;)
+    {
+        read_time(&again);
+        if (memcmp(&t, &again, sizeof(t)) == 0)
+        {
+            break;
+        }
+        t = again;
+    }
+
+    status = cmos_read(RTC_STATUS_B);
+    pm = t.hours & HOURS_PM;
+    hours = t.hours & ~HOURS_PM;
+    year = t.year;
+    month = t.month;
+    day = t.day;
+    if (!(status & STATUS_B_BINARY))
+    {
+        t.seconds = from_bcd(t.seconds);
+        t.minutes = from_bcd(t.minutes);
+        hours = from_bcd(hours);
+        year = from_bcd(year);
+        month = from_bcd(month);
+        day = from_bcd(day);
+    }
+    if (!(status & STATUS_B_24H))
+    {
+        hours = hours % 12 + (pm ? 12 : 0);
+    }
+
+    /*
+     * Only two digits of the year; the century register isn't standard.
+     */
+    year += year < 70 ? 2000 : 1900;
+
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hours > 23 ||
+        t.minutes > 59 || t.seconds > 59)
+    {
+        return 0;
+    }
+
+    return days_since_epoch(year, month, day) * 86400 + hours * 3600 +
+           t.minutes * 60 + t.seconds;
+}
@@ -0,0 +1,15 @@
+#ifndef _NEWBOS_RTC_H
+#define _NEWBOS_RTC_H
+
+#include <stdint.h>
+
+/*
+ * Reads the CMOS real time clock, taken to be in UTC. Returns the seconds
+ * since the epoch, 1970-01-01 00:00:00, or 0 if the clock makes no sense.
+ */
+uint32_t
+rtc_read_seconds(
+    void
+);
+
+#endif
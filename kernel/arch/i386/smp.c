@@ -0,0 +1,518 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/clocksource.h>
+#include <newbos/fpu.h>
+#include <newbos/hrtimer.h>
+#include <newbos/paging.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/syscall.h>
+#include <newbos/timekeeping.h>
+#include <newbos/timer.h>
+
+#include "acpi.h"
+#include "double_fault.h"
+#include "gdt.h"
+#include "interrupts.h"
+#include "lapic.h"
+
+/*
+ * Where the startup code for the other CPUs is copied to, see
+ * smp_trampoline.s. It's identity mapped and never handed out by the page
+ * frame allocator, which only uses memory above 1 MB.
+ */
+#define TRAMPOLINE_PADDR 0x8000
+
+#define AP_STACK_SIZE  (2 * PAGE_SIZE)
+
+/*
+ * Timer ticks to wait for a CPU to come up before giving up on it.
+ */
+#define AP_START_TIMEOUT_TICKS (TIMER_FREQUENCY / 10)
+
+/*
+ * Ticks to wait after INIT, 10 ms, and between the startup IPIs, 200 us.
+ * The first tick of a wait may come right away, hence one more.
+ */
+#define AP_INIT_DELAY_TICKS    (TIMER_FREQUENCY / 100 + 1)
+#define AP_STARTUP_DELAY_TICKS 2
+
+#define SEGSEL_KERNEL_DS 0x10
+
+/*
+ * Longest an idle CPU other than the first sleeps without a tick, a second.
+ */
+#define IDLE_MAX_TICKS TIMER_FREQUENCY
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint32_t smp_trampoline_cr3[];
+extern uint32_t smp_trampoline_cr4[];
+extern uint32_t smp_trampoline_stack[];
+extern uint32_t smp_trampoline_entry[];
+
+uint32_t read_cr3(void);
+uint32_t read_cr4(void);
+void tlb_flush(void);
+
+/*
+ * Set once the APIC IDs of the CPUs are known, smp_cpu_id() returns 0
+ * before.
+ */
+static uint32_t smp_started;
+
+static uint32_t num_cpus = 1;
+static uint8_t cpu_apic_ids[MAX_CPUS];
+static uint8_t apic_to_cpu[256];
+static volatile uint32_t cpu_online[MAX_CPUS];
+
+/*
+ * The scheduler tick of the CPUs other than the first, which gets it from
+ * the PIT.
+ */
+static struct hrtimer tick_timers[MAX_CPUS];
+
+/*
+ * Set by smp_flush_tlb() for every other online CPU, cleared by the CPU
+ * once it flushed its TLB.
+ */
+static volatile uint32_t flush_pending[MAX_CPUS];
+
+/*
+ * The kernel lock is a ticket lock, so CPUs get it in the order they asked
+ * for it: a CPU takes the next ticket and waits until it's served.
+ */
+static volatile uint32_t lock_next_ticket;
+static volatile uint32_t lock_serving;
+static uint32_t lock_depth[MAX_CPUS];
+
+/*
+ * What the other CPUs run when there is nothing else, kernel_main() plays
+ * this part on the first one.
+ */
+static struct process idle_processes[MAX_CPUS];
+
+static uint32_t
+trampoline_paddr(
+    void const *sym)
+{
+    return TRAMPOLINE_PADDR + ((uint8_t const *) sym - smp_trampoline_start);
+}
+
+uint32_t
+smp_cpu_id(
+    void)
+{
+    if (!smp_started)
+    {
+        return 0;
+    }
+    return apic_to_cpu[lapic_id()];
+}
+
+uint32_t
+smp_num_cpus(
+    void)
+{
+    uint32_t cpu, n = 0;
+    for (cpu = 0; cpu < num_cpus; ++cpu)
+    {
+        n += cpu_online[cpu];
+    }
+    return n;
+}
+
+int
+smp_cpu_online(
+    uint32_t cpu)
+{
+    return cpu == 0 || (cpu < num_cpus && cpu_online[cpu]);
+}
+
+static void
+handle_tlb_flush(
+    uint32_t cpu)
+{
+    if (flush_pending[cpu])
+    {
+        tlb_flush();
+        flush_pending[cpu] = 0;
+    }
+}
+
+void
+lock_kernel(
+    void)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t cpu = smp_cpu_id(), ticket;
+
+    if (lock_depth[cpu]++ == 0)
+    {
+        ticket = __atomic_fetch_add(&lock_next_ticket, 1, __ATOMIC_RELAXED);
+
+        /*
+         * The holder may be waiting for us to flush our TLB, with
+         * interrupts disabled we have to look for that ourselves.
+         */
+        while (__atomic_load_n(&lock_serving, __ATOMIC_ACQUIRE) != ticket)
+        {
+            handle_tlb_flush(cpu);
+            __builtin_ia32_pause();
+        }
+    }
+
+    restore_interrupts(flags);
+}
+
+void
+unlock_kernel(
+    void)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t cpu = smp_cpu_id();
+
+    if (--lock_depth[cpu] == 0)
+    {
+        __atomic_store_n(&lock_serving, lock_serving + 1, __ATOMIC_RELEASE);
+    }
+
+    restore_interrupts(flags);
+}
+
+uint32_t
+kernel_lock_depth(
+    void)
+{
+    return lock_depth[smp_cpu_id()];
+}
+
+void
+kernel_lock_set_depth(
+    uint32_t depth)
+{
+    lock_depth[smp_cpu_id()] = depth;
+}
+
+void
+smp_send_reschedule(
+    uint32_t cpu)
+{
+    if (cpu < num_cpus && cpu_online[cpu] && cpu != smp_cpu_id())
+    {
+        lapic_send_ipi(cpu_apic_ids[cpu], LAPIC_ICR_FIXED | RESCHEDULE_VECTOR);
+    }
+}
+
+void
+smp_idle(
+    uint32_t max_ticks)
+{
+    struct hrtimer *tick;
+
+    if (smp_cpu_id() == 0)
+    {
+        timer_idle(max_ticks);
+        return;
+    }
+
+    if (max_ticks <= 1)
+    {
+        enable_interrupts_and_halt();
+        return;
+    }
+
+    /*
+     * Put the tick off, the CPU wakes up for the first timer then, and
+     * bring it back on the next tick from when it does.
+     */
+    tick = tick_timers + smp_cpu_id();
+    lock_kernel();
+    hrtimer_start(tick, ktime_get_ns() +
+                        (uint64_t) max_ticks * NSEC_PER_TICK);
+    unlock_kernel();
+
+    enable_interrupts_and_halt();
+    disable_interrupts();
+
+    lock_kernel();
+    hrtimer_start(tick, ktime_get_ns() + NSEC_PER_TICK);
+    unlock_kernel();
+    enable_interrupts();
+}
+
+void
+smp_flush_tlb(
+    void)
+{
+    uint32_t self, cpu, others = 0;
+
+    if (num_cpus == 1)
+    {
+        return;
+    }
+
+    self = smp_cpu_id();
+    for (cpu = 0; cpu < num_cpus; ++cpu)
+    {
+        if (cpu != self && cpu_online[cpu])
+        {
+            flush_pending[cpu] = 1;
+            ++others;
+        }
+    }
+    if (others == 0)
+    {
+        return;
+    }
+
+    lapic_send_ipi_others(TLB_FLUSH_VECTOR);
+
+    for (cpu = 0; cpu < num_cpus; ++cpu)
+    {
+        while (flush_pending[cpu])
+        {
+            __builtin_ia32_pause();
+        }
+    }
+}
+
+static void
+tlb_flush_handler(
+    registers_t *regs)
+{
+    (void) regs;
+    handle_tlb_flush(smp_cpu_id());
+    lapic_eoi();
+}
+
+static void
+spurious_handler(
+    registers_t *regs)
+{
+    (void) regs;
+}
+
+static void
+reschedule_handler(
+    registers_t *regs)
+{
+    (void) regs;
+    lapic_eoi();
+}
+
+static void
+lapic_timer_handler(
+    registers_t *regs)
+{
+    (void) regs;
+    lapic_eoi();
+    hrtimer_interrupt();
+}
+
+static int
+tick_timer_fn(
+    struct hrtimer *t)
+{
+    hrtimer_forward(t, ktime_get_ns(), NSEC_PER_TICK);
+    scheduler_tick();
+    return HRTIMER_RESTART;
+}
+
+static void
+wait_ticks(
+    uint32_t n)
+{
+    uint32_t start = timer_ticks();
+    while (timer_ticks() - start < n);
+}
+
+/*
+ * Where the other CPUs enter the kernel, on the stack smp_init() gave them,
+ * with paging enabled but interrupts disabled.
+ */
+static void
+ap_main(
+    void)
+{
+    uint32_t cpu = smp_cpu_id();
+    struct process *idle = idle_processes + cpu;
+
+    gdt_init(tss_init());
+    interrupts_init_ap();
+    double_fault_init_cpu();
+    fpu_init_cpu();
+    syscall_init_cpu();
+    lapic_setup(0);
+
+    cpu_online[cpu] = 1;
+
+    lock_kernel();
+    printk("ap_main: CPU %u online. apic id: %u\n", cpu, lapic_id());
+    scheduler_init_cpu(idle);
+    lapic_timer_init_cpu();
+    hrtimer_init(tick_timers + cpu, tick_timer_fn);
+    hrtimer_start(tick_timers + cpu, ktime_get_ns() + NSEC_PER_TICK);
+    unlock_kernel();
+
+    /*
+     * Idle: let runnable processes run, halt until an interrupt when there
+     * are none. Nothing on this CPU needs its tick meanwhile; wake up now
+     * and then anyway, to look for work on the other CPUs.
+     */
+    for (;;)
+    {
+        scheduler_idle(IDLE_MAX_TICKS);
+    }
+}
+
+static void
+free_stack(
+    paddr_t paddr)
+{
+    uint32_t i;
+
+    for (i = 0; i < AP_STACK_SIZE; i += PAGE_SIZE)
+    {
+        pfa_free(paddr + i);
+    }
+}
+
+static int
+start_ap(
+    uint32_t cpu)
+{
+    uint32_t stack_vaddr, start;
+    paddr_t stack_paddr;
+
+    stack_paddr = pfa_allocate(AP_STACK_SIZE / PAGE_SIZE);
+    if (stack_paddr == 0)
+    {
+        printk("start_ap: Could not allocate a stack. cpu: %u\n", cpu);
+        return -1;
+    }
+
+    stack_vaddr = pdt_kernel_find_next_vaddr(AP_STACK_SIZE);
+    if (stack_vaddr == 0 ||
+        pdt_map_kernel_memory(stack_paddr, stack_vaddr, AP_STACK_SIZE,
+                              PAGING_READ_WRITE, PAGING_PL0) != AP_STACK_SIZE)
+    {
+        printk("start_ap: Could not map a stack. cpu: %u\n", cpu);
+        if (stack_vaddr != 0)
+        {
+            pdt_unmap_kernel_memory(stack_vaddr, AP_STACK_SIZE);
+        }
+        free_stack(stack_paddr);
+        return -1;
+    }
+
+    idle_processes[cpu].kernel_stack_start_vaddr =
+        stack_vaddr + AP_STACK_SIZE - 4;
+    *(uint32_t *) trampoline_paddr(smp_trampoline_stack) =
+        stack_vaddr + AP_STACK_SIZE;
+
+    /*
+     * INIT, then the startup IPI twice, as the MP specification says.
+     */
+    lapic_send_ipi(cpu_apic_ids[cpu],
+                   LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    lapic_send_ipi(cpu_apic_ids[cpu], LAPIC_ICR_INIT | LAPIC_ICR_LEVEL);
+    wait_ticks(AP_INIT_DELAY_TICKS);
+
+    start = timer_ticks();
+    lapic_send_ipi(cpu_apic_ids[cpu],
+                   LAPIC_ICR_STARTUP | (TRAMPOLINE_PADDR >> 12));
+    wait_ticks(AP_STARTUP_DELAY_TICKS);
+    if (!cpu_online[cpu])
+    {
+        lapic_send_ipi(cpu_apic_ids[cpu],
+                       LAPIC_ICR_STARTUP | (TRAMPOLINE_PADDR >> 12));
+    }
+
+    while (!cpu_online[cpu])
+    {
+        if (timer_ticks() - start > AP_START_TIMEOUT_TICKS)
+        {
+            printk("start_ap: CPU didn't start. apic id: %u\n",
+                   cpu_apic_ids[cpu]);
+
+            /*
+             * Hold it in INIT, so it can't start on the stack later.
+             */
+            lapic_send_ipi(cpu_apic_ids[cpu],
+                           LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+            pdt_unmap_kernel_memory(stack_vaddr, AP_STACK_SIZE);
+            free_stack(stack_paddr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+smp_init(
+    void)
+{
+    struct acpi_madt madt;
+    uint32_t cpu, bsp_apic_id, next = 1;
+
+    lock_kernel();
+
+    if (acpi_find_madt(&madt) != 0 || lapic_init(madt.lapic_paddr) != 0)
+    {
+        printk("smp_init: Running on one CPU.\n");
+        return;
+    }
+
+    bsp_apic_id = lapic_id();
+    cpu_apic_ids[0] = bsp_apic_id;
+    for (cpu = 0; cpu < madt.num_cpus && next < MAX_CPUS; ++cpu)
+    {
+        if (madt.apic_ids[cpu] != bsp_apic_id)
+        {
+            cpu_apic_ids[next] = madt.apic_ids[cpu];
+            apic_to_cpu[madt.apic_ids[cpu]] = next;
+            ++next;
+        }
+    }
+    apic_to_cpu[bsp_apic_id] = 0;
+    cpu_online[0] = 1;
+    smp_started = 1;
+
+    lapic_setup(1);
+
+    register_isr_handler_unlocked(TLB_FLUSH_VECTOR, tlb_flush_handler);
+    register_isr_handler_unlocked(SPURIOUS_VECTOR, spurious_handler);
+    register_isr_handler(RESCHEDULE_VECTOR, reschedule_handler);
+    register_isr_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+
+    lapic_timer_calibrate();
+    lapic_timer_init_cpu();
+
+    if (next == 1)
+    {
+        printk("smp_init: Running on one CPU.\n");
+        return;
+    }
+
+    memcpy((void *) TRAMPOLINE_PADDR, smp_trampoline_start,
+           smp_trampoline_end - smp_trampoline_start);
+    *(uint32_t *) trampoline_paddr(smp_trampoline_cr3) = read_cr3();
+    *(uint32_t *) trampoline_paddr(smp_trampoline_cr4) = read_cr4();
+    *(uint32_t *) trampoline_paddr(smp_trampoline_entry) = (uint32_t) ap_main;
+
+    for (cpu = 1; cpu < next; ++cpu)
+    {
+        num_cpus = cpu + 1;
+        if (start_ap(cpu) != 0)
+        {
+            num_cpus = cpu;
+            break;
+        }
+    }
+
+    printk("smp_init: %u CPUs online.\n", smp_num_cpus());
+}
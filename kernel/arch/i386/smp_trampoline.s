@@ -0,0 +1,84 @@
+/*
+ * Startup code for the other CPUs. A startup IPI starts them in real mode at
+ * the start of a page below 1 MB; smp_init() copies this code there, to
+ * TRAMPOLINE_PADDR, and fills in the variables at the end. The code switches
+ * to protected mode with a temporary GDT, enables paging with the kernel's
+ * page directory and jumps to the kernel, on the stack it was given.
+ *
+ * The code doesn't run where it's linked, so all addresses are computed
+ * relative to smp_trampoline_start.
+ */
+.set TRAMPOLINE_PADDR, 0x8000
+
+.section .text
+.align 4
+
+.code16
+.global smp_trampoline_start
+smp_trampoline_start:
+    cli
+    cld
+    xor     %ax, %ax
+    mov     %ax, %ds
+
+    lgdtl   (TRAMPOLINE_PADDR + trampoline_gdt_ptr - smp_trampoline_start)
+
+    mov     %cr0, %eax
+    or      $0x1, %eax            # protected mode
+    mov     %eax, %cr0
+
+    ljmpl   $0x08, $(TRAMPOLINE_PADDR + trampoline_protected - smp_trampoline_start)
+
+.code32
+trampoline_protected:
+    mov     $0x10, %ax
+    mov     %ax, %ds
+    mov     %ax, %es
+    mov     %ax, %fs
+    mov     %ax, %gs
+    mov     %ax, %ss
+
+    mov     (TRAMPOLINE_PADDR + smp_trampoline_cr4 - smp_trampoline_start), %eax
+    mov     %eax, %cr4            # 4 MB pages, PAE if the kernel uses it
+    mov     (TRAMPOLINE_PADDR + smp_trampoline_cr3 - smp_trampoline_start), %eax
+    mov     %eax, %cr3
+
+    mov     %cr0, %eax
+    or      $0x80010000, %eax     # paging, WP like the boot CPU
+    mov     %eax, %cr0
+
+    mov     (TRAMPOLINE_PADDR + smp_trampoline_stack - smp_trampoline_start), %esp
+    mov     (TRAMPOLINE_PADDR + smp_trampoline_entry - smp_trampoline_start), %eax
+    call    *%eax
+
+trampoline_hang:
+    cli
+    hlt
+    jmp     trampoline_hang
+
+.align 8
+trampoline_gdt:
+    .quad 0x0000000000000000
+    .quad 0x00CF9A000000FFFF      # code, base 0, 4 GB, 32 bit
+    .quad 0x00CF92000000FFFF      # data, base 0, 4 GB, 32 bit
+
+trampoline_gdt_ptr:
+    .word 3 * 8 - 1
+    .long (TRAMPOLINE_PADDR + trampoline_gdt - smp_trampoline_start)
+
+.align 4
+.global smp_trampoline_cr3
+smp_trampoline_cr3:
+    .long 0
+.global smp_trampoline_cr4
+smp_trampoline_cr4:
+    .long 0
+.global smp_trampoline_stack
+smp_trampoline_stack:
+    .long 0
+.global smp_trampoline_entry
+smp_trampoline_entry:
+    .long 0
+
+.global smp_trampoline_end
+smp_trampoline_end:
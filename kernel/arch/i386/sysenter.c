@@ -0,0 +1,119 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/syscall.h>
+
+#include "interrupts.h"
+#include "memory.h"
+
+/*
+ * CPUID leaf 1 feature flags, in edx.
+ */
+#define CPUID_SEP 0x00000800
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+/*
+ * SYSENTER loads cs from the MSR and ss from the next GDT entry, SYSEXIT
+ * the user ones from the two after.
+ */
+#define SEGSEL_KERNEL_CS 0x08
+
+uint32_t cpuid_features(void);
+void write_msr(uint32_t msr, uint64_t value);
+
+void sysenter_entry(void);
+
+extern uint8_t syscall_page_sysenter[];
+extern uint8_t syscall_page_sysenter_return[];
+extern uint8_t syscall_page_sysenter_end[];
+extern uint8_t syscall_page_int80[];
+extern uint8_t syscall_page_int80_end[];
+
+/*
+ * Where SYSEXIT returns to in the syscall page, see sysenter_assembler.s.
+ */
+uint32_t sysenter_return_eip;
+
+static int use_sysenter;
+
+/*
+ * A page of its own, nothing else of the kernel's may be mapped into
+ * processes with it.
+ */
+static uint8_t syscall_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static void
+syscall_trap(
+    registers_t *regs)
+{
+    uint32_t args[SYSCALL_MAX_ARGS] = {
+        regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi
+    };
+
+    regs->eax = (uint32_t) syscall_dispatch(regs->eax, args);
+}
+
+void
+syscall_init(
+    void)
+{
+    use_sysenter = (cpuid_features() & CPUID_SEP) != 0;
+
+    if (use_sysenter)
+    {
+        memcpy(syscall_page, syscall_page_sysenter,
+               syscall_page_sysenter_end - syscall_page_sysenter);
+        sysenter_return_eip = SYSCALL_PAGE_VADDR +
+            (syscall_page_sysenter_return - syscall_page_sysenter);
+    }
+    else
+    {
+        memcpy(syscall_page, syscall_page_int80,
+               syscall_page_int80_end - syscall_page_int80);
+    }
+
+    register_trap_handler(SYSCALL_VECTOR, syscall_trap);
+    syscall_init_cpu();
+
+    printk("syscall_init: System calls enabled. sysenter: %u\n", use_sysenter);
+}
+
+void
+syscall_init_cpu(
+    void)
+{
+    if (!use_sysenter)
+    {
+        return;
+    }
+
+    /*
+     * SYSENTER doesn't switch stacks through the TSS like an interrupt
+     * does; it starts on the TSS's esp0 field, which the entry code loads
+     * the stack pointer from.
+     */
+    write_msr(MSR_SYSENTER_CS, SEGSEL_KERNEL_CS);
+    write_msr(MSR_SYSENTER_ESP, tss_init() + offsetof(struct tss, esp0));
+    write_msr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+}
+
+int
+syscall_map(
+    struct pde *pdt)
+{
+    if (pdt_map_memory(pdt, VIRTUAL_TO_PHYSICAL((uint32_t) syscall_page),
+                       SYSCALL_PAGE_VADDR, PAGE_SIZE, PAGING_READ_ONLY,
+                       PAGING_PL3) != PAGE_SIZE)
+    {
+        printk("syscall_map: Could not map the syscall page. pdt: %X\n",
+               (uint32_t) pdt);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+.section .text
+.align 4
+
+.set USER_CS, 0x1B
+.set USER_DS, 0x23
+.set KERNEL_DS, 0x10
+.set EFLAGS_IF, 0x200
+.set SYSCALL_VECTOR, 0x80
+
+/*
+ * Where SYSENTER enters the kernel, with interrupts disabled and the stack
+ * pointer at the esp0 field of the CPU's TSS. The syscall page passed the
+ * user stack pointer in ebp and is returned to at sysenter_return_eip.
+ * Builds the frame int 0x80 would have, and handles the call the same way.
+ */
+.global sysenter_entry
+.type sysenter_entry, @function
+sysenter_entry:
+    mov     (%esp), %esp            # kernel stack of the running process
+    push    $USER_DS                # ss
+    push    %ebp                    # useresp
+    pushf
+    orl     $EFLAGS_IF, (%esp)      # eflags, as they were in user mode
+    push    $USER_CS                # cs
+    pushl   sysenter_return_eip     # eip
+    push    $0                      # error code
+    push    $SYSCALL_VECTOR
+    pusha
+    push    %ds
+    push    %es
+    push    %fs
+    push    %gs
+    mov     $KERNEL_DS, %ax
+    mov     %ax, %ds
+    mov     %ax, %es
+    mov     %ax, %fs
+    mov     %ax, %gs
+    push    %esp
+    call    interrupt_handler
+    mov     %eax, %esp
+
+    # The handler may have switched to another process. Leave with SYSEXIT
+    # if the frame goes back to the syscall page, which doesn't care about
+    # the edx and ecx SYSEXIT takes the return address and stack in;
+    # anywhere else, as an interrupt would. eip and cs are at 56 and 60.
+    cmpl    $USER_CS, 60(%esp)
+    jne     1f
+    mov     56(%esp), %eax
+    cmp     sysenter_return_eip, %eax
+    jne     1f
+
+    pop     %gs
+    pop     %fs
+    pop     %es
+    pop     %ds
+    popa
+    addl    $8, %esp                # interrupt number and error code
+    mov     (%esp), %edx            # eip
+    mov     12(%esp), %ecx          # useresp
+    andl    $0xFFFFFDFF, 8(%esp)    # interrupts stay disabled until sysexit
+    addl    $8, %esp
+    popf
+    sti
+    sysexit
+
+1:
+    pop     %gs
+    pop     %fs
+    pop     %es
+    pop     %ds
+    popa
+    addl    $8, %esp
+    iret
+
+/*
+ * The entry stubs, one of which is copied to the start of the syscall
+ * page. They only use relative addresses.
+ */
+.global syscall_page_sysenter
+syscall_page_sysenter:
+    push    %ecx
+    push    %edx
+    push    %ebp
+    mov     %esp, %ebp
+    sysenter
+.global syscall_page_sysenter_return
+syscall_page_sysenter_return:
+    pop     %ebp
+    pop     %edx
+    pop     %ecx
+    ret
+.global syscall_page_sysenter_end
+syscall_page_sysenter_end:
+
+.global syscall_page_int80
+syscall_page_int80:
+    int     $0x80
+    ret
+.global syscall_page_int80_end
+syscall_page_int80_end:
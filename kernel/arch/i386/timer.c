@@ -1,35 +1,146 @@
 #include <newbos/timer.h>
+#include <newbos/hrtimer.h>
 #include <newbos/printk.h>
+#include <newbos/scheduler.h>
+#include <newbos/softirq.h>
+#include <newbos/timekeeping.h>
 
 #include "interrupts.h"
 #include "io.h"
 
+/*
+ * Input clock of the PIT, in Hz.
+ */
+#define PIT_FREQUENCY 1193180
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+
+/*
+ * Channel 0, low then high byte of the count, and the mode: 3 is a
+ * periodic square wave, 0 interrupts once when the count runs out.
+ */
+#define PIT_PERIODIC 0x36
+#define PIT_ONESHOT  0x30
+#define PIT_LATCH    0x00
+
 uint32_t tick = 0;
 
+static uint16_t divisor;
+
+/*
+ * Ticks the PIT was programmed to cover with a single interrupt, while it's
+ * in one-shot mode, and the count it was programmed with.
+ */
+static uint32_t oneshot_ticks;
+static uint32_t oneshot_count;
+
+static void
+pit_program(uint8_t mode, uint16_t count)
+{
+    outb(PIT_COMMAND, mode);
+    outb(PIT_CHANNEL0, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)((count >> 8) & 0xFF));
+}
+
 static void
 timer_callback(registers_t* regs)
 {
-    tick += 1;
-    printk("Tick: %X\n", tick);
+    (void) regs;
+
+    if (oneshot_ticks != 0)
+    {
+        tick += oneshot_ticks;
+        oneshot_ticks = 0;
+        pit_program(PIT_PERIODIC, divisor);
+    }
+    else
+    {
+        tick += 1;
+    }
+    timekeeping_tick();
+    hrtimer_tick();
+    raise_softirq(SOFTIRQ_TIMER);
+    scheduler_tick();
+}
+
+uint32_t
+timer_ticks(void)
+{
+    return tick;
 }
 
 void
-timer_init(int16_t frequency)
+timer_init(uint32_t frequency)
 {
+    uint32_t count = frequency != 0 ? PIT_FREQUENCY / frequency : 0;
+
     register_irq_handler(IRQ0, &timer_callback);
 
     // The value we send to the PIT is the value to divide it's input clock
     // (1193180 Hz) by, to get our required frequency. Important to note is
-    // that the divisor must be small enough to fit into 16-bits.
-    int16_t divisor = 1193180 / frequency;
+    // that the divisor must be small enough to fit into 16-bits, so the
+    // PIT can't go slower than about 19 Hz.
+    if (count == 0 || count > 0xFFFF)
+    {
+        count = count == 0 ? 1 : 0xFFFF;
+        printk("timer_init: Frequency out of range. frequency: %u, "
+               "divisor: %u\n", frequency, count);
+    }
+    divisor = (uint16_t) count;
+
+    pit_program(PIT_PERIODIC, divisor);
+}
+
+void
+timer_idle(uint32_t max_ticks)
+{
+    uint32_t max_oneshot = 0xFFFF / divisor, remaining;
+
+    if (max_ticks > max_oneshot)
+    {
+        max_ticks = max_oneshot;
+    }
+    if (max_ticks <= 1)
+    {
+        enable_interrupts_and_halt();
+        return;
+    }
+
+    /*
+     * The next tick is due within a tick, the one-shot starts counting from
+     * now; the difference is lost, as if the ticks had come late.
+     */
+    oneshot_ticks = max_ticks;
+    oneshot_count = max_ticks * divisor;
+    pit_program(PIT_ONESHOT, (uint16_t) oneshot_count);
+
+    enable_interrupts_and_halt();
+    disable_interrupts();
+
+    if (oneshot_ticks == 0)
+    {
+        enable_interrupts();
+        return;
+    }
 
-    // send command byte.
-    outb(0x43, 0x36);
+    /*
+     * Woken up by another interrupt. Account for the ticks that passed and
+     * get back in step with a one-shot up to the next tick, the timer
+     * interrupt goes back to periodic from there.
+     */
+    outb(PIT_COMMAND, PIT_LATCH);
+    remaining = inb(PIT_CHANNEL0);
+    remaining |= (uint32_t) inb(PIT_CHANNEL0) << 8;
 
-    uint8_t l = (uint8_t)(divisor & 0xFF);
-    uint8_t h = (uint8_t)((divisor >> 8) & 0xFF);
+    if (remaining != 0 && remaining <= oneshot_count)
+    {
+        uint32_t elapsed = oneshot_count - remaining;
 
-    // send the frequency divisor.
-    outb(0x40, l);
-    outb(0x40, h);
+        tick += elapsed / divisor;
+        oneshot_ticks = 1;
+        oneshot_count = divisor - elapsed % divisor;
+        pit_program(PIT_ONESHOT, (uint16_t) oneshot_count);
+    }
+    enable_interrupts();
 }
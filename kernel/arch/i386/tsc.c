@@ -0,0 +1,78 @@
+#include <newbos/clocksource.h>
+#include <newbos/printk.h>
+#include <newbos/timekeeping.h>
+#include <newbos/timer.h>
+
+#include "tsc.h"
+
+/*
+ * CPUID leaf 1 feature flags, TSC in edx, TSC deadline in ecx.
+ */
+#define CPUID_TSC          0x00000010
+#define CPUID_TSC_DEADLINE 0x01000000
+
+/*
+ * PIT ticks the counter is measured over.
+ */
+#define CALIBRATE_TICKS 10
+
+/*
+ * Keeps mult in 32 bits for counters down to 4 MHz.
+ */
+#define TSC_SHIFT 24
+
+uint32_t cpuid_features(void);
+uint32_t cpuid_features_ecx(void);
+
+static uint32_t khz;
+
+static struct clocksource tsc_clocksource = {
+    "tsc", read_tsc, 0, TSC_SHIFT, 100, TIME_PAGE_TSC
+};
+
+void
+tsc_init(
+    void)
+{
+    uint32_t start;
+    uint64_t tsc_start;
+
+    if (!(cpuid_features() & CPUID_TSC))
+    {
+        printk("tsc_init: No TSC.\n");
+        return;
+    }
+
+    /*
+     * Start right after a tick, so we measure whole ticks. The count fits
+     * 32 bits for counters up to 40 GHz.
+     */
+    start = timer_ticks();
+    while (timer_ticks() == start);
+
+    start = timer_ticks();
+    tsc_start = read_tsc();
+    while (timer_ticks() - start < CALIBRATE_TICKS);
+
+    khz = (uint32_t)(read_tsc() - tsc_start) /
+          (CALIBRATE_TICKS * 1000 / TIMER_FREQUENCY);
+
+    printk("tsc_init: TSC runs at %u kHz.\n", khz);
+
+    tsc_clocksource.mult = clocks_calc_mult(khz, NSEC_PER_MSEC, TSC_SHIFT);
+    clocksource_register(&tsc_clocksource);
+}
+
+uint32_t
+tsc_khz(
+    void)
+{
+    return khz;
+}
+
+int
+tsc_deadline_supported(
+    void)
+{
+    return khz != 0 && (cpuid_features_ecx() & CPUID_TSC_DEADLINE) != 0;
+}
@@ -0,0 +1,34 @@
+#ifndef _NEWBOS_TSC_H
+#define _NEWBOS_TSC_H
+
+#include <stdint.h>
+
+uint64_t read_tsc(void);
+
+/*
+ * Measures the time stamp counter against the PIT, which must be running,
+ * and makes it the clocksource. Called once, on the first CPU. The
+ * counters of all CPUs are taken to run in step.
+ */
+void
+tsc_init(
+    void
+);
+
+/*
+ * Time stamp counts per millisecond, 0 if there is no TSC.
+ */
+uint32_t
+tsc_khz(
+    void
+);
+
+/*
+ * Returns 1 if the local APIC timer can interrupt at a TSC value.
+ */
+int
+tsc_deadline_supported(
+    void
+);
+
+#endif
@@ -0,0 +1,36 @@
+.section .text
+.align 4
+
+/*
+ * Returns the time stamp counter, in edx:eax.
+ */
+.global read_tsc
+.type read_tsc, @function
+read_tsc:
+    rdtsc
+    ret
+
+/*
+ * Returns the feature flags CPUID leaf 1 leaves in ecx.
+ */
+.global cpuid_features_ecx
+.type cpuid_features_ecx, @function
+cpuid_features_ecx:
+    push %ebx             # cpuid clobbers ebx, which is callee saved
+    mov $1, %eax
+    cpuid
+    mov %ecx, %eax
+    pop %ebx
+    ret
+
+/*
+ * write_msr(msr, value), value being 64 bits.
+ */
+.global write_msr
+.type write_msr, @function
+write_msr:
+    mov 4(%esp), %ecx
+    mov 8(%esp), %eax
+    mov 12(%esp), %edx
+    wrmsr
+    ret
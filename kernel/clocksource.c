@@ -0,0 +1,85 @@
+#include <stddef.h>
+
+#include <newbos/clocksource.h>
+#include <newbos/printk.h>
+#include <newbos/smp.h>
+#include <newbos/timekeeping.h>
+
+static struct clock_event_device *devices[MAX_CPUS];
+
+void
+clocksource_register(
+    struct clocksource *cs)
+{
+    if (timekeeping_change_clocksource(cs) == 0)
+    {
+        printk("clocksource_register: Switched to %s.\n", cs->name);
+    }
+}
+
+uint32_t
+clocks_calc_mult(
+    uint32_t from_khz,
+    uint32_t to_khz,
+    uint32_t shift)
+{
+    /*
+     * (to_khz << shift) / from_khz, a bit at a time, without 64 bit
+     * division.
+     */
+    uint32_t q = to_khz / from_khz, r = to_khz % from_khz;
+
+    while (shift-- > 0)
+    {
+        q <<= 1;
+        r <<= 1;
+        if (r >= from_khz)
+        {
+            r -= from_khz;
+            q |= 1;
+        }
+    }
+
+    return q;
+}
+
+void
+clockevents_register(
+    struct clock_event_device *dev)
+{
+    devices[smp_cpu_id()] = dev;
+}
+
+int
+clockevents_available(
+    void)
+{
+    return devices[smp_cpu_id()] != NULL;
+}
+
+int
+clockevents_program(
+    uint64_t expires)
+{
+    struct clock_event_device *dev = devices[smp_cpu_id()];
+    uint64_t now, delta;
+
+    if (dev == NULL)
+    {
+        return -1;
+    }
+
+    now = ktime_get_ns();
+    delta = expires > now ? expires - now : 0;
+    if (delta < dev->min_delta_ns)
+    {
+        delta = dev->min_delta_ns;
+    }
+    if (delta > dev->max_delta_ns)
+    {
+        delta = dev->max_delta_ns;
+    }
+
+    dev->set_next_event(delta);
+    return 0;
+}
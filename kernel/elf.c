@@ -0,0 +1,149 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/elf.h>
+#include <newbos/printk.h>
+#include <newbos/vm.h>
+
+#define FOUR_KB 0x1000
+
+static uint8_t const elf_magic[4] = { 0x7F, 'E', 'L', 'F' };
+
+static uint32_t
+align_down(
+    uint32_t n,
+    uint32_t a)
+{
+    return n - (n % a);
+}
+
+static int
+check_header(
+    struct elf32_ehdr const *eh)
+{
+    return memcmp(eh->e_ident, elf_magic, sizeof(elf_magic)) == 0 &&
+           eh->e_ident[EI_CLASS] == ELFCLASS32 &&
+           eh->e_ident[EI_DATA] == ELFDATA2LSB &&
+           eh->e_type == ET_EXEC &&
+           eh->e_machine == EM_386 &&
+           eh->e_phentsize == sizeof(struct elf32_phdr);
+}
+
+/*
+ * Returns 1 if [start, end) overlaps an area p already has.
+ */
+static int
+overlaps(
+    struct process *p,
+    uint32_t start,
+    uint32_t end)
+{
+    struct vm_area *area;
+
+    for (area = p->vm_areas; area != NULL; area = area->next)
+    {
+        if (start < area->end && end > area->start)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Adds the area of a PT_LOAD segment. The area starts at the page the
+ * segment starts in and is backed from the page its file offset is in, so
+ * both have to be equally far into their page.
+ */
+static int
+load_segment(
+    struct process *p,
+    struct initrd_file const *f,
+    struct elf32_phdr const *ph,
+    uint32_t low,
+    uint32_t high)
+{
+    uint32_t start, end, skip, flags = 0;
+
+    skip = ph->p_vaddr % FOUR_KB;
+    start = ph->p_vaddr - skip;
+    end = align_down(ph->p_vaddr + ph->p_memsz + FOUR_KB - 1, FOUR_KB);
+
+    if (ph->p_filesz > ph->p_memsz ||
+        ph->p_offset + ph->p_filesz < ph->p_offset ||
+        ph->p_offset + ph->p_filesz > f->size ||
+        ph->p_offset % FOUR_KB != skip ||
+        ph->p_vaddr + ph->p_memsz < ph->p_vaddr ||
+        start < low || end > high || end <= start ||
+        overlaps(p, start, end))
+    {
+        printk("elf_load: Bad segment. vaddr: %X, memsz: %X, offset: %X\n",
+               ph->p_vaddr, ph->p_memsz, ph->p_offset);
+        return -1;
+    }
+
+    if (ph->p_flags & PF_W)
+    {
+        flags |= VM_READ_WRITE;
+    }
+
+    return vm_area_add_file(p, start, end - start, flags, f,
+                            ph->p_offset - skip, skip + ph->p_filesz);
+}
+
+int
+elf_load(
+    struct process *p,
+    struct initrd_file const *f,
+    uint32_t low,
+    uint32_t high)
+{
+    struct elf32_ehdr eh;
+    struct elf32_phdr ph;
+    uint32_t i, code_start = high;
+
+    if (initrd_read(f, 0, &eh, sizeof(eh)) != 0 || !check_header(&eh))
+    {
+        printk("elf_load: Not an i386 ELF32 executable. file: %s\n",
+               f->cmdline);
+        return -1;
+    }
+
+    for (i = 0; i < eh.e_phnum; ++i)
+    {
+        if (initrd_read(f, eh.e_phoff + i * sizeof(ph), &ph, sizeof(ph)) != 0)
+        {
+            printk("elf_load: Program headers are cut off. file: %s\n",
+                   f->cmdline);
+            return -1;
+        }
+
+        if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+        {
+            continue;
+        }
+
+        if (load_segment(p, f, &ph, low, high) != 0)
+        {
+            return -1;
+        }
+
+        if (ph.p_vaddr < code_start)
+        {
+            code_start = align_down(ph.p_vaddr, FOUR_KB);
+        }
+    }
+
+    if (code_start == high || eh.e_entry < low || eh.e_entry >= high)
+    {
+        printk("elf_load: Nothing to run. file: %s, entry: %X\n",
+               f->cmdline, eh.e_entry);
+        return -1;
+    }
+
+    p->code_start_vaddr = code_start;
+    p->user_mode.eip = eh.e_entry;
+
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include <stddef.h>
+
+#include <newbos/clocksource.h>
+#include <newbos/hrtimer.h>
+#include <newbos/ktimer.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/timekeeping.h>
+
+#include "interrupts.h"
+
+/*
+ * Active timers per CPU.
+ */
+#define HRTIMER_HEAP_SIZE 256
+
+#define HRTIMER_INACTIVE 0xFFFFFFFF
+
+/*
+ * Per CPU: the active timers, as a binary min-heap on expires, and how
+ * many there are. Every timer knows its index in the heap, so it can be
+ * taken out from the middle.
+ */
+static struct hrtimer *heaps[MAX_CPUS][HRTIMER_HEAP_SIZE];
+static uint32_t heap_sizes[MAX_CPUS];
+
+static void
+heap_set(
+    struct hrtimer **heap,
+    uint32_t i,
+    struct hrtimer *t)
+{
+    heap[i] = t;
+    t->index = i;
+}
+
+static void
+sift_up(
+    struct hrtimer **heap,
+    uint32_t i)
+{
+    struct hrtimer *t = heap[i];
+
+    while (i > 0)
+    {
+        uint32_t parent = (i - 1) / 2;
+
+        if (heap[parent]->expires <= t->expires)
+        {
+            break;
+        }
+        heap_set(heap, i, heap[parent]);
+        i = parent;
+    }
+    heap_set(heap, i, t);
+}
+
+static void
+sift_down(
+    struct hrtimer **heap,
+    uint32_t size,
+    uint32_t i)
+{
+    struct hrtimer *t = heap[i];
+
+    for (;;)
+    {
+        uint32_t child = 2 * i + 1;
+
+        if (child >= size)
+        {
+            break;
+        }
+        if (child + 1 < size && heap[child + 1]->expires < heap[child]->expires)
+        {
+            ++child;
+        }
+        if (heap[child]->expires >= t->expires)
+        {
+            break;
+        }
+        heap_set(heap, i, heap[child]);
+        i = child;
+    }
+    heap_set(heap, i, t);
+}
+
+static int
+heap_insert(
+    uint32_t cpu,
+    struct hrtimer *t)
+{
+    struct hrtimer **heap = heaps[cpu];
+
+    if (heap_sizes[cpu] == HRTIMER_HEAP_SIZE)
+    {
+        return -1;
+    }
+
+    t->cpu = cpu;
+    heap_set(heap, heap_sizes[cpu]++, t);
+    sift_up(heap, t->index);
+    return 0;
+}
+
+static void
+heap_remove(
+    struct hrtimer *t)
+{
+    struct hrtimer **heap = heaps[t->cpu];
+    uint32_t i = t->index, size = --heap_sizes[t->cpu];
+
+    t->index = HRTIMER_INACTIVE;
+    if (i == size)
+    {
+        return;
+    }
+
+    heap_set(heap, i, heap[size]);
+    sift_up(heap, i);
+    sift_down(heap, size, heap[i]->index);
+}
+
+static struct hrtimer *
+first_timer(
+    uint32_t cpu)
+{
+    return heap_sizes[cpu] != 0 ? heaps[cpu][0] : NULL;
+}
+
+void
+hrtimer_init(
+    struct hrtimer *t,
+    int (*func)(struct hrtimer *t))
+{
+    t->expires = 0;
+    t->func = func;
+    t->cpu = 0;
+    t->index = HRTIMER_INACTIVE;
+}
+
+/*
+ * The timers run from an interrupt, which can interrupt the kernel lock
+ * holder on the same CPU; the heaps are only changed with interrupts
+ * disabled.
+ */
+int
+hrtimer_start(
+    struct hrtimer *t,
+    uint64_t expires)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t cpu = smp_cpu_id();
+    struct hrtimer *first = first_timer(cpu);
+    int ret = 0;
+
+    if (t->index != HRTIMER_INACTIVE)
+    {
+        heap_remove(t);
+    }
+
+    t->expires = expires;
+    if (heap_insert(cpu, t) != 0)
+    {
+        printk("hrtimer_start: Too many timers. cpu: %u\n", cpu);
+        ret = -1;
+    }
+    else if (first_timer(cpu) != first || t == first)
+    {
+        clockevents_program(first_timer(cpu)->expires);
+    }
+
+    restore_interrupts(flags);
+    return ret;
+}
+
+int
+hrtimer_cancel(
+    struct hrtimer *t)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    int active = t->index != HRTIMER_INACTIVE;
+
+    /*
+     * The clock event device is left alone, an interrupt for nothing
+     * costs less than reprogramming it, maybe on another CPU.
+     */
+    if (active)
+    {
+        heap_remove(t);
+    }
+
+    restore_interrupts(flags);
+    return active;
+}
+
+int
+hrtimer_active(
+    struct hrtimer *t)
+{
+    return t->index != HRTIMER_INACTIVE;
+}
+
+uint32_t
+hrtimer_forward(
+    struct hrtimer *t,
+    uint64_t now,
+    uint64_t interval)
+{
+    uint32_t overruns = 0;
+
+    while (t->expires <= now)
+    {
+        t->expires += interval;
+        ++overruns;
+    }
+
+    return overruns;
+}
+
+void
+hrtimer_interrupt(
+    void)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t cpu = smp_cpu_id();
+    struct hrtimer *t;
+
+    while ((t = first_timer(cpu)) != NULL && t->expires <= ktime_get_ns())
+    {
+        heap_remove(t);
+        restore_interrupts(flags);
+
+        if (t->func(t) == HRTIMER_RESTART)
+        {
+            hrtimer_start(t, t->expires);
+        }
+
+        flags = save_and_disable_interrupts();
+    }
+
+    if (t != NULL)
+    {
+        clockevents_program(t->expires);
+    }
+
+    restore_interrupts(flags);
+}
+
+void
+hrtimer_tick(
+    void)
+{
+    if (!clockevents_available())
+    {
+        hrtimer_interrupt();
+    }
+}
+
+uint32_t
+hrtimer_ticks_to_next(
+    void)
+{
+    struct hrtimer *t = first_timer(0);
+    uint64_t now = ktime_get_ns();
+
+    if (t == NULL || clockevents_available())
+    {
+        return KTIMER_NONE;
+    }
+    if (t->expires <= now)
+    {
+        return 0;
+    }
+    if (t->expires - now >= (uint64_t) TIMER_FREQUENCY * NSEC_PER_TICK)
+    {
+        return TIMER_FREQUENCY;
+    }
+
+    return (uint32_t)(t->expires - now) / NSEC_PER_TICK + 1;
+}
+
+struct hrtimer_sleeper {
+    struct hrtimer timer;
+    struct process *p;
+};
+
+static int
+sleeper_wake(
+    struct hrtimer *t)
+{
+    /*
+     * The timer is the first member.
+     */
+    struct hrtimer_sleeper *s = (struct hrtimer_sleeper *) t;
+
+    scheduler_wake(s->p);
+    return HRTIMER_NORESTART;
+}
+
+void
+hrtimer_nanosleep(
+    uint64_t ns)
+{
+    uint64_t until = ktime_get_ns() + ns;
+    struct hrtimer_sleeper s;
+
+    s.p = scheduler_current_process();
+    hrtimer_init(&s.timer, sleeper_wake);
+
+    while (ktime_get_ns() < until)
+    {
+        /*
+         * The timer can't run on this CPU before the process is blocked,
+         * or the wakeup would be lost.
+         */
+        disable_interrupts();
+        if (hrtimer_start(&s.timer, until) != 0)
+        {
+            enable_interrupts();
+            ktimer_block_timeout(1);
+            continue;
+        }
+        scheduler_block();
+        hrtimer_cancel(&s.timer);
+    }
+}
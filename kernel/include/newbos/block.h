@@ -0,0 +1,28 @@
+#ifndef _NEWBOS_BLOCK_H
+#define _NEWBOS_BLOCK_H
+
+#include <stdint.h>
+
+#define BLOCK_SECTOR_SIZE 512
+
+/*
+ * A device addressed in fixed size sectors, e.g. a disk.
+ */
+struct block_device {
+    char const *name;
+    uint32_t num_sectors;
+
+    int (*read)(
+        struct block_device *dev,
+        uint32_t sector,
+        uint32_t count,
+        void *buf);
+
+    int (*write)(
+        struct block_device *dev,
+        uint32_t sector,
+        uint32_t count,
+        void const *buf);
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _NEWBOS_CLOCKSOURCE_H
+#define _NEWBOS_CLOCKSOURCE_H
+
+#include <stdint.h>
+
+#include <newbos/timer.h>
+
+#define NSEC_PER_USEC 1000
+#define NSEC_PER_MSEC 1000000
+#define NSEC_PER_SEC  1000000000ULL
+#define NSEC_PER_TICK (1000000000 / TIMER_FREQUENCY)
+
+/*
+ * A free running counter the kernel tells time with. Counts are turned
+ * into nanoseconds as (counts * mult) >> shift. The one with the highest
+ * rating is used; the timer tick, at rating 1, is there from the start.
+ * time_page_mode says how processes read it, see timekeeping.h.
+ */
+struct clocksource {
+    char const *name;
+    uint64_t (*read)(void);
+    uint32_t mult;
+    uint32_t shift;
+    uint32_t rating;
+    uint32_t time_page_mode;
+};
+
+void
+clocksource_register(
+    struct clocksource *cs
+);
+
+/*
+ * Returns mult so that (counts * mult) >> shift turns counts of a from_khz
+ * counter into counts of a to_khz one. It must fit 32 bits.
+ */
+uint32_t
+clocks_calc_mult(
+    uint32_t from_khz,
+    uint32_t to_khz,
+    uint32_t shift
+);
+
+/*
+ * A per CPU timer that interrupts once, after a given number of
+ * nanoseconds, and calls hrtimer_interrupt(). Longer delays are cut to
+ * max_delta_ns, shorter ones made min_delta_ns.
+ */
+struct clock_event_device {
+    char const *name;
+    void (*set_next_event)(uint64_t delta_ns);
+    uint64_t min_delta_ns;
+    uint64_t max_delta_ns;
+};
+
+/*
+ * Makes dev the calling CPU's clock event device.
+ */
+void
+clockevents_register(
+    struct clock_event_device *dev
+);
+
+/*
+ * Returns 1 if the calling CPU has a clock event device.
+ */
+int
+clockevents_available(
+    void
+);
+
+/*
+ * Arms the calling CPU's clock event device for ktime_get_ns() reaching
+ * expires. Returns -1 if the CPU has none.
+ */
+int
+clockevents_program(
+    uint64_t expires
+);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _NEWBOS_ELF_H
+#define _NEWBOS_ELF_H
+
+#include <stdint.h>
+
+#include <newbos/initrd.h>
+#include <newbos/process.h>
+
+#define EI_NIDENT 16
+
+#define EI_CLASS   4
+#define EI_DATA    5
+#define ELFCLASS32  1
+#define ELFDATA2LSB 1
+
+#define ET_EXEC 2
+#define EM_386  3
+
+#define PT_LOAD 1
+
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
+struct elf32_ehdr {
+    uint8_t e_ident[EI_NIDENT];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} __attribute__((packed));
+
+struct elf32_phdr {
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} __attribute__((packed));
+
+/*
+ * Loads the statically linked ELF32 executable f into p: adds a VM_FILE
+ * area for each of its loadable segments, which have to lie in
+ * [low, high), and sets p up to start at its entry point. Nothing is mapped
+ * or copied until p touches it. Returns -1 if f isn't such an executable.
+ */
+int
+elf_load(
+    struct process *p,
+    struct initrd_file const *f,
+    uint32_t low,
+    uint32_t high
+);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _NEWBOS_FPU_H
+#define _NEWBOS_FPU_H
+
+#include <stdint.h>
+
+/*
+ * Size of the FXSAVE image of the x87, MMX and SSE registers.
+ */
+#define FPU_STATE_SIZE 512
+
+/*
+ * Saved FPU registers of a process. The image has to be 16 byte aligned,
+ * which a kmalloc'd process isn't, so there is room to align it in.
+ */
+struct fpu_state {
+    uint8_t area[FPU_STATE_SIZE + 15];
+};
+
+struct process;
+
+/*
+ * Enables the FPU, and SSE if the CPU has it, on the first CPU. Processes
+ * get the FPU lazily: it's disabled on every switch to a process and only
+ * handed to it, with its saved registers, when it uses it.
+ */
+void
+fpu_init(
+    void
+);
+
+/*
+ * Enables the FPU on the calling CPU, for CPUs other than the first.
+ */
+void
+fpu_init_cpu(
+    void
+);
+
+/*
+ * Called when prev is switched out. Saves its FPU registers, if it used
+ * the FPU since it was switched in, and disables the FPU again.
+ */
+void
+fpu_switch(
+    struct process *prev
+);
+
+#endif
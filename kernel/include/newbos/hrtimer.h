@@ -0,0 +1,101 @@
+#ifndef _NEWBOS_HRTIMER_H
+#define _NEWBOS_HRTIMER_H
+
+#include <stdint.h>
+
+#define HRTIMER_NORESTART 0
+#define HRTIMER_RESTART   1
+
+/*
+ * A function to run when ktime_get_ns() reaches expires, on the CPU the
+ * timer was started on. Each CPU keeps its timers in a min-heap ordered by
+ * expiry and has its clock event device interrupt for the first one, so
+ * they run within microseconds. Without a clock event device they run
+ * from the timer tick.
+ *
+ * func runs in the interrupt, with the kernel lock held. Returning
+ * HRTIMER_RESTART starts the timer again, at the expires func moved it to.
+ */
+struct hrtimer {
+    uint64_t expires;
+    int (*func)(struct hrtimer *t);
+    uint32_t cpu;
+    uint32_t index;
+};
+
+void
+hrtimer_init(
+    struct hrtimer *t,
+    int (*func)(struct hrtimer *t)
+);
+
+/*
+ * Starts t on the calling CPU, moving it if it's already active. Returns
+ * -1 if the CPU has too many timers.
+ */
+int
+hrtimer_start(
+    struct hrtimer *t,
+    uint64_t expires
+);
+
+/*
+ * Returns 1 if t was active.
+ */
+int
+hrtimer_cancel(
+    struct hrtimer *t
+);
+
+int
+hrtimer_active(
+    struct hrtimer *t
+);
+
+/*
+ * Moves expires forward by whole intervals until it's after now. Returns
+ * the number of intervals.
+ */
+uint32_t
+hrtimer_forward(
+    struct hrtimer *t,
+    uint64_t now,
+    uint64_t interval
+);
+
+/*
+ * Runs the calling CPU's expired timers and arms its clock event device
+ * for the next one.
+ */
+void
+hrtimer_interrupt(
+    void
+);
+
+/*
+ * Called from the timer tick, runs the timers of a CPU that has no clock
+ * event device.
+ */
+void
+hrtimer_tick(
+    void
+);
+
+/*
+ * Timer ticks until the first CPU has timers to run from its tick,
+ * 0xFFFFFFFF if it has none or runs them from its clock event device.
+ */
+uint32_t
+hrtimer_ticks_to_next(
+    void
+);
+
+/*
+ * Puts the running process to sleep for at least ns nanoseconds.
+ */
+void
+hrtimer_nanosleep(
+    uint64_t ns
+);
+
+#endif
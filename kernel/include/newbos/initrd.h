@@ -0,0 +1,56 @@
+#ifndef _NEWBOS_INITRD_H
+#define _NEWBOS_INITRD_H
+
+#include <stdint.h>
+
+#include <newbos/paging.h>
+
+#include "multiboot.h"
+
+/*
+ * The initial ramdisk: the multiboot modules the boot loader loaded along
+ * with the kernel. Each module is a file, found by any word of its command
+ * line, so both "module /boot/init.elf /bin/init" in GRUB and
+ * -initrd "init.elf /bin/init" in QEMU give a /bin/init.
+ *
+ * Modules start on a page boundary and their page frames are never handed
+ * out by the page frame allocator, so processes can map them as they are.
+ */
+#define INITRD_MAX_FILES   16
+#define INITRD_CMDLINE_MAX 64
+
+struct initrd_file {
+    char cmdline[INITRD_CMDLINE_MAX];
+    paddr_t paddr;
+    uint32_t size;
+};
+
+/*
+ * Records the modules in minfo. Called once, at boot.
+ */
+void
+initrd_init(
+    struct multiboot_info *minfo
+);
+
+/*
+ * Returns the file named path, or NULL if there is none.
+ */
+struct initrd_file const *
+initrd_find(
+    char const *path
+);
+
+/*
+ * Copies len bytes at offset of f into buf. Returns -1 if they're not all
+ * in f.
+ */
+int
+initrd_read(
+    struct initrd_file const *f,
+    uint32_t offset,
+    void *buf,
+    uint32_t len
+);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _NEWBOS_KSTACK_H
+#define _NEWBOS_KSTACK_H
+
+#include <stdint.h>
+
+#define KSTACK_SIZE 0x1000
+
+/*
+ * Kernel stacks of processes come from a pool of stacks mapped ahead of
+ * time, each with a guard page below it. A stack that overflows runs into
+ * its guard page and faults, rather than overwriting whatever is mapped
+ * below it. Stacks are handed out and taken back in constant time; the
+ * pool only maps more when it runs out.
+ */
+void
+kstack_init(
+    void
+);
+
+/*
+ * Returns the address right above a free stack, its initial stack pointer,
+ * or 0 if there is none.
+ */
+uint32_t
+kstack_alloc(
+    void
+);
+
+/*
+ * Puts back the stack kstack_alloc() returned top for. It must not be in use
+ * anymore.
+ */
+void
+kstack_free(
+    uint32_t top
+);
+
+/*
+ * Returns 1 if vaddr is in the guard page of a stack.
+ */
+int
+kstack_guard_hit(
+    uint32_t vaddr
+);
+
+void
+kstack_dump_stats(
+    void
+);
+
+#endif
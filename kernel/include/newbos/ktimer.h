@@ -0,0 +1,94 @@
+#ifndef _NEWBOS_KTIMER_H
+#define _NEWBOS_KTIMER_H
+
+#include <stdint.h>
+
+/*
+ * A function to run at a given timer tick, see timer_ticks(). Usually
+ * embedded in the structure it works on. It runs from the timer softirq,
+ * with the kernel lock held, and may add the timer again.
+ *
+ * Pending timers are kept in a hierarchical timer wheel, so adding and
+ * cancelling are O(1) however many there are.
+ */
+struct ktimer {
+    uint32_t expires;
+    void (*func)(struct ktimer *t);
+
+    /*
+     * The list the timer is on, NULL when it isn't pending.
+     */
+    struct ktimer **bucket;
+    struct ktimer *prev;
+    struct ktimer *next;
+};
+
+/*
+ * Returned by ktimer_ticks_to_next() when no timer is pending.
+ */
+#define KTIMER_NONE 0xFFFFFFFF
+
+/*
+ * Runs the timers from the timer tick on the first CPU.
+ */
+void
+ktimers_init(
+    void
+);
+
+void
+ktimer_init(
+    struct ktimer *t,
+    void (*func)(struct ktimer *t)
+);
+
+/*
+ * Makes t run at tick expires, or at the next tick if that has passed.
+ * A pending timer is moved.
+ */
+void
+ktimer_add(
+    struct ktimer *t,
+    uint32_t expires
+);
+
+/*
+ * Returns 1 if t was pending, 0 if it already ran or was never added.
+ */
+int
+ktimer_cancel(
+    struct ktimer *t
+);
+
+int
+ktimer_pending(
+    struct ktimer *t
+);
+
+/*
+ * Timer ticks from now until a timer may be due, KTIMER_NONE if none is
+ * pending. The first CPU can go without its tick for that long.
+ */
+uint32_t
+ktimer_ticks_to_next(
+    void
+);
+
+/*
+ * Blocks the running process like scheduler_block(), for at most ticks
+ * timer ticks. Returns 0 if it timed out, 1 if it was woken earlier.
+ */
+int
+ktimer_block_timeout(
+    uint32_t ticks
+);
+
+/*
+ * Puts the running process to sleep for at least ms milliseconds.
+ */
+void
+ktimer_sleep(
+    uint32_t ms
+);
+
+#endif
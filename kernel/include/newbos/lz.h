@@ -0,0 +1,38 @@
+#ifndef _NEWBOS_LZ_H
+#define _NEWBOS_LZ_H
+
+#include <stdint.h>
+
+/*
+ * Largest input lz_compress() accepts, match offsets are 16 bits.
+ */
+#define LZ_MAX_INPUT 0xFFFF
+
+/*
+ * LZ77 compression in the style of LZ4: a sequence of literal runs, each
+ * followed by a back reference into the data already produced.
+ *
+ * Returns the compressed size, or 0 if it wouldn't fit in dst_size bytes.
+ * Not reentrant, the hash table is static.
+ */
+uint32_t
+lz_compress(
+    void const *src,
+    uint32_t src_size,
+    void *dst,
+    uint32_t dst_size
+);
+
+/*
+ * Returns the decompressed size, or -1 if src is corrupt or the output
+ * doesn't fit in dst_size bytes.
+ */
+int32_t
+lz_decompress(
+    void const *src,
+    uint32_t src_size,
+    void *dst,
+    uint32_t dst_size
+);
+
+#endif
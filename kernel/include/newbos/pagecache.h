@@ -0,0 +1,42 @@
+#ifndef _NEWBOS_PAGECACHE_H
+#define _NEWBOS_PAGECACHE_H
+
+#include <stdint.h>
+
+#include <newbos/initrd.h>
+#include <newbos/paging.h>
+
+/*
+ * Read-only pages of images in the initial ramdisk, shared by every process
+ * that maps them. A page is found by its image and offset, and by how many
+ * bytes of it are in the image: a page the image ends in, or a segment
+ * ends in, is a copy with the rest zeroed, whole pages are the image's own
+ * page frames. Copies are freed when their last reference is put back.
+ */
+
+/*
+ * Returns the page frame holding the len bytes at offset of f, which has
+ * to be page aligned, and zeroes after them, with a reference taken. Returns
+ * 0 if it can't be had.
+ */
+paddr_t
+page_cache_get(
+    struct initrd_file const *f,
+    uint32_t offset,
+    uint32_t len
+);
+
+/*
+ * Puts back a reference taken by page_cache_get().
+ */
+void
+page_cache_put(
+    paddr_t paddr
+);
+
+void
+page_cache_dump_stats(
+    void
+);
+
+#endif
@@ -12,11 +12,31 @@
 #define PAGING_PL0        0
 #define PAGING_PL3        1
 
+/*
+ * Physical addresses are 64 bits wide with PAE, which can address up to 64 GB
+ * of physical memory. Virtual addresses are always 32 bits.
+ */
+#ifdef CONFIG_PAE
+typedef uint64_t paddr_t;
+#else
+typedef uint32_t paddr_t;
+#endif
+
+/*
+ * Size of the page a page directory entry maps directly, with PSE.
+ */
+#ifdef CONFIG_PAE
+#define LARGE_PAGE_SIZE 0x200000
+#else
+#define LARGE_PAGE_SIZE 0x400000
+#endif
+
+/*
+ * An entry in a page directory, see paging.c for the format.
+ */
 struct pde
 {
-    uint8_t config;
-    uint8_t low_addr; /* only the highest 4 bits are used */
-    uint16_t high_addr;
+    paddr_t value;
 } __attribute__((packed));
 
 void
@@ -30,11 +50,72 @@ frames_init(
     struct multiboot_info *minfo
 );
 
-uint32_t
+paddr_t
 pfa_allocate(
     uint32_t num_page_frames
 );
 
+/*
+ * Allocates contiguous page frames starting at a physical address that is a
+ * multiple of alignment (in bytes).
+ */
+paddr_t
+pfa_allocate_aligned(
+    uint32_t num_page_frames,
+    uint32_t alignment
+);
+
+void
+pfa_free(
+    paddr_t paddr
+);
+
+void
+pfa_zero(
+    paddr_t paddr
+);
+
+uint32_t
+pfa_free_frames(
+    void
+);
+
+uint32_t
+pfa_total_frames(
+    void
+);
+
+/*
+ * Lets the page frame allocator get memory back when it runs short.
+ * wakeup() is called after every allocation so background reclaim can
+ * start early, reclaim() when an allocation can't be satisfied; it returns
+ * the number of frames it freed.
+ */
+struct pfa_reclaimer {
+    void (*wakeup)(void);
+    uint32_t (*reclaim)(uint32_t num_page_frames);
+};
+
+void
+pfa_set_reclaimer(
+    struct pfa_reclaimer const *r
+);
+
+/*
+ * Maps a page frame, wherever it is in physical memory, into one of a few
+ * temporary kernel slots. Slots are handed out as a stack, so mappings must
+ * be released with kunmap_frame() in the reverse order.
+ */
+void *
+kmap_frame(
+    paddr_t paddr
+);
+
+void
+kunmap_frame(
+    void *vaddr
+);
+
 struct pde *
 pdt_create(
     uint32_t *out_paddr
@@ -42,7 +123,7 @@ pdt_create(
 
 uint32_t
 pdt_map_kernel_memory(
-    uint32_t paddr,
+    paddr_t paddr,
     uint32_t vaddr,
     uint32_t size,
     uint8_t rw,
@@ -55,16 +136,168 @@ pdt_load_process_pdt(
     uint32_t pdt_paddr
 );
 
+/*
+ * Switches to the kernel's own page directory, for processes that only run
+ * kernel code.
+ */
+void
+pdt_load_kernel_pdt(
+    void
+);
+
+/*
+ * Kernel page tables created after pdt was loaded are only in the kernel's
+ * page directory. Copies the entry for vaddr into pdt, returns -1 if there
+ * is nothing to copy.
+ */
+int
+pdt_sync_kernel_memory(
+    struct pde *pdt,
+    uint32_t vaddr
+);
+
+/*
+ * User mappings (PAGING_PL3) of whole, aligned LARGE_PAGE_SIZE regions of
+ * aligned physical memory are mapped with large pages. Unmapping or
+ * protecting only part of a large page splits it back into 4 KB pages.
+ */
 uint32_t
 pdt_map_memory(
     struct pde *pdt,
-    uint32_t paddr,
+    paddr_t paddr,
     uint32_t vaddr,
     uint32_t size,
     uint8_t rw,
     uint8_t pl
 );
 
+uint32_t
+pdt_unmap_memory(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t size
+);
+
+/*
+ * Returns the page frame mapped at vaddr, or 0 if the page isn't present.
+ */
+paddr_t
+pdt_lookup(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint8_t *out_rw
+);
+
+/*
+ * Returns 1 if anything is mapped or swapped out in the LARGE_PAGE_SIZE region
+ * around vaddr. It looks at every entry of the region's page table.
+ */
+int
+pdt_has_mappings(
+    struct pde *pdt,
+    uint32_t vaddr
+);
+
+/*
+ * Returns the number of 4 KB pages mapped in the page table of the
+ * LARGE_PAGE_SIZE region around vaddr, and stores how many of them are
+ * swapped out in out_swapped. A region without a page table has none.
+ */
+uint32_t
+pdt_count_pages(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t *out_swapped
+);
+
+/*
+ * State of a page, returned by pdt_sample_page().
+ */
+#define PAGE_STATE_PRESENT  0x01
+#define PAGE_STATE_ACCESSED 0x02
+#define PAGE_STATE_DIRTY    0x04
+#define PAGE_STATE_RW       0x08
+#define PAGE_STATE_LARGE    0x10
+#define PAGE_STATE_SWAPPED  0x20
+#define PAGE_STATE_USER     0x40
+#define PAGE_STATE_AGE_SHIFT 8
+#define PAGE_STATE_AGE(s)   (((s) >> PAGE_STATE_AGE_SHIFT) & PAGE_AGE_MAX)
+
+#define PAGE_AGE_MAX 7
+
+/*
+ * Samples and clears the accessed and dirty bits of the page at vaddr.
+ * Every present page has an age: the number of samples in a row, up to
+ * PAGE_AGE_MAX, that found it not accessed. Returns the PAGE_STATE_* bits
+ * as they were before clearing, with the updated age. The frame of a
+ * present page is stored in out_paddr, if it isn't NULL. The TLBs of all
+ * CPUs are flushed when bits were cleared, so the next access sets them
+ * again.
+ */
+uint32_t
+pdt_sample_page(
+    struct pde *pdt,
+    uint32_t vaddr,
+    paddr_t *out_paddr
+);
+
+/*
+ * Sets the empty entry of the 4 KB page at vaddr, unmapped with
+ * pdt_unmap_memory(), to a not-present entry that remembers the swap slot
+ * holding its contents.
+ */
+int
+pdt_set_swap_entry(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t slot
+);
+
+/*
+ * Returns 0 and the swap slot if the page at vaddr is swapped out.
+ */
+int
+pdt_get_swap_entry(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t *out_slot
+);
+
+uint32_t
+pdt_protect_memory(
+    struct pde *pdt,
+    uint32_t vaddr,
+    uint32_t size,
+    uint8_t rw
+);
+
+/*
+ * Number of large pages mapped in user space of the given pdt.
+ */
+uint32_t
+pdt_large_pages(
+    struct pde *pdt
+);
+
+/*
+ * Replaces the large page around vaddr with 4 KB pages of the same frames,
+ * each as old as the large page, so they can be swapped out on their own.
+ * Returns -1 if there is no large page there or no frame for the page table.
+ */
+int
+pdt_split_large_page_at(
+    struct pde *pdt,
+    uint32_t vaddr
+);
+
+/*
+ * Number of large pages split back into 4 KB pages, since boot.
+ */
+uint32_t
+pdt_large_pages_split(
+    void
+);
+
 uint32_t
 pdt_unmap_kernel_memory(
     uint32_t virtual_addr,
@@ -75,4 +308,15 @@ pdt_kernel_find_next_vaddr(
     uint32_t size
 );
 
+/*
+ * Makes the kernel page at vaddr a guard page, left unmapped so that
+ * touching it faults, which pdt_kernel_find_next_vaddr() doesn't hand out.
+ * The page table for vaddr has to exist already. Returns -1 if it doesn't
+ * or something is mapped at vaddr.
+ */
+int
+pdt_map_kernel_guard(
+    uint32_t vaddr
+);
+
 #endif
@@ -0,0 +1,50 @@
+#ifndef _NEWBOS_PID_H
+#define _NEWBOS_PID_H
+
+#include <stdint.h>
+
+struct process;
+
+/*
+ * PIDs go from 1 to PID_MAX - 1, 0 belongs to kernel_main(), see
+ * process_kernel().
+ */
+#define PID_MAX 32768
+
+/*
+ * Returns an unused PID, or 0 if all are taken. PIDs are handed out in
+ * increasing order and wrap around at PID_MAX, so a PID isn't reused soon
+ * after it's freed.
+ */
+uint32_t
+pid_alloc(
+    void
+);
+
+void
+pid_free(
+    uint32_t pid
+);
+
+/*
+ * Makes p findable by its id with pid_find(), until pid_unregister().
+ */
+void
+pid_register(
+    struct process *p
+);
+
+void
+pid_unregister(
+    struct process *p
+);
+
+/*
+ * Returns the process with the given PID, NULL if there is none.
+ */
+struct process *
+pid_find(
+    uint32_t pid
+);
+
+#endif
@@ -3,7 +3,12 @@
 
 #include <stdint.h>
 
+#include <newbos/fpu.h>
 #include <newbos/paging.h>
+#include <newbos/rbtree.h>
+#include <newbos/wss.h>
+
+struct ring;
 
 struct _registers {
     uint32_t eax;
@@ -66,9 +71,17 @@ struct tss {
 
 } __attribute__((packed));
 
+/*
+ * count page frames from paddr on. Shared frames are page cache pages, see
+ * pagecache.h, which the process holds a reference to; the others are its
+ * own.
+ */
+#define PADDR_SHARED 0x01
+
 struct paddr_ele {
-    uint32_t paddr;
+    paddr_t paddr;
     uint32_t count;
+    uint32_t flags;
     struct paddr_ele *next;
 };
 
@@ -77,24 +90,129 @@ struct paddr_list {
     struct paddr_ele *end;
 };
 
+/*
+ * Process states
+ */
+#define PROCESS_RUNNABLE 0
+#define PROCESS_RUNNING  1
+#define PROCESS_BLOCKED  2
+
 struct process
 {
     uint32_t id;
     uint32_t parent_id;
 
+    /*
+     * Set for kernel threads, see kthread_create().
+     */
+    char const *name;
+    void (*kthread_fn)(void *arg);
+    void *kthread_arg;
+
+    /*
+     * For a kernel thread working in the address space of a user process,
+     * that process. Page faults are handled in its memory.
+     */
+    struct process *mm_owner;
+
+    /*
+     * Scheduling, see scheduler.h. prio is the run queue the process is on
+     * with the priority class, derived from nice and boost, run_prev and
+     * run_next link it into that queue. vruntime orders
+     * run_node in the fair class, slice_runtime is how long the process has
+     * run since it was picked, in microseconds.
+     */
+    uint32_t state;
+    int32_t nice;
+    uint32_t prio;
+    uint32_t boost;
+    struct process *run_prev;
+    struct process *run_next;
+    uint64_t vruntime;
+    uint32_t slice_runtime;
+    struct rb_node run_node;
+
+    /*
+     * CPU whose run queue the process is on, or last ran on, and how deep it
+     * held the kernel lock when it was switched out, see smp.h.
+     */
+    uint32_t cpu;
+    uint32_t lock_depth;
+
+    /*
+     * Load balancing, see scheduler.c. on_cpu is set while the process runs
+     * and until its CPU is off its kernel stack, last_cpu and last_ran are
+     * where and at which timer tick it last ran. rq_prev and rq_next link
+     * it with the other processes on its run queue, whatever the class.
+     */
+    uint32_t on_cpu;
+    uint32_t last_cpu;
+    uint32_t last_ran;
+    struct process *rq_prev;
+    struct process *rq_next;
+    uint32_t migrations;
+
+    /*
+     * Timer ticks spent running and the number of times the process was
+     * switched out.
+     */
+    uint32_t runtime_ticks;
+    uint32_t switches;
+
+    /*
+     * FPU registers, see fpu.h. fpu_used is set once the process used the
+     * FPU, fpu_cpu is the CPU it last did so on.
+     */
+    uint32_t fpu_used;
+    uint32_t fpu_cpu;
+    struct fpu_state fpu;
+
     struct pde *pdt;
     uint32_t pdt_paddr;
 
-    struct _registers current;
     struct _registers user_mode;
 
+    /*
+     * Saved context while the process isn't running: the interrupt frame on
+     * top of its kernel stack.
+     */
+    struct registers *context;
+
     uint32_t kernel_stack_start_vaddr;
     uint32_t stack_start_vaddr;
+    uint32_t heap_start_vaddr;
     uint32_t code_start_vaddr;
 
+    /*
+     * Page frames mapped for the image the process runs, see
+     * process_add_code_frame()
+     */
     struct paddr_list code_paddrs;
-    struct paddr_list stack_paddrs;
-    struct paddr_list kernel_stack_paddrs;
+
+    /*
+     * Lazily mapped regions, see vm.h
+     */
+    struct vm_area *vm_areas;
+
+    /*
+     * Working set as of the last scan, see wss.h
+     */
+    struct wss wss;
+
+    /*
+     * Submission and completion rings, see ring.h
+     */
+    struct ring *ring;
+
+    /*
+     * All processes, in creation order, see process_next()
+     */
+    struct process *next_process;
+
+    /*
+     * Next process in the same PID hash bucket, see pid.h
+     */
+    struct process *pid_next;
 };
 
 uint32_t
@@ -118,4 +236,59 @@ process_create(
     char const *path
 );
 
+/*
+ * Records a page frame mapped for the image p runs, flags is 0 or
+ * PADDR_SHARED. A shared frame stays referenced until p goes away, even if
+ * the page was copied on write since. Returns -1 if it can't be recorded.
+ */
+int
+process_add_code_frame(
+    struct process *p,
+    paddr_t paddr,
+    uint32_t flags
+);
+
+/*
+ * Frees the page frames recorded for the image p runs and puts back its
+ * page cache references.
+ */
+void
+process_free_code(
+    struct process *p
+);
+
+/*
+ * Creates a kernel thread that runs fn(arg), to be made runnable with
+ * scheduler_add_process(). It runs in kernel mode in the kernel's address
+ * space, with no user memory, holding the kernel lock; it keeps the CPU
+ * until it blocks or calls scheduler_schedule(), and stays on the CPU it
+ * was first put on. fn shouldn't return, the thread blocks for good if it
+ * does.
+ */
+struct process *
+kthread_create(
+    char const *name,
+    void (*fn)(void *arg),
+    void *arg
+);
+
+/*
+ * The process kernel_main() runs as. It runs in kernel mode on the boot
+ * stack, in the kernel's address space, and isn't in the list of processes
+ * returned by process_next().
+ */
+struct process *
+process_kernel(
+    void
+);
+
+/*
+ * Iterates over all processes: returns the first process when p is NULL and
+ * NULL after the last one.
+ */
+struct process *
+process_next(
+    struct process *p
+);
+
 #endif
@@ -0,0 +1,69 @@
+#ifndef _NEWBOS_RBTREE_H
+#define _NEWBOS_RBTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Intrusive red-black tree: the node is embedded in the structure kept in
+ * the tree and the caller does the ordered descent itself, then links the
+ * node with rb_link_node() and rebalances with rb_insert_color():
+ *
+ *     struct rb_node **link = &root->node, *parent = NULL;
+ *     while (*link != NULL) {
+ *         parent = *link;
+ *         link = less(new, parent) ? &parent->left : &parent->right;
+ *     }
+ *     rb_link_node(&new->node, parent, link);
+ *     rb_insert_color(&new->node, root);
+ */
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    uint32_t color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define rb_entry(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+void
+rb_link_node(
+    struct rb_node *node,
+    struct rb_node *parent,
+    struct rb_node **link
+);
+
+void
+rb_insert_color(
+    struct rb_node *node,
+    struct rb_root *root
+);
+
+void
+rb_erase(
+    struct rb_node *node,
+    struct rb_root *root
+);
+
+/*
+ * Smallest node, NULL if the tree is empty.
+ */
+struct rb_node *
+rb_first(
+    struct rb_root const *root
+);
+
+/*
+ * In-order successor, NULL for the last node.
+ */
+struct rb_node *
+rb_next(
+    struct rb_node const *node
+);
+
+#endif
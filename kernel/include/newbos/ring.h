@@ -0,0 +1,110 @@
+#ifndef _NEWBOS_RING_H
+#define _NEWBOS_RING_H
+
+#include <stdint.h>
+
+struct process;
+
+/*
+ * Submission and completion rings, shared between a process and the
+ * kernel, to hand the kernel many operations at once and reap their
+ * results without a system call each.
+ *
+ * SYS_RING_SETUP maps the rings at RING_VADDR: a ring_header, then the
+ * submission queue entries at sq_offset and the completion queue entries
+ * at cq_offset. The process fills in entries at sq_tail and advances it;
+ * the kernel takes them from sq_head. The kernel posts completions at
+ * cq_tail; the process reaps them from cq_head and advances it. Indexes
+ * run freely, entries are at index & (entries - 1).
+ *
+ * SYS_RING_ENTER submits what's queued and waits for completions. With
+ * RING_SETUP_SQPOLL a kernel thread takes submissions as they come
+ * instead; after a while without any it sets RING_NEED_WAKEUP and sleeps
+ * until SYS_RING_ENTER is called with RING_ENTER_SQ_WAKEUP.
+ */
+#define RING_VADDR 0xBFFD0000
+
+#define RING_MAX_ENTRIES 64
+
+/*
+ * Operations
+ */
+#define RING_OP_NOP     0 /* completes right away with 0 */
+#define RING_OP_WRITE   1 /* addr, len: to the console, like SYS_WRITE */
+#define RING_OP_TIMEOUT 2 /* arg: completes with 0 after arg nanoseconds, */
+                          /* -1 if cq_entries timeouts are pending */
+
+/*
+ * SYS_RING_SETUP flags
+ */
+#define RING_SETUP_SQPOLL 0x1
+
+/*
+ * SYS_RING_ENTER flags
+ */
+#define RING_ENTER_SQ_WAKEUP 0x1
+
+/*
+ * ring_header flags
+ */
+#define RING_NEED_WAKEUP 0x1
+
+struct ring_header {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t sq_entries;
+    uint32_t sq_offset;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t cq_entries;
+    uint32_t cq_offset;
+    uint32_t flags;
+
+    /*
+     * Completions dropped because the completion queue was full.
+     */
+    uint32_t cq_overflow;
+};
+
+struct ring_sqe {
+    uint32_t opcode;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t reserved;
+    uint64_t arg;
+    uint64_t user_data;
+};
+
+struct ring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t reserved;
+};
+
+/*
+ * Sets up the rings of p, for entries submissions at a time, rounded up to
+ * a power of two. Returns -1 if p has rings already or they can't be set
+ * up.
+ */
+int
+ring_setup(
+    struct process *p,
+    uint32_t entries,
+    uint32_t flags
+);
+
+/*
+ * Submits up to to_submit queued operations of p, unless a kernel thread
+ * does that, then waits until there are at least min_complete completions
+ * to reap. Returns the number submitted, 0 if a kernel thread does that,
+ * -1 if p has no rings.
+ */
+int32_t
+ring_enter(
+    struct process *p,
+    uint32_t to_submit,
+    uint32_t min_complete,
+    uint32_t flags
+);
+
+#endif
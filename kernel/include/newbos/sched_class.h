@@ -0,0 +1,162 @@
+#ifndef _NEWBOS_SCHED_CLASS_H
+#define _NEWBOS_SCHED_CLASS_H
+
+#include <stdint.h>
+
+#include <newbos/process.h>
+#include <newbos/rbtree.h>
+#include <newbos/scheduler.h>
+
+/*
+ * enqueue() flags
+ */
+#define ENQUEUE_NEW     0x01 /* first time the process is runnable */
+#define ENQUEUE_WAKEUP  0x02 /* the process was blocked */
+#define ENQUEUE_MIGRATE 0x04 /* moved from the run queue of another CPU */
+
+/*
+ * dequeue() flags
+ */
+#define DEQUEUE_MIGRATE 0x04 /* moving to the run queue of another CPU */
+
+/*
+ * State of the priority class, see sched_prio.c.
+ */
+#define NUM_PRIOS         (NICE_MAX - NICE_MIN + 1)
+#define PRIO_BITMAP_WORDS ((NUM_PRIOS + 31) / 32)
+
+struct prio_queue {
+    struct process *head;
+    struct process *tail;
+};
+
+struct prio_rq {
+    struct prio_queue queues[NUM_PRIOS];
+    uint32_t bitmap[PRIO_BITMAP_WORDS];
+    uint32_t slice_left;
+};
+
+/*
+ * State of the fair class, see sched_fair.c: the runnable processes ordered
+ * by virtual runtime, with the first one cached in leftmost, and the sum of
+ * their weights. min_vruntime never decreases, it follows the least virtual
+ * runtime of the runnable processes; woken processes start from there, so
+ * the time they spent blocked doesn't let them monopolize the CPU.
+ */
+struct fair_rq {
+    struct rb_root timeline;
+    struct rb_node *leftmost;
+    uint32_t total_weight;
+    uint64_t min_vruntime;
+};
+
+/*
+ * A CPU's run queue. Each CPU picks processes from its own; only the state
+ * of the class in use is touched.
+ */
+struct rq {
+    uint32_t cpu;
+    struct process *current;
+
+    /*
+     * The process the CPU runs when its run queue is empty, never on the
+     * run queue itself. The first CPU has none: kernel_main() is scheduled
+     * like any other process there.
+     */
+    struct process *idle;
+
+    /*
+     * Set when current should be switched out at the next opportunity.
+     */
+    uint32_t need_resched;
+
+    /*
+     * Set while the CPU is halted in scheduler_idle(), possibly without its
+     * timer tick.
+     */
+    uint32_t idling;
+
+    /*
+     * Processes on the run queue, not counting current.
+     */
+    uint32_t nr_running;
+
+    /*
+     * The processes on the run queue, in no particular order, for the load
+     * balancer to choose from.
+     */
+    struct process *queued;
+
+    /*
+     * The process last switched out; the CPU is still on its kernel stack
+     * until the interrupt returns.
+     */
+    struct process *switched_out;
+
+    /*
+     * Timer ticks until the next periodic rebalance, and the number of
+     * processes this CPU took from others when it ran out of work and when
+     * rebalancing.
+     */
+    uint32_t balance_ticks;
+    uint32_t nr_steals;
+    uint32_t nr_pulls;
+
+    struct prio_rq prio;
+    struct fair_rq fair;
+};
+
+/*
+ * A scheduling policy. The scheduler core (scheduler.c) keeps track of the
+ * running process and switches between processes, the class decides which
+ * one runs next and for how long. The running process is never on the run
+ * queue of the class.
+ */
+struct sched_class {
+    char const *name;
+
+    void (*enqueue)(struct rq *rq, struct process *p, uint32_t flags);
+    void (*dequeue)(struct rq *rq, struct process *p, uint32_t flags);
+
+    /*
+     * Removes the process to run next from the run queue, NULL if empty.
+     */
+    struct process *(*pick_next)(struct rq *rq);
+
+    /*
+     * Charges a timer tick to the running process, returns 1 if it should
+     * be switched out.
+     */
+    int (*tick)(struct rq *rq, struct process *curr);
+
+    /*
+     * Returns 1 if p, just made runnable, should run before curr.
+     */
+    int (*preempt)(struct rq *rq, struct process *p, struct process *curr);
+
+    /*
+     * Prints the class specific state of p, without a newline.
+     */
+    void (*dump)(struct process *p);
+};
+
+/*
+ * Round-robin within priority levels derived from nice, with a boost for
+ * processes waking up from I/O.
+ */
+extern struct sched_class const sched_prio_class;
+
+/*
+ * Fair share by weighted virtual runtime.
+ */
+extern struct sched_class const sched_fair_class;
+
+/*
+ * Time slice set with scheduler_set_time_slice(), in timer ticks.
+ */
+uint32_t
+scheduler_time_slice(
+    void
+);
+
+#endif
@@ -3,16 +3,169 @@
 
 #include <newbos/process.h>
 
+/*
+ * How long a process runs before it's preempted, unless changed with
+ * scheduler_set_time_slice().
+ */
+#ifndef SCHEDULER_TIME_SLICE_MS
+#define SCHEDULER_TIME_SLICE_MS 20
+#endif
+
+/*
+ * Range of nice values, lower is more important.
+ */
+#define NICE_MIN -20
+#define NICE_MAX 19
+
+struct registers;
+
+/*
+ * Load of a CPU and how much the load balancer moved to it, see
+ * scheduler_get_cpu_stats().
+ */
+struct sched_cpu_stats {
+    uint32_t queued;  /* processes waiting to run */
+    uint32_t running; /* pid of the running process */
+    uint32_t idle;    /* 1 if that's the idle process */
+    uint32_t steals;  /* processes taken when the CPU ran out of work */
+    uint32_t pulls;   /* processes taken by periodic rebalancing */
+};
+
+/*
+ * Makes the code calling it, kernel_main(), the first process and starts
+ * switching between processes. policy is the scheduling class to use, "prio"
+ * or "fair"; when it's NULL the one chosen at build time is used, see
+ * CONFIG_SCHED_FAIR.
+ */
+void
+scheduler_init(
+    char const *policy
+);
+
+/*
+ * Makes a new process runnable, on the least loaded CPU. Never fails: the
+ * run queues are linked through the process itself. Processes move between
+ * CPUs when the load gets uneven.
+ */
+void
+scheduler_add_process(
+    struct process *p
+);
+
+/*
+ * Makes a new process runnable on the given CPU. Kernel threads stay there
+ * for good. Returns -1 if cpu isn't online.
+ */
+int
+scheduler_add_process_on(
+    struct process *p,
+    uint32_t cpu
+);
+
+/*
+ * Makes idle the running process of the calling CPU, for CPUs other than
+ * the first, which scheduler_init() sets up. idle only runs when there is
+ * nothing else to, calling scheduler_idle() in a loop.
+ */
+void
+scheduler_init_cpu(
+    struct process *idle
+);
+
+struct process *
+scheduler_current_process(
+    void
+);
+
+/*
+ * Number of processes waiting to run on the calling CPU.
+ */
 uint32_t
-scheduler_next_pid(
+scheduler_nr_running(
+    void
+);
+
+void
+scheduler_set_time_slice(
+    uint32_t ms
+);
+
+void
+scheduler_set_nice(
+    struct process *p,
+    int32_t nice
+);
+
+/*
+ * Puts the running process to sleep until scheduler_wake() is called on it.
+ * May return early, callers have to check what they are waiting for again.
+ */
+void
+scheduler_block(
+    void
+);
+
+/*
+ * Makes a blocked process runnable again. It gets a priority boost, so that
+ * processes waiting on I/O get to run soon after it completes.
+ */
+void
+scheduler_wake(
+    struct process *p
+);
+
+/*
+ * A CPU's idle loop: halts the CPU until an interrupt if it has nothing to
+ * run, then gives up the CPU to the next runnable process, if any. The
+ * CPU's timer tick is stopped while halted, for up to max_ticks, as nothing
+ * is due on it before then. Called without the kernel lock.
+ */
+void
+scheduler_idle(
+    uint32_t max_ticks
+);
+
+/*
+ * Called on every timer tick, charges the tick to the running process.
+ */
+void
+scheduler_tick(
     void
 );
 
+/*
+ * Called on the way out of every interrupt with the interrupted context.
+ * Returns the context to resume: the same one, or that of the next process
+ * if the running one is to be switched out. User code is preempted when its
+ * time slice is used up, kernel code only when it calls
+ * scheduler_schedule().
+ */
+struct registers *
+scheduler_interrupt_return(
+    struct registers *regs
+);
+
+/*
+ * Returns -1 if cpu isn't online.
+ */
 int
-scheduler_add_process(
-    struct process *ps
+scheduler_get_cpu_stats(
+    uint32_t cpu,
+    struct sched_cpu_stats *stats
+);
+
+/*
+ * Prints the load of every CPU and the runtime and migrations of every
+ * process.
+ */
+void
+scheduler_dump_stats(
+    void
 );
 
+/*
+ * Gives up the CPU to the next runnable process.
+ */
 void
 scheduler_schedule(
     void
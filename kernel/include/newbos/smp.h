@@ -0,0 +1,101 @@
+#ifndef _NEWBOS_SMP_H
+#define _NEWBOS_SMP_H
+
+#include <stdint.h>
+
+/*
+ * Most CPUs brought up, the rest are left halted.
+ */
+#define MAX_CPUS 8
+
+/*
+ * Finds the other CPUs in the ACPI tables and starts them. Each one runs
+ * its own idle process and takes processes from its own run queue. The
+ * caller, kernel_main(), holds the kernel lock afterwards.
+ */
+void
+smp_init(
+    void
+);
+
+/*
+ * Index of the calling CPU, 0 is the one the kernel booted on.
+ */
+uint32_t
+smp_cpu_id(
+    void
+);
+
+/*
+ * Number of CPUs running.
+ */
+uint32_t
+smp_num_cpus(
+    void
+);
+
+/*
+ * Returns 1 if cpu is running.
+ */
+int
+smp_cpu_online(
+    uint32_t cpu
+);
+
+/*
+ * Interrupts cpu so it notices a process to switch to.
+ */
+void
+smp_send_reschedule(
+    uint32_t cpu
+);
+
+/*
+ * Halts the calling CPU until an interrupt. Called with interrupts disabled,
+ * returns with them enabled. The CPU's timer tick is stopped for up to
+ * max_ticks meanwhile, if it's more than 1.
+ */
+void
+smp_idle(
+    uint32_t max_ticks
+);
+
+/*
+ * Flushes the TLBs of all other CPUs and waits until they did. Called by
+ * code holding the kernel lock after it removed or restricted a mapping.
+ */
+void
+smp_flush_tlb(
+    void
+);
+
+/*
+ * Kernel code runs under one lock, only user code runs on several CPUs at
+ * once. It's taken on every interrupt and by kernel_main() and may be taken
+ * again by the CPU holding it. Interrupts are disabled while waiting for it.
+ */
+void
+lock_kernel(
+    void
+);
+
+void
+unlock_kernel(
+    void
+);
+
+/*
+ * How deep the calling CPU holds the kernel lock, see
+ * scheduler_interrupt_return().
+ */
+uint32_t
+kernel_lock_depth(
+    void
+);
+
+void
+kernel_lock_set_depth(
+    uint32_t depth
+);
+
+#endif
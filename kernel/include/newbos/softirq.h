@@ -0,0 +1,86 @@
+#ifndef _NEWBOS_SOFTIRQ_H
+#define _NEWBOS_SOFTIRQ_H
+
+#include <stdint.h>
+
+/*
+ * Interrupt handlers only do what can't wait, acknowledging the device and
+ * taking its data, and raise a softirq for the rest. Softirqs run on the
+ * way out of the interrupt, with interrupts enabled, on the CPU that raised
+ * them. Those raised again and again while running are left to a kernel
+ * thread per CPU, ksoftirqd, so they can't starve processes.
+ *
+ * Softirqs run in order of their number.
+ */
+#define SOFTIRQ_TIMER   0
+#define SOFTIRQ_TASKLET 1
+#define SOFTIRQ_SCHED   2
+#define NR_SOFTIRQS     3
+
+/*
+ * Sets the function run for softirq nr.
+ */
+void
+open_softirq(
+    uint32_t nr,
+    void (*action)(void)
+);
+
+/*
+ * Marks softirq nr pending on the calling CPU.
+ */
+void
+raise_softirq(
+    uint32_t nr
+);
+
+/*
+ * Called by the interrupt dispatchers, with the kernel lock held, around
+ * the handlers. Pending softirqs run in irq_exit() of the outermost
+ * interrupt.
+ */
+void
+irq_enter(
+    void
+);
+
+void
+irq_exit(
+    void
+);
+
+/*
+ * Work for a driver's bottom half, run once by the SOFTIRQ_TASKLET softirq
+ * on the CPU that scheduled it, however often it was scheduled before.
+ */
+struct tasklet {
+    void (*func)(struct tasklet *t);
+    struct tasklet *next;
+    uint32_t scheduled;
+};
+
+void
+tasklet_init(
+    struct tasklet *t,
+    void (*func)(struct tasklet *t)
+);
+
+void
+tasklet_schedule(
+    struct tasklet *t
+);
+
+/*
+ * Starts ksoftirqd on every CPU.
+ */
+void
+softirq_init(
+    void
+);
+
+void
+softirq_dump_stats(
+    void
+);
+
+#endif
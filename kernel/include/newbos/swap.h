@@ -0,0 +1,52 @@
+#ifndef _NEWBOS_SWAP_H
+#define _NEWBOS_SWAP_H
+
+#include <stdint.h>
+
+#include <newbos/block.h>
+#include <newbos/process.h>
+
+struct swap_stats {
+    uint32_t slots;
+    uint32_t slots_used;
+    uint32_t pages_out;
+    uint32_t pages_in;
+    uint32_t pages_scanned;
+    uint32_t direct_reclaims;
+    uint32_t kswapd_runs;
+};
+
+/*
+ * Starts reclaiming page frames of anonymous user memory when physical
+ * memory runs low. Reclaimed pages are compressed in memory (see zswap.h)
+ * and, if that doesn't work out, written to dev, all of which is used as
+ * swap space. dev may be NULL, pages are then only compressed. Background
+ * reclaim runs on the shared workqueue, see workqueue.h.
+ */
+void
+swap_init(
+    struct block_device *dev
+);
+
+/*
+ * Reads the swapped out page at vaddr back into a new frame.
+ */
+int
+swap_in(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t slot,
+    uint8_t rw
+);
+
+void
+swap_get_stats(
+    struct swap_stats *stats
+);
+
+void
+swap_dump_stats(
+    void
+);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _NEWBOS_SYSCALL_H
+#define _NEWBOS_SYSCALL_H
+
+#include <stdint.h>
+
+#include <newbos/paging.h>
+
+/*
+ * User code makes a system call by calling the start of the syscall page,
+ * mapped read-only at SYSCALL_PAGE_VADDR in every process, with the call
+ * number in eax and up to five arguments in ebx, ecx, edx, esi and edi.
+ * The result comes back in eax, -1 on failure; other registers are kept.
+ * The page enters the kernel the fastest way the CPU has: SYSENTER, or
+ * int 0x80 without it. int 0x80 works either way.
+ */
+#define SYSCALL_PAGE_VADDR 0xBFFE1000
+
+#define SYSCALL_MAX_ARGS 5
+
+#define SYS_GETPID        0 /* () */
+#define SYS_YIELD         1 /* () */
+#define SYS_NANOSLEEP     2 /* (ns_low, ns_high) */
+#define SYS_WRITE         3 /* (buf, len), to the console */
+#define SYS_CLOCK_GETTIME 4 /* (clock, struct timespec *) */
+#define SYS_RING_SETUP    5 /* (entries, flags), see ring.h */
+#define SYS_RING_ENTER    6 /* (to_submit, min_complete, flags) */
+#define NR_SYSCALLS       7
+
+/*
+ * Runs system call nr, in the context of the calling process, with the
+ * kernel lock held and interrupts enabled. It may block.
+ */
+int32_t
+syscall_dispatch(
+    uint32_t nr,
+    uint32_t const *args
+);
+
+/*
+ * Sets up the system call entry points and the syscall page. Called once,
+ * on the first CPU, before the others are started.
+ */
+void
+syscall_init(
+    void
+);
+
+void
+syscall_init_cpu(
+    void
+);
+
+/*
+ * Maps the syscall page into pdt at SYSCALL_PAGE_VADDR. Returns -1 on
+ * failure.
+ */
+int
+syscall_map(
+    struct pde *pdt
+);
+
+#endif
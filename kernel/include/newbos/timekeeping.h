@@ -0,0 +1,115 @@
+#ifndef _NEWBOS_TIMEKEEPING_H
+#define _NEWBOS_TIMEKEEPING_H
+
+#include <stdint.h>
+
+#include <newbos/paging.h>
+
+struct clocksource;
+
+struct timespec {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+};
+
+/*
+ * Clocks of SYS_CLOCK_GETTIME
+ */
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+/*
+ * Where the time page is mapped, read-only, in every process.
+ */
+#define TIME_PAGE_VADDR 0xBFFE0000
+
+/*
+ * time_page clock modes: whether the time since the last update can be
+ * read from the TSC, or the time is only as fine as the timer tick.
+ */
+#define TIME_PAGE_COARSE 0
+#define TIME_PAGE_TSC    1
+
+/*
+ * The time base, updated every timer tick. The monotonic time is
+ *
+ *     mono_sec, mono_nsec + ((tsc - cycle_last) * mult + frac) >> shift
+ *
+ * the TSC part only in TIME_PAGE_TSC mode, and the realtime is real_sec
+ * seconds more. seq is odd while the page is updated, so readers copy what
+ * they need and start over if seq was odd or changed meanwhile:
+ *
+ *     do {
+ *         seq = tp->seq;
+ *         ...
+ *     } while ((seq & 1) || seq != tp->seq);
+ */
+struct time_page {
+    volatile uint32_t seq;
+    uint32_t clock_mode;
+    uint64_t cycle_last;
+    uint32_t mult;
+    uint32_t shift;
+    uint64_t frac;
+    uint32_t mono_sec;
+    uint32_t mono_nsec;
+    uint32_t real_sec;
+};
+
+/*
+ * Sets the realtime clock from the CMOS RTC.
+ */
+void
+timekeeping_init(
+    void
+);
+
+/*
+ * Folds the time since the last update into the time base, so the counts
+ * to convert never get too many. Called from the timer tick on the first
+ * CPU.
+ */
+void
+timekeeping_tick(
+    void
+);
+
+/*
+ * Keeps time with cs from now on. Returns -1 if it has no better rating
+ * than the clocksource in use.
+ */
+int
+timekeeping_change_clocksource(
+    struct clocksource *cs
+);
+
+/*
+ * Monotonic time since boot, in nanoseconds.
+ */
+uint64_t
+ktime_get_ns(
+    void
+);
+
+void
+ktime_get_ts(
+    struct timespec *ts
+);
+
+/*
+ * Time since the epoch, 1970-01-01 00:00:00 UTC.
+ */
+void
+ktime_get_real_ts(
+    struct timespec *ts
+);
+
+/*
+ * Maps the time page into pdt at TIME_PAGE_VADDR. Returns -1 on failure.
+ */
+int
+timekeeping_map(
+    struct pde *pdt
+);
+
+#endif
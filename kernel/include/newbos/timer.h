@@ -3,6 +3,21 @@
 
 #include <stdint.h>
 
-void timer_init(int16_t frequency);
+/*
+ * Timer interrupts per second
+ */
+#define TIMER_FREQUENCY 100
+
+void timer_init(uint32_t frequency);
+
+uint32_t timer_ticks(void);
+
+/*
+ * Halts the first CPU until an interrupt. Called with interrupts disabled,
+ * returns with them enabled. When max_ticks is more than 1, the periodic
+ * tick is stopped for up to that many ticks meanwhile, or as many as the
+ * PIT can count; timer_ticks() catches up when the CPU wakes up.
+ */
+void timer_idle(uint32_t max_ticks);
 
 #endif
@@ -0,0 +1,102 @@
+#ifndef _NEWBOS_VM_H
+#define _NEWBOS_VM_H
+
+#include <stdint.h>
+
+#include <newbos/initrd.h>
+#include <newbos/process.h>
+
+/*
+ * vm_area flags
+ */
+#define VM_READ_WRITE 0x01
+#define VM_ANONYMOUS  0x02
+#define VM_FILE       0x04
+
+/*
+ * A range [start, end) of a process address space whose pages are mapped on
+ * demand by the page fault handler.
+ *
+ * The first file_size bytes of a VM_FILE area are those at file_offset, a
+ * page boundary, of an image in the initial ramdisk. Its pages are mapped
+ * read-only from the page cache, shared with every process running the
+ * image; in a writable area each is copied on its first write. The page the
+ * file data ends in is a cached copy with the rest zeroed, except in a
+ * writable area, where it's copied right away. Pages after it are zeroed
+ * like anonymous memory.
+ */
+struct vm_area {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+    struct initrd_file const *file;
+    uint32_t file_offset;
+    uint32_t file_size;
+    struct vm_area *next;
+};
+
+struct vm_stats {
+    uint32_t large_pages;
+    uint32_t large_page_bytes;
+};
+
+void
+vm_init(
+    void
+);
+
+int
+vm_area_add(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t size,
+    uint32_t flags
+);
+
+/*
+ * Adds a VM_FILE area, vaddr has to be page aligned.
+ */
+int
+vm_area_add_file(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t size,
+    uint32_t flags,
+    struct initrd_file const *file,
+    uint32_t file_offset,
+    uint32_t file_size
+);
+
+int
+vm_handle_fault(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t error_code
+);
+
+/*
+ * Maps the pages of [vaddr, vaddr + size) of p the kernel is about to read,
+ * or write if write is set, so it doesn't fault on them itself; pages to be
+ * written are copied on write first. Returns -1 if any byte isn't in an
+ * area of p that allows the access.
+ */
+int
+vm_fault_in_range(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t size,
+    int write
+);
+
+void
+vm_get_stats(
+    struct process *p,
+    struct vm_stats *stats
+);
+
+void
+vm_dump_stats(
+    struct process *p
+);
+
+#endif
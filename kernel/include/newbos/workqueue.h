@@ -0,0 +1,88 @@
+#ifndef _NEWBOS_WORKQUEUE_H
+#define _NEWBOS_WORKQUEUE_H
+
+#include <stdint.h>
+
+#include <newbos/process.h>
+
+/*
+ * Most kernel threads a workqueue runs its work on.
+ */
+#define WORKQUEUE_MAX_WORKERS 8
+
+/*
+ * Something to be done later, by a kernel thread. Usually embedded in the
+ * structure it works on. A work item is queued at most once at a time, it
+ * can be queued again as soon as func starts.
+ */
+struct work {
+    void (*func)(struct work *work);
+    struct work *next;
+    uint32_t pending;
+};
+
+/*
+ * Work items run in the order they were queued, by a pool of kernel
+ * threads, with the kernel lock held like any kernel code. Bit i of
+ * idle_mask is set while workers[i] waits for work.
+ */
+struct workqueue {
+    char const *name;
+    struct work *head;
+    struct work *tail;
+    struct process *workers[WORKQUEUE_MAX_WORKERS];
+    uint32_t nr_workers;
+    uint32_t idle_mask;
+    uint32_t nr_queued;
+    uint32_t nr_done;
+};
+
+void
+work_init(
+    struct work *work,
+    void (*func)(struct work *work)
+);
+
+/*
+ * Creates a workqueue run by nr_workers kernel threads. Returns NULL if
+ * none of them could be created.
+ */
+struct workqueue *
+workqueue_create(
+    char const *name,
+    uint32_t nr_workers
+);
+
+/*
+ * Queues work on wq. Returns 0 if it was queued already. Can be called from
+ * interrupt handlers.
+ */
+int
+queue_work(
+    struct workqueue *wq,
+    struct work *work
+);
+
+/*
+ * Queues work on the workqueue shared by the whole kernel. Work can be
+ * queued before workqueue_init(), it runs once the workers are up.
+ */
+int
+schedule_work(
+    struct work *work
+);
+
+/*
+ * Starts the workers of the shared workqueue, one per CPU.
+ */
+void
+workqueue_init(
+    void
+);
+
+void
+workqueue_dump_stats(
+    void
+);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _NEWBOS_WSS_H
+#define _NEWBOS_WSS_H
+
+#include <stdint.h>
+
+#include <newbos/paging.h>
+
+struct process;
+
+/*
+ * Page ages lower than this count as part of the working set, i.e. pages
+ * accessed during the last WSS_WINDOW scans.
+ */
+#define WSS_WINDOW 2
+
+/*
+ * Memory use of a process as of its last scan, in pages. Large pages count
+ * as the 4 KB pages they are made of.
+ */
+struct wss {
+    uint32_t resident;
+    uint32_t working_set;
+    uint32_t dirty;
+    uint32_t ages[PAGE_AGE_MAX + 1];
+    uint32_t scans;
+};
+
+/*
+ * Samples the accessed and dirty bits of every user page of every process
+ * once per scan interval, on the shared workqueue, from now on.
+ */
+void
+wss_init(
+    void
+);
+
+void
+wss_scan_process(
+    struct process *p
+);
+
+void
+wss_dump_stats(
+    struct process *p
+);
+
+#endif
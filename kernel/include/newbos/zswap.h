@@ -0,0 +1,51 @@
+#ifndef _NEWBOS_ZSWAP_H
+#define _NEWBOS_ZSWAP_H
+
+#include <stdint.h>
+
+#include <newbos/paging.h>
+
+struct zswap_stats {
+    uint32_t stored_pages;
+    uint32_t pool_pages;
+    uint32_t compressed_bytes;
+    uint32_t loads;
+    uint32_t rejected_incompressible;
+    uint32_t rejected_pool_full;
+};
+
+/*
+ * Sets up a compressed cache in front of swap that may grow to
+ * max_pool_pages page frames.
+ */
+void
+zswap_init(
+    uint32_t max_pool_pages
+);
+
+/*
+ * Compresses the page frame into the pool. Returns 0 and the index of the
+ * entry holding it, or -1 if the page doesn't compress well or the pool is
+ * full; the page then has to go to disk.
+ */
+int
+zswap_store(
+    paddr_t paddr,
+    uint32_t *out_index
+);
+
+/*
+ * Decompresses the entry into the page frame and frees the entry.
+ */
+int
+zswap_load(
+    uint32_t index,
+    paddr_t paddr
+);
+
+void
+zswap_get_stats(
+    struct zswap_stats *stats
+);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/initrd.h>
+#include <newbos/printk.h>
+
+#define FOUR_KB 0x1000
+
+static struct initrd_file files[INITRD_MAX_FILES];
+static uint32_t nr_files;
+
+void
+initrd_init(
+    struct multiboot_info *minfo)
+{
+    multiboot_module_t *mods;
+    char const *cmdline;
+    uint32_t i, n;
+
+    if (!(minfo->flags & MULTIBOOT_INFO_MODS))
+    {
+        return;
+    }
+
+    mods = (multiboot_module_t *) minfo->mods_addr;
+    for (i = 0; i < minfo->mods_count && nr_files < INITRD_MAX_FILES; ++i)
+    {
+        struct initrd_file *f = &files[nr_files];
+
+        if (mods[i].mod_start % FOUR_KB != 0)
+        {
+            printk("initrd_init: Module isn't page aligned. start: %X\n",
+                   mods[i].mod_start);
+            continue;
+        }
+
+        cmdline = (char const *) mods[i].cmdline;
+        for (n = 0; cmdline != NULL && cmdline[n] != '\0' &&
+                    n + 1 < INITRD_CMDLINE_MAX; ++n)
+        {
+            f->cmdline[n] = cmdline[n];
+        }
+        f->cmdline[n] = '\0';
+        f->paddr = mods[i].mod_start;
+        f->size = mods[i].mod_end - mods[i].mod_start;
+        ++nr_files;
+
+        printk("initrd: %s, %u bytes at %X\n", f->cmdline, f->size,
+               (uint32_t) f->paddr);
+    }
+}
+
+/*
+ * Returns 1 if path is one of the space separated words of cmdline.
+ */
+static int
+cmdline_has(
+    char const *cmdline,
+    char const *path)
+{
+    uint32_t len = strlen(path);
+    char const *s;
+
+    for (s = cmdline; *s != '\0'; ++s)
+    {
+        if ((s == cmdline || s[-1] == ' ') && memcmp(s, path, len) == 0 &&
+            (s[len] == '\0' || s[len] == ' '))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+struct initrd_file const *
+initrd_find(
+    char const *path)
+{
+    uint32_t i;
+
+    for (i = 0; i < nr_files; ++i)
+    {
+        if (cmdline_has(files[i].cmdline, path))
+        {
+            return &files[i];
+        }
+    }
+
+    return NULL;
+}
+
+int
+initrd_read(
+    struct initrd_file const *f,
+    uint32_t offset,
+    void *buf,
+    uint32_t len)
+{
+    uint8_t *page, *dst = buf;
+    uint32_t n;
+
+    if (offset + len < offset || offset + len > f->size)
+    {
+        return -1;
+    }
+
+    while (len > 0)
+    {
+        n = FOUR_KB - offset % FOUR_KB;
+        if (n > len)
+        {
+            n = len;
+        }
+
+        page = kmap_frame(f->paddr + (offset - offset % FOUR_KB));
+        memcpy(dst, page + offset % FOUR_KB, n);
+        kunmap_frame(page);
+
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
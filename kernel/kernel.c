@@ -1,15 +1,74 @@
+#include <string.h>
+
+#include <newbos/fpu.h>
+#include <newbos/hrtimer.h>
+#include <newbos/initrd.h>
 #include <newbos/kmalloc.h>
+#include <newbos/kstack.h>
+#include <newbos/ktimer.h>
 #include <newbos/paging.h>
 #include <newbos/process.h>
 #include <newbos/printk.h>
 #include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/softirq.h>
+#include <newbos/swap.h>
+#include <newbos/syscall.h>
+#include <newbos/timekeeping.h>
 #include <newbos/timer.h>
+#include <newbos/vm.h>
+#include <newbos/workqueue.h>
+#include <newbos/wss.h>
 
+#include "ata.h"
+#include "double_fault.h"
 #include "gdt.h"
 #include "interrupts.h"
 #include "keyboard.h"
 #include "memory.h"
 #include "multiboot.h"
+#include "tsc.h"
+
+/*
+ * Finds "name=value" on the kernel command line and copies value, up to the
+ * next space, into buf. Returns buf, or NULL if the option isn't there.
+ */
+static char const *
+cmdline_option(
+    struct multiboot_info *minfo,
+    char const *name,
+    char *buf,
+    uint32_t size)
+{
+    char const *start, *s;
+    uint32_t len = strlen(name);
+
+    if (!(minfo->flags & MULTIBOOT_INFO_CMDLINE) || minfo->cmdline == 0)
+    {
+        return NULL;
+    }
+
+    start = (char const *) minfo->cmdline;
+    for (s = start; *s != '\0'; ++s)
+    {
+        uint32_t i = 0;
+
+        if ((s != start && s[-1] != ' ') ||
+            memcmp(s, name, len) != 0 || s[len] != '=')
+        {
+            continue;
+        }
+
+        for (s += len + 1; *s != '\0' && *s != ' ' && i + 1 < size; ++s)
+        {
+            buf[i++] = *s;
+        }
+        buf[i] = '\0';
+        return buf;
+    }
+
+    return NULL;
+}
 
 void
 kernel_main(
@@ -44,23 +103,68 @@ kernel_main(
                 VIRTUAL_TO_PHYSICAL(kernel_pdt_vaddr),
                 VIRTUAL_TO_PHYSICAL(kernel_pt_vaddr),
                 minfo);
+    double_fault_init_cpu();
+
+    initrd_init(minfo);
+    vm_init();
+    kstack_init();
+    swap_init(ata_init());
 
     //asm volatile ("int $0x3");
     //asm volatile ("int $0x4");
 
     keyboard_init();
+    fpu_init();
 
     int *i = (int *)kmalloc(sizeof(int));
     *i = 42;
     printk("kmalloc'd '%u' at %X...\n", *i, i);
 
-    //timer_init(1000);
+    char sched_policy[8];
+    scheduler_init(cmdline_option(minfo, "sched", sched_policy,
+                                  sizeof(sched_policy)));
+    timekeeping_init();
+    ktimers_init();
+    timer_init(TIMER_FREQUENCY);
+    tsc_init();
+    syscall_init();
+    smp_init();
+    softirq_init();
+    workqueue_init();
+    wss_init();
 
-    struct process *p = process_create("/bin/init");
-    scheduler_add_process(p);
-    scheduler_schedule();
-    printk("Finished process init %u!!!\n", p->id);
+    /*
+     * Something for every CPU to run.
+     */
+    uint32_t cpu;
+    for (cpu = 0; cpu < smp_num_cpus(); ++cpu)
+    {
+        struct process *p = process_create("/bin/init");
+        if (p != NULL)
+        {
+            scheduler_add_process(p);
+            printk("Finished process init %u!!!\n", p->id);
+        }
+    }
+
+    /*
+     * Loop forever; background work runs on kernel threads, kicked off by
+     * timers. Halt without the timer tick until the next timer may be due
+     * when there is nothing to run. The other CPUs only get into the kernel
+     * while we don't hold the kernel lock.
+     */
+    for (;;)
+    {
+        uint32_t ticks = ktimer_ticks_to_next();
+        uint32_t hrtimer_ticks = hrtimer_ticks_to_next();
 
-    // Loop forever.
-    for (;;);
+        if (hrtimer_ticks < ticks)
+        {
+            ticks = hrtimer_ticks;
+        }
+
+        unlock_kernel();
+        scheduler_idle(ticks);
+        lock_kernel();
+    }
 }
@@ -119,7 +119,8 @@ kmalloc(size_t nbytes)
 static void *
 acquire_more_heap(size_t nunits)
 {
-    uint32_t vaddr, paddr, bytes, page_frames, mapped_mem;
+    uint32_t vaddr, bytes, page_frames, mapped_mem;
+    paddr_t paddr;
     header_t *p;
 
     if (nunits < MIN_BLOCK_SIZE)
@@ -144,7 +145,7 @@ acquire_more_heap(size_t nunits)
     {
         printk("Could't find a virtual address. "
                "paddr: %X, page_frames: %u, bytes: %u\n",
-               paddr, page_frames, bytes);
+               (uint32_t) paddr, page_frames, bytes);
         return NULL;
     }
 
@@ -154,7 +155,7 @@ acquire_more_heap(size_t nunits)
     {
         printk("Could't map virtual memory. "
                "vaddr: %X, paddr: %X, page_frames: %u, bytes: %u\n",
-                  vaddr, paddr, page_frames, bytes);
+                  vaddr, (uint32_t) paddr, page_frames, bytes);
         return NULL;
     }
 
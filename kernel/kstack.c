@@ -0,0 +1,181 @@
+#include <stddef.h>
+
+#include <newbos/kstack.h>
+#include <newbos/paging.h>
+#include <newbos/printk.h>
+
+#define FOUR_KB 0x1000
+
+#define KSTACK_GUARD_SIZE FOUR_KB
+#define KSTACK_SLOT_SIZE  (KSTACK_GUARD_SIZE + KSTACK_SIZE)
+
+/*
+ * Stacks are mapped a chunk at a time: KSTACK_CHUNK_SLOTS slots back to
+ * back, each a guard page and a stack.
+ */
+#define KSTACK_CHUNK_SLOTS 16
+#define KSTACK_MAX_CHUNKS  64
+
+struct kstack_chunk {
+    uint32_t base;
+    uint32_t slots;
+};
+
+static struct kstack_chunk chunks[KSTACK_MAX_CHUNKS];
+static uint32_t nr_chunks;
+
+/*
+ * Lowest address of the first free stack. The first word of a free stack
+ * holds the next one.
+ */
+static uint32_t free_list;
+static uint32_t nr_free;
+
+static void
+push_free(
+    uint32_t stack)
+{
+    *(uint32_t *) stack = free_list;
+    free_list = stack;
+    ++nr_free;
+}
+
+/*
+ * Maps another chunk of stacks and puts them on the free list. Returns -1
+ * if none could be mapped.
+ */
+static int
+kstack_grow(
+    void)
+{
+    struct kstack_chunk *chunk;
+    paddr_t paddrs[KSTACK_CHUNK_SLOTS];
+    uint32_t i, n, stack;
+
+    if (nr_chunks == KSTACK_MAX_CHUNKS)
+    {
+        printk("kstack_grow: Too many stacks. chunks: %u\n", nr_chunks);
+        return -1;
+    }
+
+    /*
+     * Frames first: reclaim may map kernel memory while we wait for them,
+     * which must not be in the chunk.
+     */
+    for (n = 0; n < KSTACK_CHUNK_SLOTS; ++n)
+    {
+        paddrs[n] = pfa_allocate(1);
+        if (paddrs[n] == 0)
+        {
+            break;
+        }
+    }
+
+    chunk = &chunks[nr_chunks];
+    chunk->base = pdt_kernel_find_next_vaddr(n * KSTACK_SLOT_SIZE);
+    chunk->slots = 0;
+    if (n == 0 || chunk->base == 0)
+    {
+        printk("kstack_grow: Could not find memory for stacks. frames: %u\n",
+               n);
+        for (i = 0; i < n; ++i)
+        {
+            pfa_free(paddrs[i]);
+        }
+        return -1;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        stack = chunk->base + i * KSTACK_SLOT_SIZE + KSTACK_GUARD_SIZE;
+
+        if (pdt_map_kernel_memory(paddrs[i], stack, KSTACK_SIZE,
+                                  PAGING_READ_WRITE, PAGING_PL0)
+                != KSTACK_SIZE ||
+            pdt_map_kernel_guard(stack - KSTACK_GUARD_SIZE) != 0)
+        {
+            printk("kstack_grow: Could not map stack. vaddr: %X\n", stack);
+            break;
+        }
+
+        push_free(stack);
+        ++chunk->slots;
+    }
+
+    for (; i < n; ++i)
+    {
+        pfa_free(paddrs[i]);
+    }
+
+    if (chunk->slots == 0)
+    {
+        return -1;
+    }
+    ++nr_chunks;
+    return 0;
+}
+
+void
+kstack_init(
+    void)
+{
+    kstack_grow();
+}
+
+uint32_t
+kstack_alloc(
+    void)
+{
+    uint32_t stack;
+
+    if (free_list == 0 && kstack_grow() != 0)
+    {
+        return 0;
+    }
+
+    stack = free_list;
+    free_list = *(uint32_t *) stack;
+    --nr_free;
+
+    return stack + KSTACK_SIZE;
+}
+
+void
+kstack_free(
+    uint32_t top)
+{
+    push_free(top - KSTACK_SIZE);
+}
+
+int
+kstack_guard_hit(
+    uint32_t vaddr)
+{
+    uint32_t i;
+
+    for (i = 0; i < nr_chunks; ++i)
+    {
+        if (vaddr >= chunks[i].base &&
+            vaddr - chunks[i].base < chunks[i].slots * KSTACK_SLOT_SIZE)
+        {
+            return (vaddr - chunks[i].base) % KSTACK_SLOT_SIZE <
+                   KSTACK_GUARD_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+void
+kstack_dump_stats(
+    void)
+{
+    uint32_t i, total = 0;
+
+    for (i = 0; i < nr_chunks; ++i)
+    {
+        total += chunks[i].slots;
+    }
+
+    printk("kstack: %u stacks, %u free\n", total, nr_free);
+}
@@ -0,0 +1,331 @@
+#include <stddef.h>
+
+#include <newbos/ktimer.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/scheduler.h>
+#include <newbos/softirq.h>
+#include <newbos/timer.h>
+
+#include "interrupts.h"
+
+/*
+ * The timer wheel: timers due within the next 256 ticks hang off the slot
+ * for their tick in the first level. Each further level has 64 slots
+ * covering 64 times the range of the one below. Whenever the first level
+ * wraps around, the next slot of the second level is cascaded down into it,
+ * and so on up, so a timer moves at most once per level.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+#define TVN_INDEX(ticks, level) \
+    (((ticks) >> (TVR_BITS + (level) * TVN_BITS)) & TVN_MASK)
+
+/*
+ * Milliseconds per timer tick
+ */
+#define MS_PER_TICK (1000 / TIMER_FREQUENCY)
+
+static struct ktimer *tv1[TVR_SIZE];
+static struct ktimer *tvn[TVN_LEVELS][TVN_SIZE];
+
+/*
+ * Timers taken off the wheel for the tick being run, so running one can
+ * still cancel another.
+ */
+static struct ktimer *expired;
+
+/*
+ * The next tick to run the timers of.
+ */
+static uint32_t timer_jiffies;
+
+static uint32_t nr_pending;
+
+static void
+link(
+    struct ktimer **bucket,
+    struct ktimer *t)
+{
+    t->bucket = bucket;
+    t->prev = NULL;
+    t->next = *bucket;
+    if (*bucket != NULL)
+    {
+        (*bucket)->prev = t;
+    }
+    *bucket = t;
+}
+
+static void
+unlink(
+    struct ktimer *t)
+{
+    if (t->prev != NULL)
+    {
+        t->prev->next = t->next;
+    }
+    else
+    {
+        *t->bucket = t->next;
+    }
+    if (t->next != NULL)
+    {
+        t->next->prev = t->prev;
+    }
+    t->bucket = NULL;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+static void
+internal_add(
+    struct ktimer *t)
+{
+    uint32_t expires = t->expires, delta = expires - timer_jiffies;
+    struct ktimer **bucket;
+
+    if ((int32_t) delta < 0)
+    {
+        bucket = &tv1[timer_jiffies & TVR_MASK];
+    }
+    else if (delta < TVR_SIZE)
+    {
+        bucket = &tv1[expires & TVR_MASK];
+    }
+    else if (delta < 1 << (TVR_BITS + TVN_BITS))
+    {
+        bucket = &tvn[0][TVN_INDEX(expires, 0)];
+    }
+    else if (delta < 1 << (TVR_BITS + 2 * TVN_BITS))
+    {
+        bucket = &tvn[1][TVN_INDEX(expires, 1)];
+    }
+    else if (delta < 1 << (TVR_BITS + 3 * TVN_BITS))
+    {
+        bucket = &tvn[2][TVN_INDEX(expires, 2)];
+    }
+    else
+    {
+        bucket = &tvn[3][TVN_INDEX(expires, 3)];
+    }
+
+    link(bucket, t);
+}
+
+/*
+ * Moves the timers of the current slot of a level down the wheel. Returns
+ * the slot, 0 when the level wrapped around and the next one is due too.
+ */
+static uint32_t
+cascade(
+    uint32_t level)
+{
+    uint32_t index = TVN_INDEX(timer_jiffies, level);
+    struct ktimer *t;
+
+    while ((t = tvn[level][index]) != NULL)
+    {
+        unlink(t);
+        internal_add(t);
+    }
+
+    return index;
+}
+
+static void
+run_timers(
+    void)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    struct ktimer *t;
+
+    while ((int32_t)(timer_ticks() - timer_jiffies) >= 0)
+    {
+        uint32_t index = timer_jiffies & TVR_MASK, level;
+
+        for (level = 0; index == 0 && level < TVN_LEVELS; ++level)
+        {
+            if (cascade(level) != 0)
+            {
+                break;
+            }
+        }
+        ++timer_jiffies;
+
+        expired = tv1[index];
+        tv1[index] = NULL;
+        for (t = expired; t != NULL; t = t->next)
+        {
+            t->bucket = &expired;
+        }
+
+        while ((t = expired) != NULL)
+        {
+            unlink(t);
+            --nr_pending;
+            restore_interrupts(flags);
+            t->func(t);
+            flags = save_and_disable_interrupts();
+        }
+    }
+
+    restore_interrupts(flags);
+}
+
+void
+ktimers_init(
+    void)
+{
+    timer_jiffies = timer_ticks();
+    open_softirq(SOFTIRQ_TIMER, run_timers);
+}
+
+void
+ktimer_init(
+    struct ktimer *t,
+    void (*func)(struct ktimer *t))
+{
+    t->expires = 0;
+    t->func = func;
+    t->bucket = NULL;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+/*
+ * The timers run from a softirq, which can interrupt the kernel lock holder
+ * on the same CPU; the wheel is only changed with interrupts disabled.
+ */
+void
+ktimer_add(
+    struct ktimer *t,
+    uint32_t expires)
+{
+    uint32_t flags = save_and_disable_interrupts();
+
+    if (t->bucket != NULL)
+    {
+        unlink(t);
+        --nr_pending;
+    }
+
+    t->expires = expires;
+    internal_add(t);
+    ++nr_pending;
+
+    restore_interrupts(flags);
+}
+
+int
+ktimer_cancel(
+    struct ktimer *t)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    int pending = t->bucket != NULL;
+
+    if (pending)
+    {
+        unlink(t);
+        --nr_pending;
+    }
+
+    restore_interrupts(flags);
+    return pending;
+}
+
+int
+ktimer_pending(
+    struct ktimer *t)
+{
+    return t->bucket != NULL;
+}
+
+uint32_t
+ktimer_ticks_to_next(
+    void)
+{
+    uint32_t now = timer_ticks(), index, i;
+
+    if (nr_pending == 0)
+    {
+        return KTIMER_NONE;
+    }
+    if ((int32_t)(now - timer_jiffies) >= 0)
+    {
+        return 0;
+    }
+
+    /*
+     * Only the first level is searched, up to where it wraps around: a
+     * timer further up may have to be cascaded there.
+     */
+    index = timer_jiffies & TVR_MASK;
+    for (i = index; i < TVR_SIZE; ++i)
+    {
+        if (tv1[i] != NULL)
+        {
+            break;
+        }
+    }
+
+    return timer_jiffies + (i - index) - now;
+}
+
+struct sleeper {
+    struct ktimer timer;
+    struct process *p;
+};
+
+static void
+sleeper_wake(
+    struct ktimer *t)
+{
+    /*
+     * The timer is the first member.
+     */
+    struct sleeper *s = (struct sleeper *) t;
+
+    scheduler_wake(s->p);
+}
+
+int
+ktimer_block_timeout(
+    uint32_t ticks)
+{
+    struct sleeper s;
+
+    s.p = scheduler_current_process();
+    ktimer_init(&s.timer, sleeper_wake);
+
+    /*
+     * The timer can't run on this CPU before the process is blocked, or
+     * the wakeup would be lost.
+     */
+    disable_interrupts();
+    ktimer_add(&s.timer, timer_ticks() + ticks);
+    scheduler_block();
+
+    return ktimer_cancel(&s.timer);
+}
+
+void
+ktimer_sleep(
+    uint32_t ms)
+{
+    /*
+     * The current tick is partly over, so sleep one more.
+     */
+    uint32_t until = timer_ticks() + (ms + MS_PER_TICK - 1) / MS_PER_TICK + 1;
+
+    while ((int32_t)(until - timer_ticks()) > 0)
+    {
+        ktimer_block_timeout(until - timer_ticks());
+    }
+}
@@ -0,0 +1,265 @@
+#include <string.h>
+
+#include <newbos/lz.h>
+
+/*
+ * Every sequence starts with a token byte: the high nibble is the number of
+ * literals, the low nibble the match length minus LZ_MIN_MATCH. A nibble of
+ * 15 is followed by extra length bytes, added up until one is below 255.
+ * Then come the literals and, unless the input ends there, a 16 bit little
+ * endian offset back to the start of the match.
+ */
+#define LZ_MIN_MATCH    4
+#define LZ_NIBBLE_MAX   15
+#define LZ_HASH_BITS    12
+
+/*
+ * Last position + 1 at which each hashed 4 byte sequence was seen, 0 if
+ * never.
+ */
+static uint16_t hash_table[1 << LZ_HASH_BITS];
+
+static uint32_t
+read32(
+    uint8_t const *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t
+hash(
+    uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static int
+put_length(
+    uint8_t *dst,
+    uint32_t *op,
+    uint32_t dst_size,
+    uint32_t n)
+{
+    while (n >= 255)
+    {
+        if (*op >= dst_size)
+        {
+            return -1;
+        }
+        dst[(*op)++] = 255;
+        n -= 255;
+    }
+    if (*op >= dst_size)
+    {
+        return -1;
+    }
+    dst[(*op)++] = (uint8_t) n;
+    return 0;
+}
+
+/*
+ * Emits the literals [anchor, anchor + lit) and, if match_len isn't 0, a
+ * match of match_len bytes at the given offset.
+ */
+static int
+put_sequence(
+    uint8_t *dst,
+    uint32_t *op,
+    uint32_t dst_size,
+    uint8_t const *literals,
+    uint32_t lit,
+    uint32_t offset,
+    uint32_t match_len)
+{
+    uint32_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    uint8_t token;
+
+    token = (lit < LZ_NIBBLE_MAX ? lit : LZ_NIBBLE_MAX) << 4;
+    token |= ml < LZ_NIBBLE_MAX ? ml : LZ_NIBBLE_MAX;
+
+    if (*op >= dst_size)
+    {
+        return -1;
+    }
+    dst[(*op)++] = token;
+
+    if (lit >= LZ_NIBBLE_MAX &&
+        put_length(dst, op, dst_size, lit - LZ_NIBBLE_MAX) != 0)
+    {
+        return -1;
+    }
+
+    if (*op + lit > dst_size)
+    {
+        return -1;
+    }
+    memcpy(dst + *op, literals, lit);
+    *op += lit;
+
+    if (match_len == 0)
+    {
+        return 0;
+    }
+
+    if (*op + 2 > dst_size)
+    {
+        return -1;
+    }
+    dst[(*op)++] = (uint8_t) offset;
+    dst[(*op)++] = (uint8_t) (offset >> 8);
+
+    if (ml >= LZ_NIBBLE_MAX &&
+        put_length(dst, op, dst_size, ml - LZ_NIBBLE_MAX) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+uint32_t
+lz_compress(
+    void const *src,
+    uint32_t src_size,
+    void *dst,
+    uint32_t dst_size)
+{
+    uint8_t const *s = (uint8_t const *) src;
+    uint8_t *d = (uint8_t *) dst;
+    uint32_t ip = 0, anchor = 0, op = 0, h, ref, len;
+
+    if (src_size > LZ_MAX_INPUT)
+    {
+        return 0;
+    }
+
+    memset(hash_table, 0, sizeof(hash_table));
+
+    while (ip + LZ_MIN_MATCH <= src_size)
+    {
+        h = hash(read32(s + ip));
+        ref = hash_table[h];
+        hash_table[h] = (uint16_t) (ip + 1);
+
+        if (ref == 0 || read32(s + ref - 1) != read32(s + ip))
+        {
+            ++ip;
+            continue;
+        }
+        --ref;
+
+        len = LZ_MIN_MATCH;
+        while (ip + len < src_size && s[ref + len] == s[ip + len])
+        {
+            ++len;
+        }
+
+        if (put_sequence(d, &op, dst_size, s + anchor, ip - anchor,
+                         ip - ref, len) != 0)
+        {
+            return 0;
+        }
+
+        ip += len;
+        anchor = ip;
+    }
+
+    if (put_sequence(d, &op, dst_size, s + anchor, src_size - anchor, 0, 0)
+            != 0)
+    {
+        return 0;
+    }
+
+    return op;
+}
+
+static int
+get_length(
+    uint8_t const *src,
+    uint32_t *ip,
+    uint32_t src_size,
+    uint32_t *n)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= src_size)
+        {
+            return -1;
+        }
+        b = src[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+int32_t
+lz_decompress(
+    void const *src,
+    uint32_t src_size,
+    void *dst,
+    uint32_t dst_size)
+{
+    uint8_t const *s = (uint8_t const *) src;
+    uint8_t *d = (uint8_t *) dst;
+    uint32_t ip = 0, op = 0, lit, len, offset;
+    uint8_t token;
+
+    while (ip < src_size)
+    {
+        token = s[ip++];
+
+        lit = token >> 4;
+        if (lit == LZ_NIBBLE_MAX && get_length(s, &ip, src_size, &lit) != 0)
+        {
+            return -1;
+        }
+        if (ip + lit > src_size || op + lit > dst_size)
+        {
+            return -1;
+        }
+        memcpy(d + op, s + ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == src_size)
+        {
+            break;
+        }
+
+        if (ip + 2 > src_size)
+        {
+            return -1;
+        }
+        offset = s[ip] | ((uint32_t) s[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+        {
+            return -1;
+        }
+
+        len = token & LZ_NIBBLE_MAX;
+        if (len == LZ_NIBBLE_MAX && get_length(s, &ip, src_size, &len) != 0)
+        {
+            return -1;
+        }
+        len += LZ_MIN_MATCH;
+        if (op + len > dst_size)
+        {
+            return -1;
+        }
+
+        /*
+         * Byte by byte, the match may overlap the bytes it produces.
+         */
+        while (len-- > 0)
+        {
+            d[op] = d[op - offset];
+            ++op;
+        }
+    }
+
+    return (int32_t) op;
+}
@@ -0,0 +1,187 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/kmalloc.h>
+#include <newbos/pagecache.h>
+#include <newbos/printk.h>
+
+#define FOUR_KB 0x1000
+
+#define PAGE_CACHE_BUCKETS 64
+
+/*
+ * A cached page is in two hash tables: one by image and offset, to find it
+ * when it's mapped, and one by page frame, to find it when it's put back.
+ */
+struct cached_page {
+    struct initrd_file const *file;
+    uint32_t offset;
+    uint32_t len;
+    paddr_t paddr;
+    uint32_t refs;
+    struct cached_page *key_next;
+    struct cached_page *paddr_next;
+};
+
+static struct cached_page *by_key[PAGE_CACHE_BUCKETS];
+static struct cached_page *by_paddr[PAGE_CACHE_BUCKETS];
+static uint32_t nr_pages;
+static uint32_t nr_refs;
+
+static uint32_t
+key_hash(
+    struct initrd_file const *f,
+    uint32_t offset)
+{
+    return (((uint32_t) f >> 4) ^ (offset / FOUR_KB)) % PAGE_CACHE_BUCKETS;
+}
+
+static uint32_t
+paddr_hash(
+    paddr_t paddr)
+{
+    return (uint32_t) (paddr / FOUR_KB) % PAGE_CACHE_BUCKETS;
+}
+
+/*
+ * Returns a page frame with a copy of the len bytes at offset of f.
+ */
+static paddr_t
+copy_page(
+    struct initrd_file const *f,
+    uint32_t offset,
+    uint32_t len)
+{
+    paddr_t paddr = pfa_allocate(1);
+    uint8_t *page;
+    int ret;
+
+    if (paddr == 0)
+    {
+        printk("page_cache_get: Could not allocate page frame. "
+               "offset: %X\n", offset);
+        return 0;
+    }
+
+    page = kmap_frame(paddr);
+    ret = initrd_read(f, offset, page, len);
+    memset(page + len, 0, FOUR_KB - len);
+    kunmap_frame(page);
+
+    if (ret != 0)
+    {
+        pfa_free(paddr);
+        return 0;
+    }
+    return paddr;
+}
+
+paddr_t
+page_cache_get(
+    struct initrd_file const *f,
+    uint32_t offset,
+    uint32_t len)
+{
+    uint32_t h = key_hash(f, offset);
+    struct cached_page *page;
+
+    for (page = by_key[h]; page != NULL; page = page->key_next)
+    {
+        if (page->file == f && page->offset == offset && page->len == len)
+        {
+            ++page->refs;
+            ++nr_refs;
+            return page->paddr;
+        }
+    }
+
+    if (offset % FOUR_KB != 0 || len == 0 || len > FOUR_KB ||
+        offset + len < offset || offset + len > f->size)
+    {
+        return 0;
+    }
+
+    page = kmalloc(sizeof(struct cached_page));
+    if (page == NULL)
+    {
+        printk("page_cache_get: Could not allocate cache entry. "
+               "offset: %X\n", offset);
+        return 0;
+    }
+
+    page->paddr = len == FOUR_KB ? f->paddr + offset : copy_page(f, offset, len);
+    if (page->paddr == 0)
+    {
+        kfree(page);
+        return 0;
+    }
+
+    page->file = f;
+    page->offset = offset;
+    page->len = len;
+    page->refs = 1;
+    page->key_next = by_key[h];
+    by_key[h] = page;
+    h = paddr_hash(page->paddr);
+    page->paddr_next = by_paddr[h];
+    by_paddr[h] = page;
+    ++nr_pages;
+    ++nr_refs;
+
+    return page->paddr;
+}
+
+void
+page_cache_put(
+    paddr_t paddr)
+{
+    struct cached_page **pp, **kp, *page;
+
+    for (pp = &by_paddr[paddr_hash(paddr)]; *pp != NULL;
+         pp = &(*pp)->paddr_next)
+    {
+        if ((*pp)->paddr == paddr)
+        {
+            break;
+        }
+    }
+
+    page = *pp;
+    if (page == NULL)
+    {
+        printk("page_cache_put: Page isn't cached. paddr: %X\n",
+               (uint32_t) paddr);
+        return;
+    }
+
+    --nr_refs;
+    if (--page->refs > 0)
+    {
+        return;
+    }
+
+    *pp = page->paddr_next;
+    kp = &by_key[key_hash(page->file, page->offset)];
+    while (*kp != page)
+    {
+        kp = &(*kp)->key_next;
+    }
+    *kp = page->key_next;
+
+    /*
+     * Whole pages are the image's, which stays.
+     */
+    if (page->len != FOUR_KB)
+    {
+        pfa_free(page->paddr);
+    }
+    kfree(page);
+    --nr_pages;
+}
+
+void
+page_cache_dump_stats(
+    void)
+{
+    printk("page cache: %u pages, %u references\n", nr_pages, nr_refs);
+}
@@ -0,0 +1,130 @@
+#include <stddef.h>
+
+#include <newbos/pid.h>
+#include <newbos/process.h>
+
+#define BITMAP_WORDS (PID_MAX / 32)
+
+/*
+ * Buckets of the PID to process hash table, chained through pid_next in
+ * struct process. PIDs are handed out in sequence, so the low bits spread
+ * them evenly.
+ */
+#define PID_HASH_SIZE 256
+#define PID_HASH(pid) ((pid) & (PID_HASH_SIZE - 1))
+
+/*
+ * A bit per PID, set if it's in use. PID 0 is never handed out.
+ */
+static uint32_t pid_bitmap[BITMAP_WORDS] = { 0x1 };
+
+/*
+ * The PID handed out last, the search for a free one starts after it.
+ */
+static uint32_t last_pid;
+
+static struct process *pid_hash[PID_HASH_SIZE];
+
+/*
+ * Returns the first free PID in [from, to), or 0.
+ */
+static uint32_t
+find_free(
+    uint32_t from,
+    uint32_t to)
+{
+    uint32_t i = from / 32;
+    uint32_t word = ~pid_bitmap[i] & (~0u << (from % 32));
+
+    for (;;)
+    {
+        if (word != 0)
+        {
+            uint32_t pid = i * 32 + __builtin_ctz(word);
+            return pid < to ? pid : 0;
+        }
+        if (++i >= BITMAP_WORDS || i * 32 >= to)
+        {
+            return 0;
+        }
+        word = ~pid_bitmap[i];
+    }
+}
+
+uint32_t
+pid_alloc(
+    void)
+{
+    uint32_t pid = 0;
+
+    if (last_pid + 1 < PID_MAX)
+    {
+        pid = find_free(last_pid + 1, PID_MAX);
+    }
+    if (pid == 0)
+    {
+        pid = find_free(1, last_pid + 1);
+    }
+    if (pid == 0)
+    {
+        return 0;
+    }
+
+    pid_bitmap[pid / 32] |= 1u << (pid % 32);
+    last_pid = pid;
+    return pid;
+}
+
+void
+pid_free(
+    uint32_t pid)
+{
+    if (pid == 0 || pid >= PID_MAX)
+    {
+        return;
+    }
+    pid_bitmap[pid / 32] &= ~(1u << (pid % 32));
+}
+
+void
+pid_register(
+    struct process *p)
+{
+    struct process **bucket = pid_hash + PID_HASH(p->id);
+
+    p->pid_next = *bucket;
+    *bucket = p;
+}
+
+void
+pid_unregister(
+    struct process *p)
+{
+    struct process **e;
+
+    for (e = pid_hash + PID_HASH(p->id); *e != NULL; e = &(*e)->pid_next)
+    {
+        if (*e == p)
+        {
+            *e = p->pid_next;
+            p->pid_next = NULL;
+            return;
+        }
+    }
+}
+
+struct process *
+pid_find(
+    uint32_t pid)
+{
+    struct process *p;
+
+    for (p = pid_hash[PID_HASH(pid)]; p != NULL; p = p->pid_next)
+    {
+        if (p->id == pid)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
@@ -1,18 +1,35 @@
 #include <string.h>
 
+#include <newbos/elf.h>
+#include <newbos/initrd.h>
 #include <newbos/kmalloc.h>
+#include <newbos/kstack.h>
+#include <newbos/pagecache.h>
+#include <newbos/pid.h>
 #include <newbos/process.h>
 #include <newbos/printk.h>
 #include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/syscall.h>
+#include <newbos/timekeeping.h>
+#include <newbos/vm.h>
 
+#include "interrupts.h"
 #include "memory.h"
 
 #define FOUR_KB     0x1000
-#define PROC_INITIAL_STACK_SIZE 1 /* in page frames */
-#define PROC_INITIAL_STACK_VADDR (KERNEL_START_VADDR - FOUR_KB)
+#define PROC_INITIAL_STACK_SIZE 16 /* in page frames */
+#define PROC_INITIAL_STACK_VADDR \
+    (KERNEL_START_VADDR - PROC_INITIAL_STACK_SIZE * FOUR_KB)
 #define PROC_INITIAL_ESP (KERNEL_START_VADDR - 4)
+#define PROC_HEAP_VADDR 0x10000000
+#define PROC_HEAP_SIZE  0x1000000
 
-#define KERNEL_STACK_SIZE FOUR_KB
+/*
+ * Above the kernel's identity mapped first 4 MB, which every address space
+ * shares.
+ */
+#define PROC_CODE_VADDR 0x400000
 
 /*
  * segements
@@ -27,7 +44,15 @@
  */
 #define REG_EFLAGS_DEFAULT 0x202
 
-static struct tss tss;
+/*
+ * One per CPU, for the kernel stack of the process running on it.
+ */
+static struct tss tss[MAX_CPUS];
+
+static struct process *processes_first;
+static struct process *processes_last;
+
+static struct process kernel_process;
 
 static uint32_t
 div_ceil( uint32_t num, uint32_t den);
@@ -36,7 +61,7 @@ uint32_t
 tss_init(
     void)
 {
-    return (uint32_t) &tss;
+    return (uint32_t) &tss[smp_cpu_id()];
 }
 
 void
@@ -44,8 +69,16 @@ tss_set_kernel_stack(
     uint16_t segsel,
     uint32_t vaddr)
 {
-    tss.esp0 = vaddr;
-    tss.ss0 = segsel;
+    struct tss *t = &tss[smp_cpu_id()];
+    t->esp0 = vaddr;
+    t->ss0 = segsel;
+}
+
+struct process *
+process_kernel(
+    void)
+{
+    return &kernel_process;
 }
 
 void
@@ -55,9 +88,12 @@ process_init(
     process_create("/bin/init");
 }
 
-struct process *
-process_create(
-    char const *path)
+/*
+ * Allocates a process with everything but its PID set to the defaults.
+ */
+static struct process *
+process_alloc(
+    void)
 {
     struct process *p;
 
@@ -65,27 +101,173 @@ process_create(
     if (NULL == p)
     {
         printk("Failed to kmalloc 'struct process' during process create.");
+        return NULL;
     }
 
     /*
      * Initialize process structure.
      */
-    p->id = scheduler_next_pid();
+    p->id = 0;
     p->parent_id = 0;
+    p->name = NULL;
+    p->kthread_fn = NULL;
+    p->kthread_arg = NULL;
+    p->mm_owner = NULL;
+    p->state = PROCESS_RUNNABLE;
+    p->nice = 0;
+    p->prio = 0;
+    p->boost = 0;
+    p->run_prev = NULL;
+    p->run_next = NULL;
+    p->vruntime = 0;
+    p->slice_runtime = 0;
+    p->cpu = 0;
+    p->lock_depth = 0;
+    p->on_cpu = 0;
+    p->last_cpu = 0;
+    p->last_ran = 0;
+    p->rq_prev = NULL;
+    p->rq_next = NULL;
+    p->migrations = 0;
+    p->runtime_ticks = 0;
+    p->switches = 0;
+    p->fpu_used = 0;
+    p->fpu_cpu = 0;
     p->pdt = 0;
     p->pdt_paddr = 0;
     p->kernel_stack_start_vaddr = 0;
     p->code_start_vaddr = 0;
     p->stack_start_vaddr = PROC_INITIAL_STACK_VADDR;
+    p->heap_start_vaddr = PROC_HEAP_VADDR;
     p->code_paddrs.start = NULL;
     p->code_paddrs.end = NULL;
-    p->stack_paddrs.start = NULL;
-    p->stack_paddrs.end = NULL;
-    p->kernel_stack_paddrs.start = NULL;
-    p->kernel_stack_paddrs.end = NULL;
+    p->vm_areas = NULL;
+    p->ring = NULL;
+    p->next_process = NULL;
+    p->pid_next = NULL;
+    memset(&p->wss, 0, sizeof(struct wss));
 
     memset(&p->user_mode, 0, sizeof(struct _registers));
-    memset(&p->current, 0, sizeof(struct _registers));
+
+    return p;
+}
+
+/*
+ * Takes a kernel stack for p from the stack cache.
+ */
+static int
+process_load_kernel_stack(
+    struct process *p)
+{
+    uint32_t top = kstack_alloc();
+
+    if (top == 0) {
+        printk("process_load_kernel_stack: Could not allocate kernel "
+               "stack.\n");
+        return -1;
+    }
+
+    p->kernel_stack_start_vaddr = top - 4;
+
+    return 0;
+}
+
+/*
+ * Gives p a PID and adds it to the list of processes.
+ */
+static int
+process_register(
+    struct process *p)
+{
+    p->id = pid_alloc();
+    if (p->id == 0)
+    {
+        printk("process_register: Out of PIDs.\n");
+        return -1;
+    }
+    pid_register(p);
+
+    if (processes_first == NULL)
+    {
+        processes_first = p;
+    }
+    else
+    {
+        processes_last->next_process = p;
+    }
+    processes_last = p;
+
+    return 0;
+}
+
+/*
+ * Gives p one page of code, an endless loop (jmp .), for when there is no
+ * image to run.
+ */
+static int
+load_spin_loop(
+    struct process *p)
+{
+    uint32_t pfs, mapped_memory_size;
+    uint32_t vaddr = PROC_CODE_VADDR, file_size = 42;
+    paddr_t paddr;
+    uint8_t *code;
+    struct paddr_ele *code_paddrs;
+
+    pfs = div_ceil(file_size, FOUR_KB);
+    paddr = pfa_allocate(pfs);
+    if (paddr == 0)
+    {
+        printk("load_spin_loop: Could not allocate page frames for "
+               "code. pfs: %u\n", pfs);
+        return -1;
+    }
+
+    pfa_zero(paddr);
+    code = kmap_frame(paddr);
+    code[0] = 0xEB;
+    code[1] = 0xFE;
+    kunmap_frame(code);
+
+    mapped_memory_size =
+        pdt_map_memory(p->pdt, paddr, vaddr, file_size,
+                       PAGING_READ_WRITE, PAGING_PL3);
+    if (mapped_memory_size < file_size)
+    {
+        printk("Could not map memory in proc PDT. "
+               "vaddr: %X, paddr %X, size %u, pdt: %X\n",
+               vaddr, (uint32_t) paddr, file_size, (uint32_t)p->pdt);
+    }
+
+    code_paddrs = kmalloc(sizeof(struct paddr_ele));
+    if (code_paddrs == NULL)
+    {
+        return -1;
+    }
+    code_paddrs->paddr = paddr;
+    code_paddrs->count = pfs;
+    code_paddrs->flags = 0;
+    code_paddrs->next = NULL;
+
+    p->code_paddrs.start = code_paddrs;
+    p->code_paddrs.end = code_paddrs;
+    p->user_mode.eip = vaddr;
+    p->code_start_vaddr = vaddr;
+
+    return 0;
+}
+
+struct process *
+process_create(
+    char const *path)
+{
+    struct process *p;
+
+    p = process_alloc();
+    if (p == NULL)
+    {
+        return NULL;
+    }
 
     p->user_mode.eflags = REG_EFLAGS_DEFAULT;
     p->user_mode.ss = (SEGSEL_USER_SPACE_DS | 0x03);
@@ -96,7 +278,7 @@ process_create(
      */
     {
         uint32_t paddr;
-        struct pdt *pdt = pdt_create(&paddr);
+        struct pde *pdt = pdt_create(&paddr);
         if (pdt == NULL || paddr == 0)
         {
             printk("process_load_pdt: Could not create PDT for process."
@@ -109,138 +291,252 @@ process_create(
     }
 
     /*
-     * TODO: Load process code
+     * Load process code from its image in the initial ramdisk, mapped as
+     * it's touched. Without an image the process spins in an endless loop.
      */
     {
-        uint32_t pfs, paddr, kernel_vaddr, mapped_memory_size;
-        uint32_t vaddr = 0x00000000, file_size = 42;
-        pfs = div_ceil(file_size, FOUR_KB);
-        paddr = pfa_allocate(pfs);
-
-        kernel_vaddr = pdt_kernel_find_next_vaddr(file_size);
-        mapped_memory_size =
-            pdt_map_kernel_memory(paddr, kernel_vaddr, file_size,
-                                  PAGING_READ_WRITE, PAGING_PL0);
-        pdt_unmap_kernel_memory(kernel_vaddr, file_size);
-        mapped_memory_size =
-            pdt_map_memory(p->pdt, paddr, vaddr, file_size,
-                           PAGING_READ_WRITE, PAGING_PL3);
-        if (mapped_memory_size < file_size)
+        struct initrd_file const *f = initrd_find(path);
+
+        if (f == NULL)
         {
-            printk("Could not map memory in proc PDT. "
-                   "vaddr: %X, paddr %X, size %u, pdt: %X\n",
-                   vaddr, paddr, file_size, (uint32_t)p->pdt);
+            if (load_spin_loop(p) != 0)
+            {
+                return NULL;
+            }
+        }
+        else if (elf_load(p, f, PROC_CODE_VADDR, PROC_HEAP_VADDR) != 0)
+        {
+            return NULL;
         }
-
-        struct paddr_ele *code_paddrs;
-        code_paddrs = kmalloc(sizeof(struct paddr_ele));
-        code_paddrs->paddr = paddr;
-        code_paddrs->count = pfs;
-
-        p->code_paddrs.start = code_paddrs;
-        p->code_paddrs.end = code_paddrs;
-        p->user_mode.eip = vaddr;
-        p->code_start_vaddr = vaddr;
     }
 
     /*
-     * Load process stack
+     * The clock, readable without a system call, and the system call entry.
      */
+    if (timekeeping_map(p->pdt) != 0 || syscall_map(p->pdt) != 0)
     {
-        uint32_t paddr, bytes, pfs, mapped_memory_size;
-        struct paddr_ele *stack_paddrs;
-        pfs = div_ceil(PROC_INITIAL_STACK_SIZE, FOUR_KB);
-        paddr = pfa_allocate(pfs);
-        if (paddr == 0)
-        {
-            printk("process_load_stack: Could not allocate page frames for "
-                   "stack. pfs: %u\n", pfs);
-            return NULL;
-        }
+        return NULL;
+    }
 
-        bytes = pfs * FOUR_KB;
-        mapped_memory_size = pdt_map_memory(p->pdt, paddr,
-            PROC_INITIAL_STACK_VADDR, bytes, PAGING_READ_WRITE, PAGING_PL3);
-        if (mapped_memory_size < bytes)
+    /*
+     * Reserve process stack and heap. Both are anonymous memory, page frames
+     * are only allocated when a page is first written.
+     */
+    {
+        if (vm_area_add(p, PROC_INITIAL_STACK_VADDR,
+                        PROC_INITIAL_STACK_SIZE * FOUR_KB,
+                        VM_ANONYMOUS | VM_READ_WRITE) != 0)
         {
-            printk("process_load_stack: Could not map memory for stack in "
-                   "given pdt. vaddr: %X, paddr: %X, size: %u, pdt: %X\n",
-                   PROC_INITIAL_STACK_VADDR, paddr, bytes, (uint32_t) p->pdt);
+            printk("process_create: Could not reserve stack. vaddr: %X\n",
+                   PROC_INITIAL_STACK_VADDR);
             return NULL;
         }
 
-        stack_paddrs = kmalloc(sizeof(struct paddr_ele));
-        if (stack_paddrs == NULL)
+        if (vm_area_add(p, PROC_HEAP_VADDR, PROC_HEAP_SIZE,
+                        VM_ANONYMOUS | VM_READ_WRITE) != 0)
         {
-            printk("process_load_stack: Could not allocated memory for stack "
-                   "paddr list\n");
+            printk("process_create: Could not reserve heap. vaddr: %X\n",
+                   PROC_HEAP_VADDR);
             return NULL;
         }
 
-        stack_paddrs->paddr = paddr;
-        stack_paddrs->count = pfs;
-        stack_paddrs->next = NULL;
-
-        p->stack_paddrs.start = stack_paddrs;
-        p->stack_paddrs.end = stack_paddrs;
         p->stack_start_vaddr = PROC_INITIAL_STACK_VADDR;
         p->user_mode.esp = PROC_INITIAL_ESP;
     }
 
+    if (process_load_kernel_stack(p) != 0)
+    {
+        return NULL;
+    }
+
     /*
-     * Load process kernel stack
+     * The process starts running by returning from an interrupt into user
+     * mode, with a frame set up on its kernel stack as if it had been
+     * interrupted right at its entry point.
      */
     {
-        uint32_t pfs, bytes, vaddr, paddr, mapped_memory_size;
-        struct paddr_ele *kernel_stack_paddrs;
+        registers_t *regs = (registers_t *)
+            (p->kernel_stack_start_vaddr - sizeof(registers_t));
+        memset(regs, 0, sizeof(registers_t));
+
+        regs->gs = regs->fs = regs->es = regs->ds = p->user_mode.ss;
+        regs->eip = p->user_mode.eip;
+        regs->cs = p->user_mode.cs;
+        regs->eflags = p->user_mode.eflags;
+        regs->useresp = p->user_mode.esp;
+        regs->ss = p->user_mode.ss;
+
+        p->context = regs;
+    }
 
-        pfs = div_ceil(KERNEL_STACK_SIZE, FOUR_KB);
-        paddr = pfa_allocate(pfs);
-        if (paddr == 0) {
-            printk("process_load_kernel_stack: Could not allocate page for "
-                   "kernel stack. pfs: %u\n", pfs);
-            return NULL;
-        }
+    if (process_register(p) != 0)
+    {
+        kstack_free(p->kernel_stack_start_vaddr + 4);
+        return NULL;
+    }
 
-        bytes = pfs * FOUR_KB;
-        vaddr = pdt_kernel_find_next_vaddr(bytes);
-        if (vaddr == 0) {
-            printk("process_load_kernel_stack: Could not find virtual address "
-                   "for kernel stack."
-                   "bytes: %u\n", bytes);
-            return NULL;
-        }
+    return p;
+}
 
-        mapped_memory_size =
-            pdt_map_kernel_memory(paddr, vaddr, bytes, PAGING_READ_WRITE,
-                                  PAGING_PL0);
-        if (mapped_memory_size != bytes) {
-            printk("process_load_kernel_stack: Could not map memory for "
-                   "kernel stack. paddr: %X, vaddr: %X, bytes: %u\n",
-                    paddr, vaddr, bytes);
-            return NULL;
-        }
+int
+process_add_code_frame(
+    struct process *p,
+    paddr_t paddr,
+    uint32_t flags)
+{
+    struct paddr_ele *end = p->code_paddrs.end, *ele;
 
-        kernel_stack_paddrs = kmalloc(sizeof(struct paddr_ele));
-        if (kernel_stack_paddrs == NULL) {
-            printk("process_load_kernel_stack: Could not allocated memory for "
-                   "kernel stack paddr list\n");
-            return NULL;
+    /*
+     * Pages are mostly touched in order, so frames often extend the last
+     * run.
+     */
+    if (end != NULL && end->flags == flags &&
+        end->paddr + end->count * FOUR_KB == paddr)
+    {
+        ++end->count;
+        return 0;
+    }
+
+    ele = kmalloc(sizeof(struct paddr_ele));
+    if (ele == NULL)
+    {
+        printk("process_add_code_frame: Could not allocate list element. "
+               "pid: %u\n", p->id);
+        return -1;
+    }
+
+    ele->paddr = paddr;
+    ele->count = 1;
+    ele->flags = flags;
+    ele->next = NULL;
+
+    if (end == NULL)
+    {
+        p->code_paddrs.start = ele;
+    }
+    else
+    {
+        end->next = ele;
+    }
+    p->code_paddrs.end = ele;
+
+    return 0;
+}
+
+void
+process_free_code(
+    struct process *p)
+{
+    struct paddr_ele *ele, *next;
+    uint32_t i;
+
+    for (ele = p->code_paddrs.start; ele != NULL; ele = next)
+    {
+        for (i = 0; i < ele->count; ++i)
+        {
+            if (ele->flags & PADDR_SHARED)
+            {
+                page_cache_put(ele->paddr + i * FOUR_KB);
+            }
+            else
+            {
+                pfa_free(ele->paddr + i * FOUR_KB);
+            }
         }
 
-        kernel_stack_paddrs->count = pfs;
-        kernel_stack_paddrs->paddr = paddr;
-        kernel_stack_paddrs->next = NULL;
+        next = ele->next;
+        kfree(ele);
+    }
+
+    p->code_paddrs.start = NULL;
+    p->code_paddrs.end = NULL;
+}
+
+/*
+ * Where kernel threads start, see kthread_create().
+ */
+static void
+kthread_main(
+    struct process *p)
+{
+    p->kthread_fn(p->kthread_arg);
+
+    printk("kthread_main: Kernel thread returned. pid: %u\n", p->id);
+    for (;;)
+    {
+        scheduler_block();
+    }
+}
+
+struct process *
+kthread_create(
+    char const *name,
+    void (*fn)(void *arg),
+    void *arg)
+{
+    struct process *p;
 
-        p->kernel_stack_paddrs.start = kernel_stack_paddrs;
-        p->kernel_stack_paddrs.end = kernel_stack_paddrs;
-        p->kernel_stack_start_vaddr = vaddr + bytes - 4;
+    p = process_alloc();
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    p->name = name;
+    p->kthread_fn = fn;
+    p->kthread_arg = arg;
+
+    /*
+     * Kernel code runs holding the kernel lock, see smp.h.
+     */
+    p->lock_depth = 1;
+
+    if (process_load_kernel_stack(p) != 0)
+    {
+        return NULL;
+    }
+
+    /*
+     * Like a user process, the thread starts by returning from an interrupt,
+     * but to kernel mode, which doesn't pop esp and ss. Its stack starts
+     * where useresp is, so kthread_main() takes that for the return address
+     * and ss for its argument.
+     */
+    {
+        registers_t *regs = (registers_t *)
+            (p->kernel_stack_start_vaddr - sizeof(registers_t));
+        memset(regs, 0, sizeof(registers_t));
+
+        regs->gs = regs->fs = regs->es = regs->ds = SEGSEL_KERNEL_DS;
+        regs->eip = (uint32_t) kthread_main;
+        regs->cs = SEGSEL_KERNEL_CS;
+        regs->eflags = REG_EFLAGS_DEFAULT;
+        regs->useresp = 0;
+        regs->ss = (uint32_t) p;
+
+        p->context = regs;
+    }
+
+    if (process_register(p) != 0)
+    {
+        kstack_free(p->kernel_stack_start_vaddr + 4);
+        return NULL;
     }
 
-    p->current = p->user_mode;
     return p;
 }
 
+struct process *
+process_next(
+    struct process *p)
+{
+    if (p == NULL)
+    {
+        return processes_first;
+    }
+    return p->next_process;
+}
+
 static uint32_t
 div_ceil(
     uint32_t num,
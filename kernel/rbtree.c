@@ -0,0 +1,316 @@
+#include <stddef.h>
+
+#include <newbos/rbtree.h>
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+#define IS_BLACK(n) ((n) == NULL || (n)->color == RB_BLACK)
+
+static void
+replace_child(
+    struct rb_root *root,
+    struct rb_node *parent,
+    struct rb_node *old,
+    struct rb_node *new)
+{
+    if (parent == NULL)
+    {
+        root->node = new;
+    }
+    else if (parent->left == old)
+    {
+        parent->left = new;
+    }
+    else
+    {
+        parent->right = new;
+    }
+    if (new != NULL)
+    {
+        new->parent = parent;
+    }
+}
+
+static void
+rotate_left(
+    struct rb_node *x,
+    struct rb_root *root)
+{
+    struct rb_node *y = x->right;
+
+    x->right = y->left;
+    if (y->left != NULL)
+    {
+        y->left->parent = x;
+    }
+    replace_child(root, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void
+rotate_right(
+    struct rb_node *x,
+    struct rb_root *root)
+{
+    struct rb_node *y = x->left;
+
+    x->left = y->right;
+    if (y->right != NULL)
+    {
+        y->right->parent = x;
+    }
+    replace_child(root, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+void
+rb_link_node(
+    struct rb_node *node,
+    struct rb_node *parent,
+    struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    *link = node;
+}
+
+void
+rb_insert_color(
+    struct rb_node *node,
+    struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    node->color = RB_RED;
+
+    while ((parent = node->parent) != NULL && parent->color == RB_RED)
+    {
+        /*
+         * A red parent is never the root, so there is a grandparent.
+         */
+        gparent = parent->parent;
+
+        if (parent == gparent->left)
+        {
+            uncle = gparent->right;
+            if (!IS_BLACK(uncle))
+            {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right)
+            {
+                rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(gparent, root);
+        }
+        else
+        {
+            uncle = gparent->left;
+            if (!IS_BLACK(uncle))
+            {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left)
+            {
+                rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(gparent, root);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+/*
+ * Restores the black height after a black node was removed above x, which
+ * may be NULL, so its parent is passed along.
+ */
+static void
+erase_fixup(
+    struct rb_node *x,
+    struct rb_node *parent,
+    struct rb_root *root)
+{
+    struct rb_node *w;
+
+    while (x != root->node && IS_BLACK(x))
+    {
+        if (x == parent->left)
+        {
+            w = parent->right;
+            if (!IS_BLACK(w))
+            {
+                w->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(parent, root);
+                w = parent->right;
+            }
+            if (IS_BLACK(w->left) && IS_BLACK(w->right))
+            {
+                w->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (IS_BLACK(w->right))
+            {
+                w->left->color = RB_BLACK;
+                w->color = RB_RED;
+                rotate_right(w, root);
+                w = parent->right;
+            }
+            w->color = parent->color;
+            parent->color = RB_BLACK;
+            w->right->color = RB_BLACK;
+            rotate_left(parent, root);
+        }
+        else
+        {
+            w = parent->left;
+            if (!IS_BLACK(w))
+            {
+                w->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(parent, root);
+                w = parent->left;
+            }
+            if (IS_BLACK(w->left) && IS_BLACK(w->right))
+            {
+                w->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (IS_BLACK(w->left))
+            {
+                w->right->color = RB_BLACK;
+                w->color = RB_RED;
+                rotate_left(w, root);
+                w = parent->left;
+            }
+            w->color = parent->color;
+            parent->color = RB_BLACK;
+            w->left->color = RB_BLACK;
+            rotate_right(parent, root);
+        }
+        x = root->node;
+        break;
+    }
+
+    if (x != NULL)
+    {
+        x->color = RB_BLACK;
+    }
+}
+
+void
+rb_erase(
+    struct rb_node *node,
+    struct rb_root *root)
+{
+    struct rb_node *y, *x, *parent;
+    uint32_t color = node->color;
+
+    if (node->left == NULL)
+    {
+        x = node->right;
+        parent = node->parent;
+        replace_child(root, node->parent, node, x);
+    }
+    else if (node->right == NULL)
+    {
+        x = node->left;
+        parent = node->parent;
+        replace_child(root, node->parent, node, x);
+    }
+    else
+    {
+        /*
+         * Two children: the successor takes the node's place.
+         */
+        for (y = node->right; y->left != NULL; y = y->left);
+        color = y->color;
+        x = y->right;
+
+        if (y->parent == node)
+        {
+            parent = y;
+        }
+        else
+        {
+            parent = y->parent;
+            replace_child(root, y->parent, y, x);
+            y->right = node->right;
+            y->right->parent = y;
+        }
+
+        replace_child(root, node->parent, node, y);
+        y->left = node->left;
+        y->left->parent = y;
+        y->color = node->color;
+    }
+
+    if (color == RB_BLACK)
+    {
+        erase_fixup(x, parent, root);
+    }
+}
+
+struct rb_node *
+rb_first(
+    struct rb_root const *root)
+{
+    struct rb_node *n = root->node;
+    if (n == NULL)
+    {
+        return NULL;
+    }
+    while (n->left != NULL)
+    {
+        n = n->left;
+    }
+    return n;
+}
+
+struct rb_node *
+rb_next(
+    struct rb_node const *node)
+{
+    struct rb_node const *parent;
+
+    if (node->right != NULL)
+    {
+        node = node->right;
+        while (node->left != NULL)
+        {
+            node = node->left;
+        }
+        return (struct rb_node *) node;
+    }
+
+    while ((parent = node->parent) != NULL && node == parent->right)
+    {
+        node = parent;
+    }
+    return (struct rb_node *) parent;
+}
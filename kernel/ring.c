@@ -0,0 +1,489 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/clocksource.h>
+#include <newbos/hrtimer.h>
+#include <newbos/kmalloc.h>
+#include <newbos/paging.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/ring.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/syscall.h>
+#include <newbos/timekeeping.h>
+
+#include "interrupts.h"
+
+/*
+ * The header, then RING_MAX_ENTRIES submission queue entries and twice as
+ * many completion queue entries, so completions of one full batch and the
+ * next still fit.
+ */
+#define RING_SQ_OFFSET 64
+#define RING_SIZE      (2 * PAGE_SIZE)
+
+/*
+ * How long the submission thread keeps polling after the last submission
+ * before it goes to sleep.
+ */
+#define RING_POLL_IDLE_NS NSEC_PER_MSEC
+
+/*
+ * A RING_OP_TIMEOUT slot. The timer is the first member.
+ */
+struct ring_timeout {
+    struct hrtimer timer;
+    struct ring *r;
+    uint64_t user_data;
+    uint32_t in_use;
+};
+
+struct ring {
+    /*
+     * Kernel mappings of the shared memory. The process can write to all
+     * of it at any time, so the kernel only reads the indexes the process
+     * advances and keeps its own copy of everything else. The indexes the
+     * kernel advances are published to the header, never read back.
+     */
+    struct ring_header *hdr;
+    struct ring_sqe *sqes;
+    struct ring_cqe *cqes;
+    paddr_t paddr;
+
+    uint32_t sq_head;
+    uint32_t cq_tail;
+    uint32_t cq_overflow;
+    uint32_t sq_mask;
+    uint32_t cq_mask;
+
+    /*
+     * The process waiting in ring_enter() for wait_nr completions.
+     */
+    struct process *waiter;
+    uint32_t wait_nr;
+
+    /*
+     * Submission thread, with RING_SETUP_SQPOLL.
+     */
+    struct process *poller;
+
+    /*
+     * One RING_OP_TIMEOUT slot per completion queue entry.
+     */
+    struct ring_timeout *timeouts;
+};
+
+static uint32_t
+completions_ready(
+    struct ring *r)
+{
+    return r->cq_tail - __atomic_load_n(&r->hdr->cq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called from process context and from timer interrupts, hence interrupts
+ * are disabled while the tail moves.
+ */
+static void
+post_completion(
+    struct ring *r,
+    uint64_t user_data,
+    int32_t res)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    struct ring_cqe *cqe;
+
+    if (completions_ready(r) > r->cq_mask)
+    {
+        __atomic_store_n(&r->hdr->cq_overflow, ++r->cq_overflow,
+                         __ATOMIC_RELAXED);
+    }
+    else
+    {
+        cqe = &r->cqes[r->cq_tail & r->cq_mask];
+        cqe->user_data = user_data;
+        cqe->res = res;
+        cqe->reserved = 0;
+        ++r->cq_tail;
+        __atomic_store_n(&r->hdr->cq_tail, r->cq_tail, __ATOMIC_RELEASE);
+    }
+
+    if (r->waiter != NULL && completions_ready(r) >= r->wait_nr)
+    {
+        scheduler_wake(r->waiter);
+    }
+
+    restore_interrupts(flags);
+}
+
+/*
+ * Called from timer interrupts, so the slot is given back here rather than
+ * freed: the allocator isn't safe to enter from an interrupt.
+ */
+static int
+timeout_fn(
+    struct hrtimer *t)
+{
+    struct ring_timeout *to = (struct ring_timeout *) t;
+    uint32_t flags;
+
+    post_completion(to->r, to->user_data, 0);
+
+    flags = save_and_disable_interrupts();
+    to->in_use = 0;
+    restore_interrupts(flags);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Returns a free timeout slot of r, marked in use, or NULL if all of them
+ * are.
+ */
+static struct ring_timeout *
+timeout_get(
+    struct ring *r)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    struct ring_timeout *to = NULL;
+    uint32_t i;
+
+    for (i = 0; i <= r->cq_mask; ++i)
+    {
+        if (!r->timeouts[i].in_use)
+        {
+            to = &r->timeouts[i];
+            to->in_use = 1;
+            break;
+        }
+    }
+
+    restore_interrupts(flags);
+    return to;
+}
+
+static void
+issue(
+    struct ring *r,
+    struct ring_sqe const *sqe)
+{
+    uint32_t args[SYSCALL_MAX_ARGS] = { 0 };
+    struct ring_timeout *to;
+
+    if (sqe->opcode == RING_OP_NOP)
+    {
+        post_completion(r, sqe->user_data, 0);
+    }
+    else if (sqe->opcode == RING_OP_WRITE)
+    {
+        args[0] = sqe->addr;
+        args[1] = sqe->len;
+        post_completion(r, sqe->user_data, syscall_dispatch(SYS_WRITE, args));
+    }
+    else if (sqe->opcode == RING_OP_TIMEOUT)
+    {
+        to = timeout_get(r);
+        if (to == NULL)
+        {
+            post_completion(r, sqe->user_data, -1);
+            return;
+        }
+
+        hrtimer_init(&to->timer, timeout_fn);
+        to->r = r;
+        to->user_data = sqe->user_data;
+        if (hrtimer_start(&to->timer, ktime_get_ns() + sqe->arg) != 0)
+        {
+            to->in_use = 0;
+            post_completion(r, sqe->user_data, -1);
+        }
+    }
+    else
+    {
+        post_completion(r, sqe->user_data, -1);
+    }
+}
+
+/*
+ * Takes up to max entries off the submission queue and issues them, no
+ * more than the queue holds so a process refilling it as fast as it's
+ * emptied can't keep the kernel here. Returns the number taken.
+ */
+static uint32_t
+submit(
+    struct ring *r,
+    uint32_t max)
+{
+    uint32_t tail = __atomic_load_n(&r->hdr->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t n;
+    struct ring_sqe sqe;
+
+    if (max > r->sq_mask + 1)
+    {
+        max = r->sq_mask + 1;
+    }
+
+    for (n = 0; n < max && r->sq_head != tail; ++n)
+    {
+        /*
+         * The slot is free for the process again once sq_head moves past
+         * it, so the entry is copied first.
+         */
+        sqe = r->sqes[r->sq_head & r->sq_mask];
+        ++r->sq_head;
+        __atomic_store_n(&r->hdr->sq_head, r->sq_head, __ATOMIC_RELEASE);
+
+        issue(r, &sqe);
+    }
+
+    return n;
+}
+
+static int
+submissions_pending(
+    struct ring *r)
+{
+    return __atomic_load_n(&r->hdr->sq_tail, __ATOMIC_ACQUIRE) != r->sq_head;
+}
+
+static void
+sqpoll_main(
+    void *arg)
+{
+    struct ring *r = arg;
+    uint64_t last = ktime_get_ns();
+
+    for (;;)
+    {
+        if (submit(r, RING_MAX_ENTRIES) != 0)
+        {
+            last = ktime_get_ns();
+            continue;
+        }
+
+        if (ktime_get_ns() - last < RING_POLL_IDLE_NS)
+        {
+            /*
+             * Kernel code isn't preempted, so give way to anything else
+             * that wants this CPU, and the kernel lock to the others.
+             */
+            if (scheduler_nr_running() != 0)
+            {
+                scheduler_schedule();
+            }
+            else
+            {
+                unlock_kernel();
+                __builtin_ia32_pause();
+                lock_kernel();
+            }
+            continue;
+        }
+
+        /*
+         * The process sets sq_tail before it looks at flags, and we set
+         * flags before we look at sq_tail again, so one of us sees the
+         * other.
+         */
+        __atomic_or_fetch(&r->hdr->flags, RING_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+        disable_interrupts();
+        if (!submissions_pending(r))
+        {
+            scheduler_block();
+        }
+        else
+        {
+            enable_interrupts();
+        }
+        __atomic_and_fetch(&r->hdr->flags, ~RING_NEED_WAKEUP,
+                           __ATOMIC_SEQ_CST);
+        last = ktime_get_ns();
+    }
+}
+
+static int
+start_poller(
+    struct process *p,
+    struct ring *r)
+{
+    struct process *t = kthread_create("ring_sqpoll", sqpoll_main, r);
+
+    if (t == NULL)
+    {
+        return -1;
+    }
+
+    /*
+     * It reads the buffers of p's submissions, in p's address space.
+     */
+    t->pdt = p->pdt;
+    t->pdt_paddr = p->pdt_paddr;
+    t->mm_owner = p;
+
+    r->poller = t;
+    scheduler_add_process(t);
+
+    return 0;
+}
+
+int
+ring_setup(
+    struct process *p,
+    uint32_t entries,
+    uint32_t flags)
+{
+    struct ring *r;
+    uint32_t i, n = 1, vaddr;
+
+    if (p->pdt == NULL || p->ring != NULL || entries == 0 ||
+        entries > RING_MAX_ENTRIES)
+    {
+        return -1;
+    }
+    while (n < entries)
+    {
+        n <<= 1;
+    }
+
+    r = kmalloc(sizeof(struct ring));
+    if (r == NULL)
+    {
+        printk("ring_setup: Could not allocate the ring. pid: %u\n", p->id);
+        return -1;
+    }
+
+    r->timeouts = kmalloc(2 * n * sizeof(struct ring_timeout));
+    if (r->timeouts == NULL)
+    {
+        printk("ring_setup: Could not allocate timeouts. pid: %u\n", p->id);
+        kfree(r);
+        return -1;
+    }
+    memset(r->timeouts, 0, 2 * n * sizeof(struct ring_timeout));
+
+    r->paddr = pfa_allocate(RING_SIZE / PAGE_SIZE);
+    if (r->paddr == 0)
+    {
+        printk("ring_setup: Could not allocate page frames. pid: %u\n",
+               p->id);
+        kfree(r->timeouts);
+        kfree(r);
+        return -1;
+    }
+    for (i = 0; i < RING_SIZE; i += PAGE_SIZE)
+    {
+        pfa_zero(r->paddr + i);
+    }
+
+    vaddr = pdt_kernel_find_next_vaddr(RING_SIZE);
+    if (vaddr == 0 ||
+        pdt_map_kernel_memory(r->paddr, vaddr, RING_SIZE, PAGING_READ_WRITE,
+                              PAGING_PL0) != RING_SIZE)
+    {
+        printk("ring_setup: Could not map the ring into the kernel. "
+               "paddr: %X\n", (uint32_t) r->paddr);
+        goto free_frames;
+    }
+
+    if (pdt_map_memory(p->pdt, r->paddr, RING_VADDR, RING_SIZE,
+                       PAGING_READ_WRITE, PAGING_PL3) != RING_SIZE)
+    {
+        printk("ring_setup: Could not map the ring. pid: %u\n", p->id);
+        pdt_unmap_kernel_memory(vaddr, RING_SIZE);
+        goto free_frames;
+    }
+
+    r->hdr = (struct ring_header *) vaddr;
+    r->hdr->sq_entries = n;
+    r->hdr->sq_offset = RING_SQ_OFFSET;
+    r->hdr->cq_entries = 2 * n;
+    r->hdr->cq_offset = RING_SQ_OFFSET + n * sizeof(struct ring_sqe);
+    r->sqes = (struct ring_sqe *) (vaddr + RING_SQ_OFFSET);
+    r->cqes = (struct ring_cqe *) (r->sqes + n);
+    r->sq_head = 0;
+    r->cq_tail = 0;
+    r->cq_overflow = 0;
+    r->sq_mask = n - 1;
+    r->cq_mask = 2 * n - 1;
+    r->waiter = NULL;
+    r->wait_nr = 0;
+    r->poller = NULL;
+
+    if ((flags & RING_SETUP_SQPOLL) && start_poller(p, r) != 0)
+    {
+        printk("ring_setup: Could not start the submission thread. "
+               "pid: %u\n", p->id);
+        pdt_unmap_memory(p->pdt, RING_VADDR, RING_SIZE);
+        pdt_unmap_kernel_memory(vaddr, RING_SIZE);
+        goto free_frames;
+    }
+
+    p->ring = r;
+    return 0;
+
+free_frames:
+    for (i = 0; i < RING_SIZE; i += PAGE_SIZE)
+    {
+        pfa_free(r->paddr + i);
+    }
+    kfree(r->timeouts);
+    kfree(r);
+    return -1;
+}
+
+int32_t
+ring_enter(
+    struct process *p,
+    uint32_t to_submit,
+    uint32_t min_complete,
+    uint32_t flags)
+{
+    struct ring *r = p->ring;
+    uint32_t submitted = 0;
+
+    if (r == NULL)
+    {
+        return -1;
+    }
+
+    if (r->poller != NULL)
+    {
+        if (flags & RING_ENTER_SQ_WAKEUP)
+        {
+            scheduler_wake(r->poller);
+        }
+    }
+    else
+    {
+        submitted = submit(r, to_submit);
+    }
+
+    /*
+     * More than the queue can hold would never be ready.
+     */
+    if (min_complete > r->cq_mask + 1)
+    {
+        min_complete = r->cq_mask + 1;
+    }
+
+    for (;;)
+    {
+        /*
+         * A completion posted between the check and blocking would find
+         * no waiter and the wakeup would be lost.
+         */
+        disable_interrupts();
+        if (completions_ready(r) >= min_complete)
+        {
+            enable_interrupts();
+            break;
+        }
+        r->waiter = p;
+        r->wait_nr = min_complete;
+        scheduler_block();
+        r->waiter = NULL;
+    }
+
+    return (int32_t) submitted;
+}
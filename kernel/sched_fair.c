@@ -0,0 +1,268 @@
+#include <stddef.h>
+
+#include <newbos/printk.h>
+#include <newbos/rbtree.h>
+#include <newbos/sched_class.h>
+#include <newbos/scheduler.h>
+#include <newbos/timer.h>
+
+/*
+ * Runnable processes are ordered by virtual runtime: the time they have run,
+ * scaled by the inverse of their weight. The one that has run the least runs
+ * next, so over time every process gets CPU time in proportion to its
+ * weight.
+ *
+ * Times are in microseconds. Time is only charged on timer ticks, so nothing
+ * here is finer than a tick.
+ */
+#define TICK_US (1000000 / TIMER_FREQUENCY)
+
+/*
+ * Period in which every runnable process should get to run once, and the
+ * least a process runs before it's preempted for another one.
+ */
+#define SCHED_LATENCY_US         40000u
+#define SCHED_MIN_GRANULARITY_US TICK_US
+
+/*
+ * A woken process preempts the running one only if it's this far behind it
+ * in virtual runtime, so processes that wake up often don't switch on every
+ * wakeup.
+ */
+#define SCHED_WAKEUP_GRANULARITY_US TICK_US
+
+#define NICE_0_WEIGHT 1024
+
+/*
+ * Weight of every nice level, from NICE_MIN to NICE_MAX. Each level gets
+ * about 10% more CPU time than the one above it.
+ */
+static uint32_t const nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+static uint32_t
+weight(
+    struct process *p)
+{
+    return nice_to_weight[p->nice - NICE_MIN];
+}
+
+static void
+update_min_vruntime(
+    struct fair_rq *rq,
+    struct process *curr)
+{
+    uint64_t vruntime = curr->vruntime;
+
+    if (rq->leftmost != NULL)
+    {
+        struct process *first =
+            rb_entry(rq->leftmost, struct process, run_node);
+        if (first->vruntime < vruntime)
+        {
+            vruntime = first->vruntime;
+        }
+    }
+
+    if (vruntime > rq->min_vruntime)
+    {
+        rq->min_vruntime = vruntime;
+    }
+}
+
+static void
+fair_enqueue(
+    struct rq *rq,
+    struct process *p,
+    uint32_t flags)
+{
+    struct fair_rq *frq = &rq->fair;
+    struct rb_node **link = &frq->timeline.node, *parent = NULL;
+    int is_leftmost = 1;
+
+    if ((flags & (ENQUEUE_NEW | ENQUEUE_WAKEUP)) &&
+        p->vruntime < frq->min_vruntime)
+    {
+        p->vruntime = frq->min_vruntime;
+    }
+    else if (flags & ENQUEUE_MIGRATE)
+    {
+        p->vruntime += frq->min_vruntime;
+    }
+
+    /*
+     * Equal keys go to the right, so processes with the same virtual
+     * runtime run in the order they were enqueued.
+     */
+    while (*link != NULL)
+    {
+        struct process *e;
+
+        parent = *link;
+        e = rb_entry(parent, struct process, run_node);
+        if (p->vruntime < e->vruntime)
+        {
+            link = &parent->left;
+        }
+        else
+        {
+            link = &parent->right;
+            is_leftmost = 0;
+        }
+    }
+
+    rb_link_node(&p->run_node, parent, link);
+    rb_insert_color(&p->run_node, &frq->timeline);
+    if (is_leftmost)
+    {
+        frq->leftmost = &p->run_node;
+    }
+
+    frq->total_weight += weight(p);
+}
+
+static void
+fair_dequeue(
+    struct rq *rq,
+    struct process *p,
+    uint32_t flags)
+{
+    struct fair_rq *frq = &rq->fair;
+
+    if (frq->leftmost == &p->run_node)
+    {
+        frq->leftmost = rb_next(&p->run_node);
+    }
+    rb_erase(&p->run_node, &frq->timeline);
+    frq->total_weight -= weight(p);
+
+    /*
+     * The clocks of two CPUs' run queues have nothing to do with each other,
+     * a migrating process keeps its lead or lag relative to min_vruntime.
+     * It may be behind it, the arithmetic wraps around and back.
+     */
+    if (flags & DEQUEUE_MIGRATE)
+    {
+        p->vruntime -= frq->min_vruntime;
+    }
+}
+
+static struct process *
+fair_pick_next(
+    struct rq *rq)
+{
+    struct process *p;
+
+    if (rq->fair.leftmost == NULL)
+    {
+        return NULL;
+    }
+
+    p = rb_entry(rq->fair.leftmost, struct process, run_node);
+    fair_dequeue(rq, p, 0);
+    p->slice_runtime = 0;
+    return p;
+}
+
+/*
+ * The share of SCHED_LATENCY_US that curr should run before it's preempted,
+ * given the weights of the runnable processes.
+ */
+static uint32_t
+ideal_runtime(
+    struct fair_rq *rq,
+    struct process *curr)
+{
+    uint32_t w = weight(curr);
+    uint32_t slice = SCHED_LATENCY_US * w / (rq->total_weight + w);
+
+    return slice < SCHED_MIN_GRANULARITY_US ? SCHED_MIN_GRANULARITY_US : slice;
+}
+
+static int
+fair_tick(
+    struct rq *rq,
+    struct process *curr)
+{
+    struct fair_rq *frq = &rq->fair;
+    struct process *first;
+    uint32_t ideal;
+
+    curr->vruntime += TICK_US * NICE_0_WEIGHT / weight(curr);
+    curr->slice_runtime += TICK_US;
+    update_min_vruntime(frq, curr);
+
+    if (frq->leftmost == NULL)
+    {
+        return 0;
+    }
+
+    ideal = ideal_runtime(frq, curr);
+    if (curr->slice_runtime >= ideal)
+    {
+        return 1;
+    }
+
+    /*
+     * Don't let a process run its whole slice when it's already far ahead
+     * of the one waiting the longest.
+     */
+    first = rb_entry(frq->leftmost, struct process, run_node);
+    return curr->slice_runtime >= SCHED_MIN_GRANULARITY_US &&
+           curr->vruntime > first->vruntime + ideal;
+}
+
+static int
+fair_preempt(
+    struct rq *rq,
+    struct process *p,
+    struct process *curr)
+{
+    (void) rq;
+    return p->vruntime + SCHED_WAKEUP_GRANULARITY_US < curr->vruntime;
+}
+
+/*
+ * Converts microseconds to milliseconds, a 16 bit digit at a time since
+ * there is no 64 bit division.
+ */
+static uint32_t
+us_to_ms(
+    uint64_t us)
+{
+    uint32_t rem = 0, ms = 0;
+    int shift;
+
+    for (shift = 48; shift >= 0; shift -= 16)
+    {
+        uint32_t cur = (rem << 16) | (uint32_t) ((us >> shift) & 0xFFFF);
+        ms = (ms << 16) | (cur / 1000);
+        rem = cur % 1000;
+    }
+    return ms;
+}
+
+static void
+fair_dump(
+    struct process *p)
+{
+    printk("weight: %u, vruntime: %u ms", weight(p), us_to_ms(p->vruntime));
+}
+
+struct sched_class const sched_fair_class = {
+    "fair",
+    fair_enqueue,
+    fair_dequeue,
+    fair_pick_next,
+    fair_tick,
+    fair_preempt,
+    fair_dump,
+};
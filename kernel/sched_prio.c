@@ -0,0 +1,189 @@
+#include <stddef.h>
+
+#include <newbos/printk.h>
+#include <newbos/sched_class.h>
+#include <newbos/scheduler.h>
+
+/*
+ * One run queue per priority level, lower levels run first. A process with
+ * nice 0 and no boost runs at NICE_TO_PRIO(0).
+ */
+#define NICE_TO_PRIO(n) ((uint32_t) ((n) - NICE_MIN))
+
+/*
+ * Levels a process is raised by when it wakes up. It loses one for every
+ * time slice it uses up, so processes that mostly wait on I/O stay ahead of
+ * ones that compute.
+ */
+#define MAX_BOOST 5
+
+static void
+update_prio(
+    struct process *p)
+{
+    int32_t prio = (int32_t) NICE_TO_PRIO(p->nice) - (int32_t) p->boost;
+    p->prio = prio < 0 ? 0 : (uint32_t) prio;
+}
+
+/*
+ * The run queues link processes through run_prev and run_next in struct
+ * process, so none of these allocate and all are O(1).
+ */
+static void
+run_queue_push(
+    struct prio_queue *q,
+    struct process *p)
+{
+    p->run_prev = q->tail;
+    p->run_next = NULL;
+    if (q->tail == NULL)
+    {
+        q->head = p;
+    }
+    else
+    {
+        q->tail->run_next = p;
+    }
+    q->tail = p;
+}
+
+static void
+run_queue_remove(
+    struct prio_queue *q,
+    struct process *p)
+{
+    if (p->run_prev == NULL)
+    {
+        q->head = p->run_next;
+    }
+    else
+    {
+        p->run_prev->run_next = p->run_next;
+    }
+    if (p->run_next == NULL)
+    {
+        q->tail = p->run_prev;
+    }
+    else
+    {
+        p->run_next->run_prev = p->run_prev;
+    }
+    p->run_prev = NULL;
+    p->run_next = NULL;
+}
+
+static void
+prio_enqueue(
+    struct rq *rq,
+    struct process *p,
+    uint32_t flags)
+{
+    if (flags & ENQUEUE_WAKEUP)
+    {
+        p->boost = MAX_BOOST;
+    }
+    update_prio(p);
+
+    run_queue_push(rq->prio.queues + p->prio, p);
+    rq->prio.bitmap[p->prio / 32] |= 1u << (p->prio % 32);
+}
+
+static void
+prio_dequeue(
+    struct rq *rq,
+    struct process *p,
+    uint32_t flags)
+{
+    struct prio_queue *q = rq->prio.queues + p->prio;
+
+    (void) flags;
+
+    run_queue_remove(q, p);
+    if (q->head == NULL)
+    {
+        rq->prio.bitmap[p->prio / 32] &= ~(1u << (p->prio % 32));
+    }
+}
+
+/*
+ * Returns the highest priority level with a runnable process, or NUM_PRIOS
+ * if there is none.
+ */
+static uint32_t
+first_prio(
+    struct rq *rq)
+{
+    uint32_t i;
+    for (i = 0; i < PRIO_BITMAP_WORDS; ++i)
+    {
+        if (rq->prio.bitmap[i] != 0)
+        {
+            return i * 32 + __builtin_ctz(rq->prio.bitmap[i]);
+        }
+    }
+    return NUM_PRIOS;
+}
+
+static struct process *
+prio_pick_next(
+    struct rq *rq)
+{
+    uint32_t prio = first_prio(rq);
+    struct process *p;
+
+    if (prio == NUM_PRIOS)
+    {
+        return NULL;
+    }
+
+    p = rq->prio.queues[prio].head;
+    prio_dequeue(rq, p, 0);
+
+    rq->prio.slice_left = scheduler_time_slice();
+    return p;
+}
+
+static int
+prio_tick(
+    struct rq *rq,
+    struct process *curr)
+{
+    if (rq->prio.slice_left > 0 && --rq->prio.slice_left > 0)
+    {
+        return 0;
+    }
+
+    if (curr->boost > 0)
+    {
+        --curr->boost;
+    }
+    return 1;
+}
+
+static int
+prio_preempt(
+    struct rq *rq,
+    struct process *p,
+    struct process *curr)
+{
+    (void) rq;
+    update_prio(curr);
+    return p->prio < curr->prio;
+}
+
+static void
+prio_dump(
+    struct process *p)
+{
+    printk("prio: %u, boost: %u", p->prio, p->boost);
+}
+
+struct sched_class const sched_prio_class = {
+    "prio",
+    prio_enqueue,
+    prio_dequeue,
+    prio_pick_next,
+    prio_tick,
+    prio_preempt,
+    prio_dump,
+};
@@ -1,7 +1,15 @@
 #include <stddef.h>
+#include <string.h>
 
-#include <newbos/kmalloc.h>
+#include <newbos/fpu.h>
+#include <newbos/printk.h>
+#include <newbos/sched_class.h>
 #include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/softirq.h>
+#include <newbos/timer.h>
+
+#include "interrupts.h"
 
 /*
  * segements
@@ -11,102 +19,728 @@
 #define SEGSEL_USER_SPACE_CS 0x18
 #define SEGSEL_USER_SPACE_DS 0x20
 
-struct process_list_element {
-    struct process_list_element *next;
-    struct process *ps;
-};
+#define IS_USER_MODE(regs) (((regs)->cs & 0x03) == 0x03)
+
+/*
+ * Scheduling class used unless another one is asked for at boot.
+ */
+#ifdef CONFIG_SCHED_FAIR
+#define DEFAULT_SCHED_CLASS sched_fair_class
+#else
+#define DEFAULT_SCHED_CLASS sched_prio_class
+#endif
 
-struct process_list {
-    struct process_list_element *start;
-    struct process_list_element *end;
+static struct sched_class const *const sched_classes[] = {
+    &sched_prio_class,
+    &sched_fair_class,
 };
 
-static struct process_list runnable_processes = { NULL, NULL };
+#define NUM_SCHED_CLASSES (sizeof(sched_classes) / sizeof(sched_classes[0]))
 
-uint32_t
-scheduler_next_pid(
+static struct sched_class const *sched_class = &DEFAULT_SCHED_CLASS;
+
+static struct rq run_queues[MAX_CPUS];
+
+/*
+ * Length of a time slice, in timer ticks.
+ */
+static uint32_t time_slice;
+
+static struct rq *
+this_rq(
     void)
 {
-    uint32_t max_pid = 0;
-    struct process_list_element *p = runnable_processes.start;
-    while (p != NULL)
+    return run_queues + smp_cpu_id();
+}
+
+static void
+yield_handler(
+    registers_t *regs)
+{
+    (void) regs;
+    this_rq()->need_resched = 1;
+}
+
+static void
+enqueue(
+    struct rq *rq,
+    struct process *p,
+    uint32_t flags)
+{
+    p->cpu = rq->cpu;
+    sched_class->enqueue(rq, p, flags);
+    ++rq->nr_running;
+
+    p->rq_prev = NULL;
+    p->rq_next = rq->queued;
+    if (rq->queued != NULL)
+    {
+        rq->queued->rq_prev = p;
+    }
+    rq->queued = p;
+}
+
+static void
+unlink_queued(
+    struct rq *rq,
+    struct process *p)
+{
+    if (p->rq_prev == NULL)
+    {
+        rq->queued = p->rq_next;
+    }
+    else
+    {
+        p->rq_prev->rq_next = p->rq_next;
+    }
+    if (p->rq_next != NULL)
     {
-        if (p->ps != NULL && p->ps->id > max_pid)
+        p->rq_next->rq_prev = p->rq_prev;
+    }
+    p->rq_prev = NULL;
+    p->rq_next = NULL;
+    --rq->nr_running;
+}
+
+static void
+dequeue(
+    struct rq *rq,
+    struct process *p,
+    uint32_t flags)
+{
+    sched_class->dequeue(rq, p, flags);
+    unlink_queued(rq, p);
+}
+
+static struct process *
+pick_next(
+    struct rq *rq)
+{
+    struct process *p = sched_class->pick_next(rq);
+    if (p != NULL)
+    {
+        unlink_queued(rq, p);
+    }
+    return p;
+}
+
+/*
+ * Called after p was put on the run queue of another CPU or of this one.
+ */
+static void
+check_preempt(
+    struct rq *rq,
+    struct process *p)
+{
+    if (rq->current == NULL ||
+        (rq->current != rq->idle && !rq->idling &&
+         !sched_class->preempt(rq, p, rq->current)))
+    {
+        return;
+    }
+
+    rq->need_resched = 1;
+    if (rq->cpu != smp_cpu_id())
+    {
+        smp_send_reschedule(rq->cpu);
+    }
+}
+
+static uint32_t
+load(
+    struct rq *rq)
+{
+    return rq->nr_running + (rq->current != rq->idle ? 1 : 0);
+}
+
+/*
+ * Run queue of the online CPU with the fewest processes, for a process
+ * that doesn't have a CPU yet.
+ */
+static struct rq *
+least_loaded_rq(
+    void)
+{
+    struct rq *best = this_rq();
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+        struct rq *rq = run_queues + cpu;
+        if (rq->current != NULL && load(rq) < load(best))
         {
-            max_pid = p->ps->id;
+            best = rq;
         }
-        p = p->next;
     }
+    return best;
+}
+
+/*
+ * Load balancing. A CPU that runs out of work steals a process waiting on
+ * the busiest CPU, and every 100 ms each CPU pulls one from the busiest if
+ * that has at least two more. Processes that ran less than 20 ms ago
+ * probably still have their working set in the cache of their CPU, they
+ * are only moved when a CPU would otherwise idle; a process that last ran
+ * on the CPU pulling is moved first.
+ *
+ * The run queues are only touched with the kernel lock held, like the rest
+ * of the kernel, so balancing needs no locks of its own.
+ */
+#define REBALANCE_TICKS (100 * TIMER_FREQUENCY / 1000)
+#define CACHE_HOT_TICKS (20 * TIMER_FREQUENCY / 1000)
+
+static int
+can_migrate(
+    struct process *p)
+{
+    /*
+     * Kernel processes stay on the CPU they started on. A process switched
+     * out a moment ago may still have its kernel stack in use.
+     */
+    return p->kthread_fn == NULL && p->pdt != NULL && !p->on_cpu;
+}
 
-    return max_pid + 1;
+static int
+cache_hot(
+    struct process *p)
+{
+    return p->switches != 0 && timer_ticks() - p->last_ran < CACHE_HOT_TICKS;
 }
 
-int
+/*
+ * The process on src best moved to dst, NULL if none should be. Cache hot
+ * processes are only taken if force is set.
+ */
+static struct process *
+pick_migratable(
+    struct rq *src,
+    struct rq *dst,
+    int force)
+{
+    struct process *p, *cold = NULL, *hot = NULL;
+
+    for (p = src->queued; p != NULL; p = p->rq_next)
+    {
+        if (!can_migrate(p))
+        {
+            continue;
+        }
+        if (p->switches != 0 && p->last_cpu == dst->cpu)
+        {
+            return p;
+        }
+        if (cache_hot(p))
+        {
+            hot = hot == NULL ? p : hot;
+        }
+        else
+        {
+            cold = cold == NULL ? p : cold;
+        }
+    }
+    return cold != NULL ? cold : (force ? hot : NULL);
+}
+
+/*
+ * Run queue of the online CPU, other than dst, with the most processes.
+ */
+static struct rq *
+busiest_rq(
+    struct rq *dst)
+{
+    struct rq *busiest = NULL;
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+        struct rq *rq = run_queues + cpu;
+        if (rq != dst && rq->current != NULL &&
+            (busiest == NULL || load(rq) > load(busiest)))
+        {
+            busiest = rq;
+        }
+    }
+    return busiest;
+}
+
+static void
+migrate(
+    struct process *p,
+    struct rq *src,
+    struct rq *dst)
+{
+    dequeue(src, p, DEQUEUE_MIGRATE);
+    enqueue(dst, p, ENQUEUE_MIGRATE);
+    ++p->migrations;
+}
+
+/*
+ * Called when rq has nothing left to run. Returns 1 if it took a process
+ * from another CPU, one that is waiting there while another runs.
+ */
+static int
+idle_balance(
+    struct rq *rq)
+{
+    struct rq *busiest = busiest_rq(rq);
+    struct process *p;
+
+    if (busiest == NULL || load(busiest) < 2)
+    {
+        return 0;
+    }
+
+    p = pick_migratable(busiest, rq, 1);
+    if (p == NULL)
+    {
+        return 0;
+    }
+
+    migrate(p, busiest, rq);
+    ++rq->nr_steals;
+    return 1;
+}
+
+static void
+periodic_balance(
+    struct rq *rq)
+{
+    struct rq *busiest = busiest_rq(rq);
+    struct process *p;
+
+    if (busiest == NULL || load(busiest) < load(rq) + 2)
+    {
+        return;
+    }
+
+    p = pick_migratable(busiest, rq, rq->current == rq->idle);
+    if (p == NULL)
+    {
+        return;
+    }
+
+    migrate(p, busiest, rq);
+    ++rq->nr_pulls;
+    check_preempt(rq, p);
+}
+
+/*
+ * Called after p was put on the run queue of rq, behind a running process.
+ * Wakes up a halted CPU, if there is one, to take it; halted CPUs may not
+ * get a timer tick to look for work on their own for a while.
+ */
+static void
+kick_idle_cpu(
+    struct rq *rq)
+{
+    uint32_t cpu;
+
+    if (rq->current == rq->idle || rq->idling)
+    {
+        return;
+    }
+
+    for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+        struct rq *idle_rq = run_queues + cpu;
+        if (idle_rq->idling && idle_rq->nr_running == 0)
+        {
+            smp_send_reschedule(cpu);
+            return;
+        }
+    }
+}
+
+static void
+rebalance_softirq(
+    void)
+{
+    periodic_balance(this_rq());
+}
+
+static struct sched_class const *
+find_sched_class(
+    char const *name)
+{
+    uint32_t i, len = strlen(name);
+    for (i = 0; i < NUM_SCHED_CLASSES; ++i)
+    {
+        if (strlen(sched_classes[i]->name) == len &&
+            memcmp(sched_classes[i]->name, name, len) == 0)
+        {
+            return sched_classes[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sets up the run queue of the calling CPU, with p running.
+ */
+static void
+init_rq(
+    struct process *p)
+{
+    struct rq *rq = this_rq();
+
+    rq->cpu = smp_cpu_id();
+    rq->balance_ticks = REBALANCE_TICKS;
+    p->cpu = rq->cpu;
+    p->last_cpu = rq->cpu;
+    p->on_cpu = 1;
+    p->state = PROCESS_RUNNING;
+    rq->current = p;
+}
+
+void
+scheduler_init(
+    char const *policy)
+{
+    if (policy != NULL)
+    {
+        struct sched_class const *c = find_sched_class(policy);
+        if (c == NULL)
+        {
+            printk("scheduler_init: Unknown policy. policy: %s\n", policy);
+        }
+        else
+        {
+            sched_class = c;
+        }
+    }
+    printk("scheduler_init: Using the %s scheduler.\n", sched_class->name);
+
+    scheduler_set_time_slice(SCHEDULER_TIME_SLICE_MS);
+
+    register_isr_handler(YIELD_VECTOR, yield_handler);
+    open_softirq(SOFTIRQ_SCHED, rebalance_softirq);
+
+    init_rq(process_kernel());
+}
+
+void
+scheduler_init_cpu(
+    struct process *idle)
+{
+    this_rq()->idle = idle;
+    init_rq(idle);
+}
+
+void
 scheduler_add_process(
     struct process *p)
 {
-    struct process_list_element *e = kmalloc(
-        sizeof(struct process_list_element));
-    if (e == NULL)
+    struct rq *rq = least_loaded_rq();
+
+    p->state = PROCESS_RUNNABLE;
+    enqueue(rq, p, ENQUEUE_NEW);
+    check_preempt(rq, p);
+    kick_idle_cpu(rq);
+}
+
+int
+scheduler_add_process_on(
+    struct process *p,
+    uint32_t cpu)
+{
+    struct rq *rq;
+
+    if (cpu >= MAX_CPUS || run_queues[cpu].current == NULL)
     {
-        printk("scheduler_add_process: Couldn't allocate memory for element in "
-              "process list\n");
         return -1;
     }
 
-    e->ps = p;
-    e->next = NULL;
+    rq = run_queues + cpu;
+    p->state = PROCESS_RUNNABLE;
+    enqueue(rq, p, ENQUEUE_NEW);
+    check_preempt(rq, p);
+    return 0;
+}
 
-    if (runnable_processes.start == NULL)
+struct process *
+scheduler_current_process(
+    void)
+{
+    return this_rq()->current;
+}
+
+uint32_t
+scheduler_nr_running(
+    void)
+{
+    return this_rq()->nr_running;
+}
+
+void
+scheduler_set_time_slice(
+    uint32_t ms)
+{
+    time_slice = ms * TIMER_FREQUENCY / 1000;
+    if (time_slice == 0)
     {
-        runnable_processes.start = e;
+        time_slice = 1;
+    }
+}
+
+uint32_t
+scheduler_time_slice(
+    void)
+{
+    return time_slice;
+}
+
+void
+scheduler_set_nice(
+    struct process *p,
+    int32_t nice)
+{
+    if (nice < NICE_MIN)
+    {
+        nice = NICE_MIN;
+    }
+    else if (nice > NICE_MAX)
+    {
+        nice = NICE_MAX;
+    }
+
+    if (p->state == PROCESS_RUNNABLE)
+    {
+        struct rq *rq = run_queues + p->cpu;
+        dequeue(rq, p, 0);
+        p->nice = nice;
+        enqueue(rq, p, 0);
     }
     else
     {
-        runnable_processes.end->next = e;
+        p->nice = nice;
     }
+}
 
-    runnable_processes.end = e;
-    return 0;
+void
+scheduler_block(
+    void)
+{
+    disable_interrupts();
+    this_rq()->current->state = PROCESS_BLOCKED;
+    scheduler_schedule();
+    enable_interrupts();
 }
 
 void
-scheduler_schedule(
+scheduler_wake(
+    struct process *p)
+{
+    if (p->state != PROCESS_BLOCKED)
+    {
+        return;
+    }
+
+    p->state = PROCESS_RUNNABLE;
+    enqueue(run_queues + p->cpu, p, ENQUEUE_WAKEUP);
+    check_preempt(run_queues + p->cpu, p);
+    kick_idle_cpu(run_queues + p->cpu);
+}
+
+void
+scheduler_idle(
+    uint32_t max_ticks)
+{
+    struct rq *rq = this_rq();
+
+    /*
+     * idling is set before looking at the run queue, a CPU putting a
+     * process on it after that sees it and sends a reschedule interrupt,
+     * which ends the halt.
+     */
+    disable_interrupts();
+    rq->idling = 1;
+    if (rq->nr_running == 0 && !rq->need_resched)
+    {
+        smp_idle(max_ticks);
+    }
+    else
+    {
+        enable_interrupts();
+    }
+    rq->idling = 0;
+
+    scheduler_schedule();
+}
+
+void
+scheduler_tick(
     void)
 {
-    if (runnable_processes.start == NULL ||
-        runnable_processes.start->ps == NULL)
+    struct rq *rq = this_rq();
+
+    if (rq->current == NULL)
     {
-        printk("scheduler: There are no runnable processes to schedule\n");
         return;
     }
 
-    struct process_list_element *e = runnable_processes.start;
-    if (e->next != NULL)
+    ++rq->current->runtime_ticks;
+    if (--rq->balance_ticks == 0)
+    {
+        rq->balance_ticks = REBALANCE_TICKS;
+        raise_softirq(SOFTIRQ_SCHED);
+    }
+
+    if (rq->current != rq->idle && sched_class->tick(rq, rq->current))
+    {
+        rq->need_resched = 1;
+    }
+}
+
+int
+scheduler_get_cpu_stats(
+    uint32_t cpu,
+    struct sched_cpu_stats *stats)
+{
+    struct rq *rq;
+
+    if (cpu >= MAX_CPUS || run_queues[cpu].current == NULL)
+    {
+        return -1;
+    }
+
+    rq = run_queues + cpu;
+    stats->queued = rq->nr_running;
+    stats->running = rq->current->id;
+    stats->idle = rq->current == rq->idle;
+    stats->steals = rq->nr_steals;
+    stats->pulls = rq->nr_pulls;
+    return 0;
+}
+
+static void
+dump_process(
+    struct process *p)
+{
+    static char const *const states[] = { "runnable", "running", "blocked" };
+    uint32_t nice = p->nice < 0 ? (uint32_t) -p->nice : (uint32_t) p->nice;
+
+    printk("  pid: %u%s%s, cpu: %u, %s, nice: %s%u, runtime: %u ms, "
+           "switches: %u, migrations: %u, ", p->id, p->name ? " " : "",
+           p->name ? p->name : "", p->cpu, states[p->state],
+           p->nice < 0 ? "-" : "", nice,
+           p->runtime_ticks * (1000 / TIMER_FREQUENCY), p->switches,
+           p->migrations);
+    sched_class->dump(p);
+    printk("\n");
+}
+
+void
+scheduler_dump_stats(
+    void)
+{
+    struct process *p;
+    uint32_t cpu;
+
+    printk("scheduler: %s, uptime: %u ms\n", sched_class->name,
+           timer_ticks() * (1000 / TIMER_FREQUENCY));
+    for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+        struct sched_cpu_stats stats;
+        if (scheduler_get_cpu_stats(cpu, &stats) == 0)
+        {
+            printk(" cpu: %u, queued: %u, running: %u%s, steals: %u, "
+                   "pulls: %u\n", cpu, stats.queued, stats.running,
+                   stats.idle ? " (idle)" : "", stats.steals, stats.pulls);
+        }
+    }
+    dump_process(process_kernel());
+    for (p = process_next(NULL); p != NULL; p = process_next(p))
+    {
+        dump_process(p);
+    }
+}
+
+struct registers *
+scheduler_interrupt_return(
+    struct registers *regs)
+{
+    struct rq *rq = this_rq();
+    struct process *prev = rq->current, *next;
+
+    /*
+     * Any earlier switch on this CPU is complete: the interrupt it happened
+     * in has returned, the process switched out can run elsewhere.
+     */
+    if (rq->switched_out != NULL)
+    {
+        rq->switched_out->on_cpu = 0;
+        rq->switched_out = NULL;
+    }
+
+    if (!rq->need_resched || prev == NULL)
+    {
+        return regs;
+    }
+
+    if (!IS_USER_MODE(regs) && regs->interrupt_number != YIELD_VECTOR)
+    {
+        return regs;
+    }
+
+    rq->need_resched = 0;
+
+    if (prev->state == PROCESS_RUNNING && prev != rq->idle)
+    {
+        prev->state = PROCESS_RUNNABLE;
+        enqueue(rq, prev, 0);
+    }
+
+    next = pick_next(rq);
+    if (next == NULL && idle_balance(rq))
+    {
+        next = pick_next(rq);
+    }
+    if (next == NULL)
     {
         /*
-         * More than one element in the list. Move current process (head of
-         * list) to the end of list.
+         * The running process blocked, or is the idle process, and there is
+         * nothing else to run. Without an idle process let it continue,
+         * scheduler_block() may return early.
          */
-        runnable_processes.start = e->next;
-        e->next = NULL;
-        runnable_processes.end->next = e;
-        runnable_processes.end = e;
+        next = prev->state == PROCESS_BLOCKED && rq->idle != NULL ?
+               rq->idle : prev;
     }
+    next->state = PROCESS_RUNNING;
+    rq->current = next;
 
-    struct process *p = runnable_processes.start->ps;
-    if (p == NULL)
+    if (next == prev)
     {
-        printk("scheduler: No process to schedule\n");
-        return;
+        return regs;
     }
 
-    tss_set_kernel_stack(SEGSEL_KERNEL_DS, p->kernel_stack_start_vaddr);
-    pdt_load_process_pdt(p->pdt, p->pdt_paddr);
+    prev->context = regs;
+    fpu_switch(prev);
+    prev->last_ran = timer_ticks();
+    ++prev->switches;
+    rq->switched_out = prev;
+    next->on_cpu = 1;
+    next->last_cpu = rq->cpu;
+
+    /*
+     * The kernel lock is held by the CPU, on behalf of whatever runs on it.
+     * Hand over how deep prev held it, not counting this interrupt, and take
+     * on how deep next did when it was switched out.
+     */
+    prev->lock_depth = kernel_lock_depth() - 1;
+    kernel_lock_set_depth(next->lock_depth + 1);
 
-    if (p->current.cs == SEGSEL_KERNEL_CS) {
-        // TODO: run_process_in_kernel_mode(&p->current);
-    } else {
-        run_process_in_user_mode(&p->current);
+    tss_set_kernel_stack(SEGSEL_KERNEL_DS, next->kernel_stack_start_vaddr);
+    if (next->pdt != NULL)
+    {
+        pdt_load_process_pdt(next->pdt, next->pdt_paddr);
     }
+    else if (prev->pdt != NULL)
+    {
+        /*
+         * Between kernel threads the kernel's page directory stays loaded.
+         */
+        pdt_load_kernel_pdt();
+    }
+
+    return next->context;
 }
@@ -0,0 +1,265 @@
+#include <stddef.h>
+
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/softirq.h>
+
+#include "interrupts.h"
+
+/*
+ * Rounds of pending softirqs run on the way out of an interrupt, before the
+ * rest is left to ksoftirqd.
+ */
+#define MAX_SOFTIRQ_RESTART 10
+
+static void
+tasklet_action(
+    void);
+
+static void (*actions[NR_SOFTIRQS])(void) = {
+    [SOFTIRQ_TASKLET] = tasklet_action,
+};
+
+static char const *const softirq_names[NR_SOFTIRQS] = {
+    "timer",
+    "tasklet",
+    "sched",
+};
+
+/*
+ * Per CPU: the pending softirqs, one bit each, how deep in interrupt
+ * handlers the CPU is, whether it's running softirqs, and the tasklets
+ * scheduled on it.
+ */
+static uint32_t pending[MAX_CPUS];
+static uint32_t irq_depth[MAX_CPUS];
+static uint32_t running[MAX_CPUS];
+static struct process *ksoftirqd[MAX_CPUS];
+static struct tasklet *tasklets_head[MAX_CPUS];
+static struct tasklet *tasklets_tail[MAX_CPUS];
+
+static uint32_t runs[NR_SOFTIRQS];
+static uint32_t deferred;
+
+static void
+wakeup_softirqd(
+    uint32_t cpu)
+{
+    if (ksoftirqd[cpu] != NULL)
+    {
+        scheduler_wake(ksoftirqd[cpu]);
+    }
+}
+
+static void
+do_softirq(
+    void)
+{
+    uint32_t cpu = smp_cpu_id(), restarts = MAX_SOFTIRQ_RESTART, flags;
+    uint32_t set, nr;
+
+    if (running[cpu])
+    {
+        return;
+    }
+
+    flags = save_and_disable_interrupts();
+    running[cpu] = 1;
+
+    while (pending[cpu] != 0 && restarts-- != 0)
+    {
+        set = pending[cpu];
+        pending[cpu] = 0;
+
+        enable_interrupts();
+        for (nr = 0; set != 0; ++nr, set >>= 1)
+        {
+            if ((set & 1) && actions[nr] != NULL)
+            {
+                ++runs[nr];
+                actions[nr]();
+            }
+        }
+        disable_interrupts();
+    }
+
+    running[cpu] = 0;
+    if (pending[cpu] != 0)
+    {
+        ++deferred;
+        wakeup_softirqd(cpu);
+    }
+    restore_interrupts(flags);
+}
+
+void
+open_softirq(
+    uint32_t nr,
+    void (*action)(void))
+{
+    actions[nr] = action;
+}
+
+void
+raise_softirq(
+    uint32_t nr)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t cpu = smp_cpu_id();
+
+    pending[cpu] |= 1u << nr;
+
+    /*
+     * Outside of interrupt handlers nothing would run it until the next
+     * interrupt.
+     */
+    if (irq_depth[cpu] == 0 && !running[cpu])
+    {
+        wakeup_softirqd(cpu);
+    }
+    restore_interrupts(flags);
+}
+
+void
+irq_enter(
+    void)
+{
+    ++irq_depth[smp_cpu_id()];
+}
+
+void
+irq_exit(
+    void)
+{
+    uint32_t cpu = smp_cpu_id();
+
+    if (--irq_depth[cpu] == 0 && pending[cpu] != 0)
+    {
+        do_softirq();
+    }
+}
+
+static void
+ksoftirqd_main(
+    void *arg)
+{
+    uint32_t cpu = smp_cpu_id();
+
+    (void) arg;
+
+    for (;;)
+    {
+        disable_interrupts();
+        if (pending[cpu] == 0)
+        {
+            scheduler_block();
+            continue;
+        }
+        enable_interrupts();
+
+        do_softirq();
+
+        if (scheduler_nr_running() != 0)
+        {
+            scheduler_schedule();
+        }
+    }
+}
+
+void
+tasklet_init(
+    struct tasklet *t,
+    void (*func)(struct tasklet *t))
+{
+    t->func = func;
+    t->next = NULL;
+    t->scheduled = 0;
+}
+
+void
+tasklet_schedule(
+    struct tasklet *t)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t cpu = smp_cpu_id();
+
+    if (!t->scheduled)
+    {
+        t->scheduled = 1;
+        t->next = NULL;
+        if (tasklets_tail[cpu] == NULL)
+        {
+            tasklets_head[cpu] = t;
+        }
+        else
+        {
+            tasklets_tail[cpu]->next = t;
+        }
+        tasklets_tail[cpu] = t;
+        raise_softirq(SOFTIRQ_TASKLET);
+    }
+    restore_interrupts(flags);
+}
+
+static void
+tasklet_action(
+    void)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t cpu = smp_cpu_id();
+    struct tasklet *t = tasklets_head[cpu], *next;
+
+    tasklets_head[cpu] = NULL;
+    tasklets_tail[cpu] = NULL;
+    restore_interrupts(flags);
+
+    for (; t != NULL; t = next)
+    {
+        next = t->next;
+        t->scheduled = 0;
+        t->func(t);
+    }
+}
+
+void
+softirq_init(
+    void)
+{
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+        struct process *p;
+
+        if (!smp_cpu_online(cpu))
+        {
+            continue;
+        }
+
+        p = kthread_create("ksoftirqd", ksoftirqd_main, NULL);
+        if (p == NULL)
+        {
+            printk("softirq_init: Could not create ksoftirqd. cpu: %u\n",
+                   cpu);
+            continue;
+        }
+        ksoftirqd[cpu] = p;
+        scheduler_add_process_on(p, cpu);
+    }
+}
+
+void
+softirq_dump_stats(
+    void)
+{
+    uint32_t nr;
+
+    printk("softirq:");
+    for (nr = 0; nr < NR_SOFTIRQS; ++nr)
+    {
+        printk(" %s: %u,", softirq_names[nr], runs[nr]);
+    }
+    printk(" deferred to ksoftirqd: %u\n", deferred);
+}
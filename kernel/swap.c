@@ -0,0 +1,550 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <newbos/kmalloc.h>
+#include <newbos/paging.h>
+#include <newbos/printk.h>
+#include <newbos/swap.h>
+#include <newbos/vm.h>
+#include <newbos/workqueue.h>
+#include <newbos/zswap.h>
+
+#define SECTORS_PER_SLOT (PAGE_SIZE / BLOCK_SECTOR_SIZE)
+
+/*
+ * Swap entries in page tables hold either a slot on the swap device or,
+ * with this bit set, the index of a compressed page in zswap. Page table
+ * entries have room for 20 bits.
+ */
+#define SLOT_COMPRESSED 0x80000
+#define MAX_DISK_SLOTS  SLOT_COMPRESSED
+
+/*
+ * Share of physical memory the compressed pool may use, in percent.
+ */
+#define ZSWAP_POOL_PERCENT 20
+
+/*
+ * Watermarks, in free page frames. kswapd is woken below the low one and
+ * reclaims until the high one is reached.
+ */
+#define LOW_WATERMARK(total)  ((total) / 32)
+#define HIGH_WATERMARK(total) ((total) / 16)
+
+/*
+ * Number of pages reclaimed at least per pass, so that a pass pays for the
+ * scanning it did.
+ */
+#define RECLAIM_BATCH 32
+
+static struct block_device *swap_dev;
+
+/*
+ * One bit per slot, set when the slot is in use.
+ */
+static uint32_t *slot_bitmap;
+static uint32_t slot_hint;
+
+static uint32_t low_watermark;
+static uint32_t high_watermark;
+
+/*
+ * Background reclaim, queued when free page frames drop below the low
+ * watermark.
+ */
+static struct work kswapd_work;
+
+/*
+ * Set while reclaiming, so that allocations made on the way don't recurse
+ * into reclaim.
+ */
+static uint32_t reclaiming;
+
+/*
+ * The clock hand sweeps over the pages of every anonymous vm_area of every
+ * process. A page that was accessed since it was last sampled, by the hand
+ * or by the working set scanner, gets a second chance: its age is reset and
+ * the hand moves on. A page that wasn't is swapped out.
+ */
+static struct process *hand_process;
+static struct vm_area *hand_area;
+static uint32_t hand_vaddr;
+static uint32_t hand_wraps;
+
+static struct swap_stats stats;
+
+static void
+swap_wakeup(
+    void);
+
+static uint32_t
+swap_reclaim(
+    uint32_t num_page_frames);
+
+static void
+kswapd(
+    struct work *work);
+
+static struct pfa_reclaimer const swap_reclaimer = {
+    swap_wakeup,
+    swap_reclaim,
+};
+
+static uint32_t
+align_up(
+    uint32_t n,
+    uint32_t a)
+{
+    return (n + a - 1) & ~(a - 1);
+}
+
+static int
+slot_allocate(
+    uint32_t *out_slot)
+{
+    uint32_t i, slot;
+
+    for (i = 0; i < stats.slots; ++i)
+    {
+        slot = slot_hint + i;
+        if (slot >= stats.slots)
+        {
+            slot -= stats.slots;
+        }
+
+        if (!(slot_bitmap[slot / 32] & (1u << (slot % 32))))
+        {
+            slot_bitmap[slot / 32] |= 1u << (slot % 32);
+            slot_hint = slot + 1;
+            ++stats.slots_used;
+            *out_slot = slot;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void
+slot_free(
+    uint32_t slot)
+{
+    slot_bitmap[slot / 32] &= ~(1u << (slot % 32));
+    --stats.slots_used;
+}
+
+static int
+swap_device_init(
+    struct block_device *dev)
+{
+    uint32_t bitmap_size, slots;
+
+    slots = dev->num_sectors / SECTORS_PER_SLOT;
+    if (slots > MAX_DISK_SLOTS)
+    {
+        slots = MAX_DISK_SLOTS;
+    }
+    if (slots == 0)
+    {
+        printk("swap_init: Device too small for swap. device: %s\n",
+               dev->name);
+        return -1;
+    }
+
+    bitmap_size = ((slots + 31) / 32) * sizeof(uint32_t);
+    slot_bitmap = kmalloc(bitmap_size);
+    if (slot_bitmap == NULL)
+    {
+        printk("swap_init: Could not allocate slot bitmap. slots: %u\n",
+               slots);
+        return -1;
+    }
+    memset(slot_bitmap, 0, bitmap_size);
+
+    stats.slots = slots;
+    swap_dev = dev;
+    return 0;
+}
+
+void
+swap_init(
+    struct block_device *dev)
+{
+    uint32_t total = pfa_total_frames();
+
+    /*
+     * Cold pages are compressed into memory first and only go to the swap
+     * device when they don't compress or the pool is full.
+     */
+    zswap_init(total / 100 * ZSWAP_POOL_PERCENT);
+
+    low_watermark = LOW_WATERMARK(total);
+    high_watermark = HIGH_WATERMARK(total);
+    work_init(&kswapd_work, kswapd);
+    pfa_set_reclaimer(&swap_reclaimer);
+
+    if (dev == NULL)
+    {
+        printk("swap: No swap device\n");
+        return;
+    }
+
+    if (swap_device_init(dev) == 0)
+    {
+        printk("swap: %u KB on %s\n", stats.slots * (PAGE_SIZE / 1024),
+               dev->name);
+    }
+}
+
+/*
+ * Moves the clock hand to the next page of anonymous memory that may be
+ * mapped. Returns -1 if there is no such page in any process.
+ */
+static int
+clock_advance(
+    void)
+{
+    uint32_t wraps = 0;
+
+    hand_vaddr += PAGE_SIZE;
+
+    for (;;)
+    {
+        if (hand_area != NULL && hand_vaddr < hand_area->end)
+        {
+            if (!(hand_area->flags & VM_ANONYMOUS))
+            {
+                hand_vaddr = hand_area->end;
+                continue;
+            }
+            /*
+             * Look at each region once, as the hand enters it.
+             */
+            if ((hand_vaddr != hand_area->start &&
+                 hand_vaddr % LARGE_PAGE_SIZE != 0) ||
+                pdt_has_mappings(hand_process->pdt, hand_vaddr))
+            {
+                return 0;
+            }
+            hand_vaddr = align_up(hand_vaddr + 1, LARGE_PAGE_SIZE);
+            if (hand_vaddr == 0)
+            {
+                hand_vaddr = hand_area->end;
+            }
+            continue;
+        }
+
+        if (hand_area != NULL && hand_area->next != NULL)
+        {
+            hand_area = hand_area->next;
+        }
+        else
+        {
+            hand_process = process_next(hand_process);
+            if (hand_process == NULL)
+            {
+                if (wraps++ == 1)
+                {
+                    return -1;
+                }
+                ++hand_wraps;
+                hand_process = process_next(NULL);
+                if (hand_process == NULL)
+                {
+                    return -1;
+                }
+            }
+            hand_area = hand_process->vm_areas;
+            if (hand_area == NULL)
+            {
+                continue;
+            }
+        }
+        hand_vaddr = hand_area->start;
+    }
+}
+
+/*
+ * The page is unmapped on every CPU before its contents are copied, so a
+ * write by the process can't land in the frame after the copy is taken.
+ * A fault on it waits for the kernel lock until the swap entry is set, or
+ * the page is mapped again when it can't be swapped out.
+ */
+static int
+swap_out(
+    struct process *p,
+    uint32_t vaddr,
+    paddr_t paddr)
+{
+    uint32_t slot;
+    void *buf;
+    int ret = -1;
+
+    if (pdt_unmap_memory(p->pdt, vaddr, PAGE_SIZE) != PAGE_SIZE)
+    {
+        return -1;
+    }
+
+    if (zswap_store(paddr, &slot) == 0)
+    {
+        slot |= SLOT_COMPRESSED;
+        if (pdt_set_swap_entry(p->pdt, vaddr, slot) == 0)
+        {
+            ret = 0;
+        }
+        else
+        {
+            printk("swap_out: Could not set swap entry. vaddr: %X\n", vaddr);
+            zswap_load(slot & ~SLOT_COMPRESSED, paddr);
+        }
+    }
+    else if (swap_dev != NULL && slot_allocate(&slot) == 0)
+    {
+        buf = kmap_frame(paddr);
+        if (buf != NULL)
+        {
+            ret = swap_dev->write(swap_dev, slot * SECTORS_PER_SLOT,
+                                  SECTORS_PER_SLOT, buf);
+            kunmap_frame(buf);
+        }
+
+        if (ret == 0 && pdt_set_swap_entry(p->pdt, vaddr, slot) != 0)
+        {
+            ret = -1;
+        }
+        if (ret != 0)
+        {
+            printk("swap_out: Could not swap out page. vaddr: %X, slot: %u\n",
+                   vaddr, slot);
+            slot_free(slot);
+        }
+    }
+
+    if (ret != 0)
+    {
+        if (pdt_map_memory(p->pdt, paddr, vaddr, PAGE_SIZE, PAGING_READ_WRITE,
+                           PAGING_PL3) < PAGE_SIZE)
+        {
+            printk("swap_out: Could not map page again. vaddr: %X\n", vaddr);
+            abort();
+        }
+        return -1;
+    }
+
+    pfa_free(paddr);
+    ++stats.pages_out;
+    return 0;
+}
+
+int
+swap_in(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t slot,
+    uint8_t rw)
+{
+    paddr_t paddr;
+    void *buf;
+    int ret;
+
+    paddr = pfa_allocate(1);
+    if (paddr == 0)
+    {
+        printk("swap_in: Could not allocate page frame. vaddr: %X\n", vaddr);
+        return -1;
+    }
+
+    if (slot & SLOT_COMPRESSED)
+    {
+        ret = zswap_load(slot & ~SLOT_COMPRESSED, paddr);
+    }
+    else
+    {
+        buf = kmap_frame(paddr);
+        if (buf == NULL)
+        {
+            pfa_free(paddr);
+            return -1;
+        }
+        ret = swap_dev->read(swap_dev, slot * SECTORS_PER_SLOT,
+                             SECTORS_PER_SLOT, buf);
+        kunmap_frame(buf);
+    }
+
+    if (ret != 0)
+    {
+        printk("swap_in: Could not read page. vaddr: %X, slot: %u\n",
+               vaddr, slot);
+        pfa_free(paddr);
+        return -1;
+    }
+
+    if (pdt_map_memory(p->pdt, paddr, vaddr, PAGE_SIZE, rw, PAGING_PL3)
+            < PAGE_SIZE)
+    {
+        printk("swap_in: Could not map page. vaddr: %X, paddr: %X\n",
+               vaddr, (uint32_t) paddr);
+        pfa_free(paddr);
+        return -1;
+    }
+
+    if (!(slot & SLOT_COMPRESSED))
+    {
+        slot_free(slot);
+    }
+    ++stats.pages_in;
+    return 0;
+}
+
+/*
+ * Runs the clock until num_pages pages are swapped out, or the hand went
+ * twice around all processes without finding enough unused pages.
+ */
+static uint32_t
+reclaim_pages(
+    uint32_t num_pages)
+{
+    uint32_t state, reclaimed = 0, start_wraps = hand_wraps;
+    paddr_t paddr;
+
+    while (reclaimed < num_pages && hand_wraps - start_wraps <= 2)
+    {
+        if (clock_advance() != 0)
+        {
+            break;
+        }
+        ++stats.pages_scanned;
+
+        state = pdt_sample_page(hand_process->pdt, hand_vaddr, &paddr);
+
+        /*
+         * A large page is sampled once for all of it, then the hand moves
+         * past it. Once it's cold it's split, and its 4 KB frames are
+         * swapped like any others.
+         */
+        if (state & PAGE_STATE_LARGE)
+        {
+            if (PAGE_STATE_AGE(state) == 0 ||
+                pdt_split_large_page_at(hand_process->pdt, hand_vaddr) != 0)
+            {
+                hand_vaddr = (hand_vaddr & ~(LARGE_PAGE_SIZE - 1)) +
+                             LARGE_PAGE_SIZE - PAGE_SIZE;
+                continue;
+            }
+            state = pdt_sample_page(hand_process->pdt, hand_vaddr, &paddr);
+        }
+
+        /*
+         * Only private 4 KB frames are swapped. Read-only pages of anonymous
+         * memory are the shared zero page.
+         */
+        if (!(state & PAGE_STATE_PRESENT) || !(state & PAGE_STATE_RW))
+        {
+            continue;
+        }
+
+        if (PAGE_STATE_AGE(state) == 0)
+        {
+            continue;
+        }
+
+        if (swap_out(hand_process, hand_vaddr, paddr) == 0)
+        {
+            ++reclaimed;
+        }
+    }
+
+    return reclaimed;
+}
+
+static void
+swap_wakeup(
+    void)
+{
+    if (pfa_free_frames() < low_watermark)
+    {
+        schedule_work(&kswapd_work);
+    }
+}
+
+static uint32_t
+swap_reclaim(
+    uint32_t num_page_frames)
+{
+    uint32_t reclaimed;
+
+    if (reclaiming)
+    {
+        return 0;
+    }
+
+    reclaiming = 1;
+    ++stats.direct_reclaims;
+    reclaimed = reclaim_pages(num_page_frames > RECLAIM_BATCH ?
+                              num_page_frames : RECLAIM_BATCH);
+    reclaiming = 0;
+
+    return reclaimed;
+}
+
+/*
+ * Swaps out pages until free page frames are above the high watermark
+ * again.
+ */
+static void
+kswapd(
+    struct work *work)
+{
+    (void) work;
+
+    if (reclaiming)
+    {
+        return;
+    }
+
+    reclaiming = 1;
+    ++stats.kswapd_runs;
+
+    while (pfa_free_frames() < high_watermark)
+    {
+        if (reclaim_pages(RECLAIM_BATCH) == 0)
+        {
+            break;
+        }
+    }
+
+    reclaiming = 0;
+}
+
+void
+swap_get_stats(
+    struct swap_stats *s)
+{
+    *s = stats;
+}
+
+void
+swap_dump_stats(
+    void)
+{
+    struct zswap_stats z;
+    zswap_get_stats(&z);
+
+    printk("swap: %u/%u slots used, out: %u, in: %u, scanned: %u, "
+           "direct reclaims: %u, kswapd runs: %u\n",
+           stats.slots_used, stats.slots, stats.pages_out, stats.pages_in,
+           stats.pages_scanned, stats.direct_reclaims, stats.kswapd_runs);
+
+    /*
+     * Ratio of uncompressed to pool size, hit rate of page-ins served from
+     * memory.
+     */
+    printk("zswap: %u pages in %u frames (ratio: %u%%), %u KB compressed, "
+           "hits: %u/%u (%u%%), rejected: %u incompressible, %u pool full\n",
+           z.stored_pages, z.pool_pages,
+           z.pool_pages ? z.stored_pages * 100 / z.pool_pages : 0,
+           z.compressed_bytes / 1024, z.loads, stats.pages_in,
+           stats.pages_in ? z.loads * 100 / stats.pages_in : 0,
+           z.rejected_incompressible, z.rejected_pool_full);
+}
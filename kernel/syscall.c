@@ -0,0 +1,155 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/hrtimer.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/ring.h>
+#include <newbos/scheduler.h>
+#include <newbos/syscall.h>
+#include <newbos/timekeeping.h>
+#include <newbos/vm.h>
+
+#include "memory.h"
+
+/*
+ * Bytes of a user buffer printed at a time.
+ */
+#define WRITE_CHUNK 64
+
+/*
+ * Returns 1 if [vaddr, vaddr + size) is memory of the calling process the
+ * kernel may read, or write if write is set, with its pages mapped so that
+ * touching them doesn't fault. Kernel threads working for a process, like
+ * the ring submission thread, use its memory.
+ */
+static int
+user_range_ok(
+    uint32_t vaddr,
+    uint32_t size,
+    int write)
+{
+    struct process *p = scheduler_current_process();
+
+    if (p->mm_owner != NULL)
+    {
+        p = p->mm_owner;
+    }
+
+    return vaddr + size >= vaddr && vaddr + size <= KERNEL_START_VADDR &&
+           vm_fault_in_range(p, vaddr, size, write) == 0;
+}
+
+static int32_t
+sys_getpid(
+    uint32_t const *args)
+{
+    (void) args;
+    return (int32_t) scheduler_current_process()->id;
+}
+
+static int32_t
+sys_yield(
+    uint32_t const *args)
+{
+    (void) args;
+    scheduler_schedule();
+    return 0;
+}
+
+static int32_t
+sys_nanosleep(
+    uint32_t const *args)
+{
+    hrtimer_nanosleep((uint64_t) args[1] << 32 | args[0]);
+    return 0;
+}
+
+static int32_t
+sys_write(
+    uint32_t const *args)
+{
+    char const *buf = (char const *) args[0];
+    uint32_t len = args[1], done, n;
+    char chunk[WRITE_CHUNK + 1];
+
+    if (!user_range_ok(args[0], len, 0))
+    {
+        return -1;
+    }
+
+    for (done = 0; done < len; done += n)
+    {
+        n = len - done < WRITE_CHUNK ? len - done : WRITE_CHUNK;
+        memcpy(chunk, buf + done, n);
+        chunk[n] = '\0';
+        printk("%s", chunk);
+    }
+
+    return (int32_t) len;
+}
+
+static int32_t
+sys_clock_gettime(
+    uint32_t const *args)
+{
+    struct timespec ts;
+
+    if (!user_range_ok(args[1], sizeof(ts), 1))
+    {
+        return -1;
+    }
+
+    if (args[0] == CLOCK_REALTIME)
+    {
+        ktime_get_real_ts(&ts);
+    }
+    else if (args[0] == CLOCK_MONOTONIC)
+    {
+        ktime_get_ts(&ts);
+    }
+    else
+    {
+        return -1;
+    }
+
+    memcpy((void *) args[1], &ts, sizeof(ts));
+    return 0;
+}
+
+static int32_t
+sys_ring_setup(
+    uint32_t const *args)
+{
+    return ring_setup(scheduler_current_process(), args[0], args[1]);
+}
+
+static int32_t
+sys_ring_enter(
+    uint32_t const *args)
+{
+    return ring_enter(scheduler_current_process(), args[0], args[1], args[2]);
+}
+
+static int32_t (*const syscall_table[NR_SYSCALLS])(uint32_t const *args) = {
+    [SYS_GETPID] = sys_getpid,
+    [SYS_YIELD] = sys_yield,
+    [SYS_NANOSLEEP] = sys_nanosleep,
+    [SYS_WRITE] = sys_write,
+    [SYS_CLOCK_GETTIME] = sys_clock_gettime,
+    [SYS_RING_SETUP] = sys_ring_setup,
+    [SYS_RING_ENTER] = sys_ring_enter,
+};
+
+int32_t
+syscall_dispatch(
+    uint32_t nr,
+    uint32_t const *args)
+{
+    if (nr >= NR_SYSCALLS || syscall_table[nr] == NULL)
+    {
+        return -1;
+    }
+
+    return syscall_table[nr](args);
+}
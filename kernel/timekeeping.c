@@ -0,0 +1,219 @@
+#include <stddef.h>
+
+#include <newbos/clocksource.h>
+#include <newbos/printk.h>
+#include <newbos/timekeeping.h>
+
+#include "interrupts.h"
+#include "memory.h"
+#include "rtc.h"
+
+static uint64_t
+jiffies_read(
+    void)
+{
+    return timer_ticks();
+}
+
+static struct clocksource jiffies_clocksource = {
+    "jiffies", jiffies_read, NSEC_PER_TICK, 0, 1, TIME_PAGE_COARSE
+};
+
+static struct clocksource *clock = &jiffies_clocksource;
+
+/*
+ * A page of its own, nothing else of the kernel's may be mapped into
+ * processes with it.
+ */
+static union {
+    struct time_page tp;
+    uint8_t bytes[PAGE_SIZE];
+} time_page __attribute__((aligned(PAGE_SIZE))) = {
+    { 0, TIME_PAGE_COARSE, 0, NSEC_PER_TICK, 0, 0, 0, 0, 0 }
+};
+
+static struct time_page *const tp = &time_page.tp;
+
+/*
+ * Updates of the time page are made with interrupts disabled, the timer
+ * tick would update it too otherwise, and under the kernel lock, so
+ * there's one writer at a time.
+ */
+static uint32_t
+write_begin(
+    void)
+{
+    uint32_t flags = save_and_disable_interrupts();
+
+    ++tp->seq;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return flags;
+}
+
+static void
+write_end(
+    uint32_t flags)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ++tp->seq;
+    restore_interrupts(flags);
+}
+
+static void
+fold(
+    void)
+{
+    uint64_t now = clock->read();
+    uint64_t shifted = (now - tp->cycle_last) * tp->mult + tp->frac;
+    uint64_t nsec = tp->mono_nsec + (shifted >> tp->shift);
+
+    tp->cycle_last = now;
+    tp->frac = shifted & (((uint64_t) 1 << tp->shift) - 1);
+    while (nsec >= NSEC_PER_SEC)
+    {
+        nsec -= NSEC_PER_SEC;
+        ++tp->mono_sec;
+    }
+    tp->mono_nsec = (uint32_t) nsec;
+}
+
+/*
+ * Reads the monotonic time, with the nanoseconds not yet carried into the
+ * seconds, and the realtime offset.
+ */
+static void
+read_time(
+    uint32_t *sec,
+    uint64_t *nsec,
+    uint32_t *real_sec)
+{
+    uint32_t seq;
+
+    do
+    {
+        seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE);
+        *sec = tp->mono_sec;
+        *nsec = tp->mono_nsec +
+                (((clock->read() - tp->cycle_last) * tp->mult + tp->frac) >>
+                 tp->shift);
+        *real_sec = tp->real_sec;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != tp->seq);
+}
+
+void
+timekeeping_init(
+    void)
+{
+    uint32_t seconds = rtc_read_seconds(), flags;
+
+    if (seconds == 0)
+    {
+        printk("timekeeping_init: Could not read the RTC.\n");
+        return;
+    }
+
+    flags = write_begin();
+    fold();
+    tp->real_sec = seconds - tp->mono_sec;
+    write_end(flags);
+
+    printk("timekeeping_init: Realtime clock set. seconds: %u\n", seconds);
+}
+
+void
+timekeeping_tick(
+    void)
+{
+    uint32_t flags = write_begin();
+
+    fold();
+    write_end(flags);
+}
+
+int
+timekeeping_change_clocksource(
+    struct clocksource *cs)
+{
+    uint32_t flags;
+
+    if (cs->rating <= clock->rating)
+    {
+        return -1;
+    }
+
+    flags = write_begin();
+    fold();
+    clock = cs;
+    tp->clock_mode = cs->time_page_mode;
+    tp->cycle_last = cs->read();
+    tp->mult = cs->mult;
+    tp->shift = cs->shift;
+    tp->frac = 0;
+    write_end(flags);
+
+    return 0;
+}
+
+uint64_t
+ktime_get_ns(
+    void)
+{
+    uint32_t sec, real_sec;
+    uint64_t nsec;
+
+    read_time(&sec, &nsec, &real_sec);
+    return sec * NSEC_PER_SEC + nsec;
+}
+
+static void
+get_ts(
+    struct timespec *ts,
+    int real)
+{
+    uint32_t real_sec;
+    uint64_t nsec;
+
+    read_time(&ts->tv_sec, &nsec, &real_sec);
+    while (nsec >= NSEC_PER_SEC)
+    {
+        nsec -= NSEC_PER_SEC;
+        ++ts->tv_sec;
+    }
+    ts->tv_nsec = (uint32_t) nsec;
+
+    if (real)
+    {
+        ts->tv_sec += real_sec;
+    }
+}
+
+void
+ktime_get_ts(
+    struct timespec *ts)
+{
+    get_ts(ts, 0);
+}
+
+void
+ktime_get_real_ts(
+    struct timespec *ts)
+{
+    get_ts(ts, 1);
+}
+
+int
+timekeeping_map(
+    struct pde *pdt)
+{
+    if (pdt_map_memory(pdt, VIRTUAL_TO_PHYSICAL((uint32_t) &time_page),
+                       TIME_PAGE_VADDR, PAGE_SIZE, PAGING_READ_ONLY,
+                       PAGING_PL3) != PAGE_SIZE)
+    {
+        printk("timekeeping_map: Could not map the time page. pdt: %X\n",
+               (uint32_t) pdt);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,561 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <newbos/kmalloc.h>
+#include <newbos/kstack.h>
+#include <newbos/paging.h>
+#include <newbos/pagecache.h>
+#include <newbos/printk.h>
+#include <newbos/scheduler.h>
+#include <newbos/swap.h>
+#include <newbos/vm.h>
+
+#include "interrupts.h"
+
+#define FOUR_KB     0x1000
+
+#define LARGE_PAGE_PAGES (LARGE_PAGE_SIZE / FOUR_KB)
+
+/*
+ * Pages of a region that have to be in use before it's moved to a large
+ * page, three quarters.
+ */
+#define LARGE_PAGE_MIN_PAGES (LARGE_PAGE_PAGES / 4 * 3)
+
+/*
+ * page fault error code bits
+ */
+#define PF_PRESENT  0x01
+#define PF_WRITE    0x02
+#define PF_USER     0x04
+
+uint32_t read_cr2(void);
+
+/*
+ * A single frame filled with zeroes. It is mapped read-only into every page of
+ * anonymous memory that has been read but never written, so that those pages
+ * don't consume a frame of their own.
+ */
+static paddr_t zero_frame;
+
+static void
+page_fault_handler(
+    registers_t *regs);
+
+static uint32_t
+align_down(
+    uint32_t n,
+    uint32_t a)
+{
+    return n - (n % a);
+}
+
+void
+vm_init(
+    void)
+{
+    zero_frame = pfa_allocate(1);
+    if (zero_frame == 0)
+    {
+        printk("vm_init: Could not allocate the zero page frame\n");
+        return;
+    }
+    pfa_zero(zero_frame);
+
+    register_isr_handler(14, page_fault_handler);
+}
+
+int
+vm_area_add(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t size,
+    uint32_t flags)
+{
+    struct vm_area *area = kmalloc(sizeof(struct vm_area));
+    if (area == NULL)
+    {
+        printk("vm_area_add: Could not allocate memory for area. "
+               "vaddr: %X, size: %u\n", vaddr, size);
+        return -1;
+    }
+
+    area->start = vaddr;
+    area->end = vaddr + size;
+    area->flags = flags;
+    area->file = NULL;
+    area->file_offset = 0;
+    area->file_size = 0;
+    area->next = p->vm_areas;
+    p->vm_areas = area;
+
+    return 0;
+}
+
+int
+vm_area_add_file(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t size,
+    uint32_t flags,
+    struct initrd_file const *file,
+    uint32_t file_offset,
+    uint32_t file_size)
+{
+    if (vm_area_add(p, vaddr, size, flags | VM_FILE) != 0)
+    {
+        return -1;
+    }
+
+    p->vm_areas->file = file;
+    p->vm_areas->file_offset = file_offset;
+    p->vm_areas->file_size = file_size;
+    return 0;
+}
+
+static struct vm_area *
+vm_area_find(
+    struct process *p,
+    uint32_t vaddr)
+{
+    struct vm_area *area;
+    for (area = p->vm_areas; area != NULL; area = area->next)
+    {
+        if (vaddr >= area->start && vaddr < area->end)
+        {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Gives the page at vaddr a private frame holding the first len bytes of the
+ * frame at src and zeroes after them, replacing whatever was mapped there
+ * before (nothing, the zero page or a page of a file).
+ */
+static int
+vm_map_copied_frame(
+    struct process *p,
+    uint32_t vaddr,
+    paddr_t src,
+    uint32_t len,
+    uint8_t rw)
+{
+    uint8_t *to, *from;
+    paddr_t paddr = pfa_allocate(1);
+    if (paddr == 0)
+    {
+        printk("vm_map_copied_frame: Could not allocate page frame. "
+               "vaddr: %X\n", vaddr);
+        return -1;
+    }
+
+    to = kmap_frame(paddr);
+    if (len > 0)
+    {
+        from = kmap_frame(src);
+        memcpy(to, from, len);
+        kunmap_frame(from);
+    }
+    memset(to + len, 0, FOUR_KB - len);
+    kunmap_frame(to);
+
+    pdt_unmap_memory(p->pdt, vaddr, FOUR_KB);
+    if (pdt_map_memory(p->pdt, paddr, vaddr, FOUR_KB, rw, PAGING_PL3)
+            < FOUR_KB)
+    {
+        printk("vm_map_copied_frame: Could not map page. "
+               "vaddr: %X, paddr: %X\n", vaddr, (uint32_t) paddr);
+        pfa_free(paddr);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Gives the page at vaddr a private zeroed frame.
+ */
+static int
+vm_map_private_frame(
+    struct process *p,
+    uint32_t vaddr,
+    uint8_t rw)
+{
+    return vm_map_copied_frame(p, vaddr, 0, 0, rw);
+}
+
+static int
+vm_map_zero_page(
+    struct process *p,
+    uint32_t vaddr)
+{
+    if (pdt_map_memory(p->pdt, zero_frame, vaddr, FOUR_KB,
+                       PAGING_READ_ONLY, PAGING_PL3) < FOUR_KB)
+    {
+        printk("vm_map_zero_page: Could not map zero page. vaddr: %X\n",
+               vaddr);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Gives the page at vaddr of a VM_FILE area a private copy of the frame at
+ * src, of which the first len bytes are the image's.
+ */
+static int
+vm_map_file_copy(
+    struct process *p,
+    uint32_t vaddr,
+    paddr_t src,
+    uint32_t len)
+{
+    paddr_t paddr;
+    uint8_t rw;
+
+    if (vm_map_copied_frame(p, vaddr, src, len, PAGING_READ_WRITE) != 0)
+    {
+        return -1;
+    }
+
+    paddr = pdt_lookup(p->pdt, vaddr, &rw);
+    return process_add_code_frame(p, paddr, 0);
+}
+
+/*
+ * Maps the page at vaddr of a VM_FILE area, see vm.h.
+ */
+static int
+vm_map_file_page(
+    struct process *p,
+    struct vm_area *area,
+    uint32_t vaddr,
+    uint32_t error_code)
+{
+    uint32_t offset = vaddr - area->start, len;
+    paddr_t paddr;
+
+    if (offset >= area->file_size)
+    {
+        if (error_code & PF_WRITE)
+        {
+            return vm_map_private_frame(p, vaddr, PAGING_READ_WRITE);
+        }
+        return vm_map_zero_page(p, vaddr);
+    }
+
+    len = area->file_size - offset < FOUR_KB ? area->file_size - offset :
+                                               FOUR_KB;
+    offset += area->file_offset;
+
+    if ((area->flags & VM_READ_WRITE) &&
+        (len < FOUR_KB || (error_code & PF_WRITE)))
+    {
+        return vm_map_file_copy(p, vaddr,
+                                area->file->paddr + offset, len);
+    }
+
+    paddr = page_cache_get(area->file, offset, len);
+    if (paddr == 0)
+    {
+        return -1;
+    }
+
+    if (pdt_map_memory(p->pdt, paddr, vaddr, FOUR_KB, PAGING_READ_ONLY,
+                       PAGING_PL3) < FOUR_KB)
+    {
+        printk("vm_map_file_page: Could not map page. vaddr: %X\n", vaddr);
+        page_cache_put(paddr);
+        return -1;
+    }
+
+    return process_add_code_frame(p, paddr, PADDR_SHARED);
+}
+
+/*
+ * Backs the whole LARGE_PAGE_SIZE region around vaddr with one large page,
+ * once most of it is in use: the region has to lie inside the area, have at
+ * least LARGE_PAGE_MIN_PAGES pages mapped and none swapped out, and there
+ * has to be aligned contiguous physical memory for it. The pages mapped so
+ * far are copied into the large page and freed.
+ */
+static int
+vm_map_large_page(
+    struct process *p,
+    struct vm_area *area,
+    uint32_t vaddr)
+{
+    uint32_t i, swapped, start = align_down(vaddr, LARGE_PAGE_SIZE);
+    paddr_t paddr, *old;
+    uint8_t *to, *from, rw;
+
+    if (start < area->start || area->end - start < LARGE_PAGE_SIZE ||
+        pdt_count_pages(p->pdt, start, &swapped) < LARGE_PAGE_MIN_PAGES ||
+        swapped != 0)
+    {
+        return -1;
+    }
+
+    old = kmalloc(LARGE_PAGE_PAGES * sizeof(paddr_t));
+    if (old == NULL)
+    {
+        return -1;
+    }
+
+    paddr = pfa_allocate_aligned(LARGE_PAGE_PAGES, LARGE_PAGE_SIZE);
+    if (paddr == 0)
+    {
+        kfree(old);
+        return -1;
+    }
+
+    for (i = 0; i < LARGE_PAGE_PAGES; ++i)
+    {
+        old[i] = pdt_lookup(p->pdt, start + i * FOUR_KB, &rw);
+        if (old[i] == 0 || old[i] == zero_frame)
+        {
+            pfa_zero(paddr + i * FOUR_KB);
+            continue;
+        }
+
+        to = kmap_frame(paddr + i * FOUR_KB);
+        from = kmap_frame(old[i]);
+        memcpy(to, from, FOUR_KB);
+        kunmap_frame(from);
+        kunmap_frame(to);
+    }
+
+    pdt_unmap_memory(p->pdt, start, LARGE_PAGE_SIZE);
+    if (pdt_map_memory(p->pdt, paddr, start, LARGE_PAGE_SIZE,
+                       PAGING_READ_WRITE, PAGING_PL3) < LARGE_PAGE_SIZE)
+    {
+        printk("vm_map_large_page: Could not map large page. "
+               "vaddr: %X, paddr: %X\n", start, (uint32_t) paddr);
+
+        /*
+         * Put the pages back as they were.
+         */
+        for (i = 0; i < LARGE_PAGE_PAGES; ++i)
+        {
+            if (old[i] != 0)
+            {
+                pdt_map_memory(p->pdt, old[i], start + i * FOUR_KB, FOUR_KB,
+                               old[i] == zero_frame ? PAGING_READ_ONLY :
+                                                      PAGING_READ_WRITE,
+                               PAGING_PL3);
+            }
+            pfa_free(paddr + i * FOUR_KB);
+        }
+        kfree(old);
+        return -1;
+    }
+
+    for (i = 0; i < LARGE_PAGE_PAGES; ++i)
+    {
+        if (old[i] != 0 && old[i] != zero_frame)
+        {
+            pfa_free(old[i]);
+        }
+    }
+    kfree(old);
+    return 0;
+}
+
+/*
+ * Gives the page at vaddr of an anonymous area a private zeroed frame on its
+ * first write, then moves its region to a large page if it's mostly in use
+ * by now.
+ */
+static int
+vm_map_anonymous_frame(
+    struct process *p,
+    struct vm_area *area,
+    uint32_t vaddr)
+{
+    if (vm_map_private_frame(p, vaddr, PAGING_READ_WRITE) != 0)
+    {
+        return -1;
+    }
+
+    if (!(area->flags & VM_FILE))
+    {
+        vm_map_large_page(p, area, vaddr);
+    }
+    return 0;
+}
+
+int
+vm_handle_fault(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t error_code)
+{
+    struct vm_area *area;
+    paddr_t paddr;
+    uint32_t slot;
+    uint8_t rw;
+
+    if (p == NULL || (area = vm_area_find(p, vaddr)) == NULL)
+    {
+        return -1;
+    }
+
+    vaddr = align_down(vaddr, FOUR_KB);
+
+    if ((error_code & PF_WRITE) && !(area->flags & VM_READ_WRITE))
+    {
+        return -1;
+    }
+
+    if (!(error_code & PF_PRESENT))
+    {
+        if (area->flags & VM_FILE)
+        {
+            return vm_map_file_page(p, area, vaddr, error_code);
+        }
+
+        if (!(area->flags & VM_ANONYMOUS))
+        {
+            return -1;
+        }
+
+        if (pdt_get_swap_entry(p->pdt, vaddr, &slot) == 0)
+        {
+            rw = (area->flags & VM_READ_WRITE) ? PAGING_READ_WRITE :
+                                                 PAGING_READ_ONLY;
+            return swap_in(p, vaddr, slot, rw);
+        }
+
+        if (error_code & PF_WRITE)
+        {
+            return vm_map_anonymous_frame(p, area, vaddr);
+        }
+
+        /*
+         * First touch is a read: share the zero page until it's written.
+         */
+        return vm_map_zero_page(p, vaddr);
+    }
+
+    /*
+     * Write to a present, read-only page in a writable area: the zero page
+     * or a page of a file, both copied on write.
+     */
+    paddr = pdt_lookup(p->pdt, vaddr, &rw);
+    if (paddr == zero_frame && rw == PAGING_READ_ONLY)
+    {
+        return vm_map_anonymous_frame(p, area, vaddr);
+    }
+    if ((area->flags & VM_FILE) && rw == PAGING_READ_ONLY)
+    {
+        return vm_map_file_copy(p, vaddr, paddr, FOUR_KB);
+    }
+
+    return -1;
+}
+
+int
+vm_fault_in_range(
+    struct process *p,
+    uint32_t vaddr,
+    uint32_t size,
+    int write)
+{
+    struct vm_area *area;
+    uint32_t addr, end = vaddr + size, error_code;
+    paddr_t paddr;
+    uint8_t rw;
+
+    if (p == NULL || end < vaddr)
+    {
+        return -1;
+    }
+
+    for (addr = vaddr; addr < end; addr = area->end)
+    {
+        area = vm_area_find(p, addr);
+        if (area == NULL || (write && !(area->flags & VM_READ_WRITE)))
+        {
+            return -1;
+        }
+    }
+
+    for (addr = align_down(vaddr, FOUR_KB); addr < end; addr += FOUR_KB)
+    {
+        paddr = pdt_lookup(p->pdt, addr, &rw);
+        if (paddr != 0 && (!write || rw == PAGING_READ_WRITE))
+        {
+            continue;
+        }
+
+        error_code = PF_USER;
+        if (paddr != 0)
+        {
+            error_code |= PF_PRESENT;
+        }
+        if (write)
+        {
+            error_code |= PF_WRITE;
+        }
+        if (vm_handle_fault(p, addr, error_code) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void
+vm_get_stats(
+    struct process *p,
+    struct vm_stats *stats)
+{
+    stats->large_pages = pdt_large_pages(p->pdt);
+    stats->large_page_bytes = stats->large_pages * LARGE_PAGE_SIZE;
+}
+
+void
+vm_dump_stats(
+    struct process *p)
+{
+    struct vm_stats stats;
+    vm_get_stats(p, &stats);
+
+    printk("vm: pid %u large pages: %u (%u KB), split since boot: %u\n",
+           p->id, stats.large_pages, stats.large_page_bytes / 1024,
+           pdt_large_pages_split());
+}
+
+static void
+page_fault_handler(
+    registers_t *regs)
+{
+    uint32_t vaddr = read_cr2();
+    struct process *p = scheduler_current_process();
+
+    if (p != NULL && p->mm_owner != NULL)
+    {
+        p = p->mm_owner;
+    }
+
+    if (p != NULL && p->pdt != NULL &&
+        pdt_sync_kernel_memory(p->pdt, vaddr) == 0)
+    {
+        return;
+    }
+
+    if (vm_handle_fault(p, vaddr, regs->error_code) != 0)
+    {
+        printk("Page fault - vaddr: %X, eip: %X, [errno - %X]\n",
+               vaddr, regs->eip, regs->error_code);
+        if (kstack_guard_hit(vaddr))
+        {
+            printk("Kernel stack overflow - pid: %u\n",
+                   scheduler_current_process()->id);
+        }
+        abort();
+    }
+}
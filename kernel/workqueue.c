@@ -0,0 +1,233 @@
+#include <stddef.h>
+
+#include <newbos/kmalloc.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/scheduler.h>
+#include <newbos/smp.h>
+#include <newbos/workqueue.h>
+
+#include "interrupts.h"
+
+/*
+ * Workqueues shown by workqueue_dump_stats()
+ */
+#define MAX_WORKQUEUES 8
+
+static struct workqueue system_wq;
+
+static struct workqueue *workqueues[MAX_WORKQUEUES];
+static uint32_t num_workqueues;
+
+static struct work *
+dequeue_work(
+    struct workqueue *wq)
+{
+    struct work *work = wq->head;
+
+    if (work != NULL)
+    {
+        wq->head = work->next;
+        if (wq->head == NULL)
+        {
+            wq->tail = NULL;
+        }
+        work->next = NULL;
+        work->pending = 0;
+    }
+    return work;
+}
+
+static void
+worker_main(
+    void *arg)
+{
+    struct workqueue *wq = arg;
+    struct process *self = scheduler_current_process();
+    struct work *work;
+    uint32_t i, bit = 0;
+
+    for (i = 0; i < wq->nr_workers; ++i)
+    {
+        if (wq->workers[i] == self)
+        {
+            bit = 1u << i;
+        }
+    }
+
+    for (;;)
+    {
+        /*
+         * Interrupts are off between finding the queue empty and blocking,
+         * an interrupt handler queueing work in between would find the
+         * worker busy and not wake it.
+         */
+        disable_interrupts();
+        work = dequeue_work(wq);
+        if (work == NULL)
+        {
+            wq->idle_mask |= bit;
+            scheduler_block();
+            wq->idle_mask &= ~bit;
+            continue;
+        }
+        enable_interrupts();
+
+        work->func(work);
+        ++wq->nr_done;
+
+        /*
+         * Kernel threads aren't preempted, let others run between items.
+         */
+        if (scheduler_nr_running() != 0)
+        {
+            scheduler_schedule();
+        }
+    }
+}
+
+static int
+start_workers(
+    struct workqueue *wq,
+    uint32_t nr_workers)
+{
+    if (nr_workers > WORKQUEUE_MAX_WORKERS)
+    {
+        nr_workers = WORKQUEUE_MAX_WORKERS;
+    }
+
+    while (wq->nr_workers < nr_workers)
+    {
+        struct process *p = kthread_create(wq->name, worker_main, wq);
+        if (p == NULL)
+        {
+            printk("start_workers: Could not create a worker. name: %s\n",
+                   wq->name);
+            break;
+        }
+        wq->workers[wq->nr_workers++] = p;
+        scheduler_add_process(p);
+    }
+
+    if (num_workqueues < MAX_WORKQUEUES)
+    {
+        workqueues[num_workqueues++] = wq;
+    }
+    return wq->nr_workers == 0 ? -1 : 0;
+}
+
+void
+work_init(
+    struct work *work,
+    void (*func)(struct work *work))
+{
+    work->func = func;
+    work->next = NULL;
+    work->pending = 0;
+}
+
+struct workqueue *
+workqueue_create(
+    char const *name,
+    uint32_t nr_workers)
+{
+    struct workqueue *wq = kmalloc(sizeof(struct workqueue));
+    uint32_t i;
+
+    if (wq == NULL)
+    {
+        printk("workqueue_create: Could not allocate. name: %s\n", name);
+        return NULL;
+    }
+
+    wq->name = name;
+    wq->head = NULL;
+    wq->tail = NULL;
+    for (i = 0; i < WORKQUEUE_MAX_WORKERS; ++i)
+    {
+        wq->workers[i] = NULL;
+    }
+    wq->nr_workers = 0;
+    wq->idle_mask = 0;
+    wq->nr_queued = 0;
+    wq->nr_done = 0;
+
+    /*
+     * There is no way to stop workers, a workqueue without any is leaked.
+     */
+    if (start_workers(wq, nr_workers) != 0)
+    {
+        return NULL;
+    }
+    return wq;
+}
+
+int
+queue_work(
+    struct workqueue *wq,
+    struct work *work)
+{
+    if (work->pending)
+    {
+        return 0;
+    }
+
+    work->pending = 1;
+    work->next = NULL;
+    if (wq->tail == NULL)
+    {
+        wq->head = work;
+    }
+    else
+    {
+        wq->tail->next = work;
+    }
+    wq->tail = work;
+    ++wq->nr_queued;
+
+    /*
+     * Busy workers get to it when they are done, unless one is idle.
+     */
+    if (wq->idle_mask != 0)
+    {
+        scheduler_wake(wq->workers[__builtin_ctz(wq->idle_mask)]);
+    }
+    return 1;
+}
+
+int
+schedule_work(
+    struct work *work)
+{
+    return queue_work(&system_wq, work);
+}
+
+void
+workqueue_init(
+    void)
+{
+    system_wq.name = "events";
+    start_workers(&system_wq, smp_num_cpus());
+}
+
+void
+workqueue_dump_stats(
+    void)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_workqueues; ++i)
+    {
+        struct workqueue *wq = workqueues[i];
+        struct work *work;
+        uint32_t waiting = 0;
+
+        for (work = wq->head; work != NULL; work = work->next)
+        {
+            ++waiting;
+        }
+        printk("workqueue: %s, workers: %u, queued: %u, done: %u, "
+               "waiting: %u\n", wq->name, wq->nr_workers, wq->nr_queued,
+               wq->nr_done, waiting);
+    }
+}
@@ -0,0 +1,129 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/ktimer.h>
+#include <newbos/printk.h>
+#include <newbos/process.h>
+#include <newbos/timer.h>
+#include <newbos/workqueue.h>
+#include <newbos/wss.h>
+
+#include "memory.h"
+
+/*
+ * Once a second
+ */
+#define WSS_SCAN_INTERVAL TIMER_FREQUENCY
+
+void
+wss_scan_process(
+    struct process *p)
+{
+    struct wss w;
+    uint32_t vaddr = 0, state, age, pages, step;
+
+    memset(&w, 0, sizeof(w));
+    w.scans = p->wss.scans + 1;
+
+    while (vaddr < KERNEL_START_VADDR)
+    {
+        if (vaddr % LARGE_PAGE_SIZE == 0 && !pdt_has_mappings(p->pdt, vaddr))
+        {
+            vaddr += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        state = pdt_sample_page(p->pdt, vaddr, NULL);
+
+        if (state & PAGE_STATE_LARGE)
+        {
+            pages = LARGE_PAGE_SIZE / PAGE_SIZE;
+            step = LARGE_PAGE_SIZE;
+        }
+        else
+        {
+            pages = 1;
+            step = PAGE_SIZE;
+        }
+        vaddr += step;
+
+        if (!(state & PAGE_STATE_PRESENT) || !(state & PAGE_STATE_USER))
+        {
+            continue;
+        }
+
+        age = PAGE_STATE_AGE(state);
+        w.resident += pages;
+        w.ages[age] += pages;
+        if (age < WSS_WINDOW)
+        {
+            w.working_set += pages;
+        }
+        if (state & PAGE_STATE_DIRTY)
+        {
+            w.dirty += pages;
+        }
+    }
+
+    p->wss = w;
+}
+
+static void
+scan_all(
+    struct work *work)
+{
+    struct process *p;
+
+    (void) work;
+
+    for (p = process_next(NULL); p != NULL; p = process_next(p))
+    {
+        /*
+         * Kernel threads have no user memory of their own.
+         */
+        if (p->pdt != NULL && p->kthread_fn == NULL)
+        {
+            wss_scan_process(p);
+        }
+    }
+}
+
+static struct work scan_work = { scan_all, NULL, 0 };
+
+static void
+scan_timer_fn(
+    struct ktimer *t)
+{
+    schedule_work(&scan_work);
+    ktimer_add(t, t->expires + WSS_SCAN_INTERVAL);
+}
+
+static struct ktimer scan_timer;
+
+void
+wss_init(
+    void)
+{
+    ktimer_init(&scan_timer, scan_timer_fn);
+    ktimer_add(&scan_timer, timer_ticks() + WSS_SCAN_INTERVAL);
+}
+
+void
+wss_dump_stats(
+    struct process *p)
+{
+    uint32_t i;
+
+    printk("wss: pid %u resident: %u KB, working set: %u KB, "
+           "dirty: %u KB, scans: %u\n",
+           p->id, p->wss.resident * (PAGE_SIZE / 1024),
+           p->wss.working_set * (PAGE_SIZE / 1024),
+           p->wss.dirty * (PAGE_SIZE / 1024), p->wss.scans);
+
+    printk("wss: pages by age:");
+    for (i = 0; i <= PAGE_AGE_MAX; ++i)
+    {
+        printk(" %u", p->wss.ages[i]);
+    }
+    printk("\n");
+}
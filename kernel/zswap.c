@@ -0,0 +1,328 @@
+#include <stddef.h>
+#include <string.h>
+
+#include <newbos/kmalloc.h>
+#include <newbos/lz.h>
+#include <newbos/printk.h>
+#include <newbos/zswap.h>
+
+/*
+ * The pool is made of page frames cut into chunks. All objects in one pool
+ * page take the same number of chunks, so a page is just a bitmap of equal
+ * slots and a freed object leaves a hole that fits the next object of the
+ * same size exactly.
+ */
+#define CHUNK_SIZE      64
+#define CHUNKS_PER_PAGE (PAGE_SIZE / CHUNK_SIZE)
+
+/*
+ * Pages that don't compress to 3/4 of their size aren't worth keeping in
+ * memory.
+ */
+#define MAX_CHUNKS      (CHUNKS_PER_PAGE * 3 / 4)
+#define MAX_COMPRESSED  (MAX_CHUNKS * CHUNK_SIZE)
+
+/*
+ * Entries per pool page, bounds the compression ratio the pool can reach.
+ */
+#define ENTRIES_PER_POOL_PAGE 8
+
+struct zpool_page {
+    paddr_t paddr;
+    uint32_t used[CHUNKS_PER_PAGE / 32];
+    uint16_t chunks;    /* per object */
+    uint16_t free;      /* objects */
+    struct zpool_page *prev;
+    struct zpool_page *next;
+};
+
+struct zswap_entry {
+    struct zpool_page *page;    /* NULL if the entry is unused */
+    uint16_t obj;
+    uint16_t size;
+};
+
+/*
+ * Pool pages with free objects, by object size in chunks.
+ */
+static struct zpool_page *partial[MAX_CHUNKS + 1];
+
+static struct zswap_entry *entries;
+static uint32_t num_entries;
+static uint32_t entry_hint;
+static uint32_t max_pool_pages;
+
+static uint8_t buffer[MAX_COMPRESSED];
+
+static struct zswap_stats stats;
+
+void
+zswap_init(
+    uint32_t max_pages)
+{
+    uint32_t size = max_pages * ENTRIES_PER_POOL_PAGE *
+                    sizeof(struct zswap_entry);
+
+    entries = kmalloc(size);
+    if (entries == NULL)
+    {
+        printk("zswap_init: Could not allocate entries. max_pages: %u\n",
+               max_pages);
+        return;
+    }
+    memset(entries, 0, size);
+
+    num_entries = max_pages * ENTRIES_PER_POOL_PAGE;
+    max_pool_pages = max_pages;
+
+    printk("zswap: Up to %u KB of compressed pages\n",
+           max_pages * (PAGE_SIZE / 1024));
+}
+
+static void
+partial_remove(
+    struct zpool_page *page)
+{
+    if (page->prev != NULL)
+    {
+        page->prev->next = page->next;
+    }
+    else
+    {
+        partial[page->chunks] = page->next;
+    }
+    if (page->next != NULL)
+    {
+        page->next->prev = page->prev;
+    }
+    page->prev = page->next = NULL;
+}
+
+static void
+partial_add(
+    struct zpool_page *page)
+{
+    page->prev = NULL;
+    page->next = partial[page->chunks];
+    if (page->next != NULL)
+    {
+        page->next->prev = page;
+    }
+    partial[page->chunks] = page;
+}
+
+static struct zpool_page *
+zpool_page_create(
+    uint32_t chunks)
+{
+    struct zpool_page *page;
+
+    if (stats.pool_pages == max_pool_pages)
+    {
+        return NULL;
+    }
+
+    page = kmalloc(sizeof(struct zpool_page));
+    if (page == NULL)
+    {
+        return NULL;
+    }
+
+    page->paddr = pfa_allocate(1);
+    if (page->paddr == 0)
+    {
+        kfree(page);
+        return NULL;
+    }
+
+    memset(page->used, 0, sizeof(page->used));
+    page->chunks = chunks;
+    page->free = CHUNKS_PER_PAGE / chunks;
+    partial_add(page);
+
+    ++stats.pool_pages;
+    return page;
+}
+
+/*
+ * Returns the pool page and object number for an object of size bytes.
+ */
+static struct zpool_page *
+zpool_alloc(
+    uint32_t size,
+    uint16_t *out_obj)
+{
+    uint32_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE, obj;
+    struct zpool_page *page = partial[chunks];
+
+    if (page == NULL && (page = zpool_page_create(chunks)) == NULL)
+    {
+        return NULL;
+    }
+
+    for (obj = 0; page->used[obj / 32] & (1u << (obj % 32)); ++obj);
+
+    page->used[obj / 32] |= 1u << (obj % 32);
+    if (--page->free == 0)
+    {
+        partial_remove(page);
+    }
+
+    *out_obj = obj;
+    return page;
+}
+
+static void
+zpool_free(
+    struct zpool_page *page,
+    uint16_t obj)
+{
+    page->used[obj / 32] &= ~(1u << (obj % 32));
+
+    if (page->free++ == 0)
+    {
+        partial_add(page);
+    }
+
+    if (page->free == CHUNKS_PER_PAGE / page->chunks)
+    {
+        partial_remove(page);
+        pfa_free(page->paddr);
+        kfree(page);
+        --stats.pool_pages;
+    }
+}
+
+static int
+entry_allocate(
+    uint32_t *out_index)
+{
+    uint32_t i, index;
+
+    for (i = 0; i < num_entries; ++i)
+    {
+        index = entry_hint + i;
+        if (index >= num_entries)
+        {
+            index -= num_entries;
+        }
+        if (entries[index].page == NULL)
+        {
+            entry_hint = index + 1;
+            *out_index = index;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+zswap_store(
+    paddr_t paddr,
+    uint32_t *out_index)
+{
+    struct zswap_entry *e;
+    uint32_t size, index;
+    uint8_t *p;
+
+    if (num_entries == 0)
+    {
+        return -1;
+    }
+
+    p = kmap_frame(paddr);
+    if (p == NULL)
+    {
+        return -1;
+    }
+    size = lz_compress(p, PAGE_SIZE, buffer, MAX_COMPRESSED);
+    kunmap_frame(p);
+
+    if (size == 0)
+    {
+        ++stats.rejected_incompressible;
+        return -1;
+    }
+
+    if (entry_allocate(&index) != 0)
+    {
+        ++stats.rejected_pool_full;
+        return -1;
+    }
+    e = entries + index;
+
+    e->page = zpool_alloc(size, &e->obj);
+    if (e->page == NULL)
+    {
+        ++stats.rejected_pool_full;
+        return -1;
+    }
+    e->size = size;
+
+    p = kmap_frame(e->page->paddr);
+    if (p == NULL)
+    {
+        zpool_free(e->page, e->obj);
+        e->page = NULL;
+        return -1;
+    }
+    memcpy(p + e->obj * e->page->chunks * CHUNK_SIZE, buffer, size);
+    kunmap_frame(p);
+
+    ++stats.stored_pages;
+    stats.compressed_bytes += size;
+
+    *out_index = index;
+    return 0;
+}
+
+int
+zswap_load(
+    uint32_t index,
+    paddr_t paddr)
+{
+    struct zswap_entry *e = entries + index;
+    uint8_t *src, *dst;
+    int32_t size = -1;
+
+    if (index >= num_entries || e->page == NULL)
+    {
+        printk("zswap_load: No such entry. index: %u\n", index);
+        return -1;
+    }
+
+    src = kmap_frame(e->page->paddr);
+    if (src == NULL)
+    {
+        return -1;
+    }
+    dst = kmap_frame(paddr);
+    if (dst != NULL)
+    {
+        size = lz_decompress(src + e->obj * e->page->chunks * CHUNK_SIZE,
+                             e->size, dst, PAGE_SIZE);
+        kunmap_frame(dst);
+    }
+    kunmap_frame(src);
+
+    if (size != PAGE_SIZE)
+    {
+        printk("zswap_load: Could not decompress entry. index: %u\n", index);
+        return -1;
+    }
+
+    zpool_free(e->page, e->obj);
+    e->page = NULL;
+
+    --stats.stored_pages;
+    stats.compressed_bytes -= e->size;
+    ++stats.loads;
+    return 0;
+}
+
+void
+zswap_get_stats(
+    struct zswap_stats *s)
+{
+    *s = stats;
+}
@@ -2,9 +2,11 @@
 
 #include <newbos/printk.h>
 
+#include "interrupts.h"
+
 void
 abort(void)
 {
     printk("abort()\n");
-    for (;;);
+    halt_forever();
 }